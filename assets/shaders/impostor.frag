@@ -0,0 +1,22 @@
+#version 330 core
+in vec3 object_color;
+
+out vec4 frag_color;
+
+void main() {
+    // the sphere is only shaded, its normal follows from the point coordinate
+    vec2 offset = gl_PointCoord * 2.0 - 1.0;
+    float squared = dot(offset, offset);
+    if (squared > 1.0) {
+        discard;
+    }
+
+    vec3 norm = vec3(offset.x, -offset.y, sqrt(1.0 - squared));
+    vec4 light_color = vec4(0.7, 0.7, 0.7, 1.0);
+    vec4 color = vec4(object_color.xyz, 1.0f);
+
+    vec3 light_direction = normalize(vec3(0.0, 1.0, 1.0));
+    float diff = max(dot(norm, light_direction), 0.0);
+
+    frag_color = color + diff * light_color;
+}
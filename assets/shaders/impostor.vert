@@ -0,0 +1,18 @@
+#version 330 core
+layout (location = 2) in vec3 instance_position;
+layout (location = 3) in float instance_scale;
+layout (location = 4) in vec3 instance_color;
+
+uniform mat4 view;
+uniform mat4 projection;
+uniform float radius; // of the model
+uniform float point_scale; // pixels of a unit radius at unit distance
+
+out vec3 object_color;
+
+void main() {
+    vec4 view_pos = view * vec4(instance_position, 1.0);
+    gl_Position = projection * view_pos;
+    gl_PointSize = max(2.0 * radius * instance_scale * point_scale / -view_pos.z, 1.0);
+    object_color = instance_color;
+}
@@ -0,0 +1,20 @@
+#version 330 core
+layout (location = 0) in vec3 pos;
+layout (location = 1) in vec3 normal;
+layout (location = 2) in vec3 instance_position;
+layout (location = 3) in float instance_scale;
+layout (location = 4) in vec3 instance_color;
+
+uniform mat4 view;
+uniform mat4 projection;
+
+out vec4 frag_pos;
+out vec4 frag_normal;
+out vec3 object_color;
+
+void main() {
+    gl_Position = projection * view * vec4(pos.xyz * instance_scale + instance_position, 1.0);
+    frag_pos = gl_Position;
+    frag_normal = vec4(normal.xyz + instance_position, 1.0);
+    object_color = instance_color;
+}
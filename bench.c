@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "body.h"
+#include "math.h"
+#include "octree.h"
+#include "pm.h"
+#include "workers.h"
+
+#define BENCH_DEFAULT_SEED 1
+#define BENCH_DEFAULT_REPEATS 3
+#define BENCH_DEFAULT_SAMPLE 1024 // bodies checked against the reference
+#define BENCH_MAX_SIZES 32
+#define BENCH_CUBE_SIDE 1000.0
+#define BENCH_PLUMMER_RADIUS 100.0
+
+enum distribution {
+    DISTRIBUTION_UNIFORM, // cube of side BENCH_CUBE_SIDE
+    DISTRIBUTION_PLUMMER, // plummer sphere, dense core and sparse halo
+};
+
+enum format {
+    FORMAT_CSV,
+    FORMAT_JSON,
+};
+
+// one force path with one setting
+struct bench_solver {
+    const char *solver;
+    const char *setting;
+    const char *kernel; // direct only
+    float theta; // barnes-hut only
+    int grid; // particle mesh only
+};
+
+static struct bench_solver bench_solvers[] = {
+    { "direct", "avx2", "avx2", 0.0f, 0 },
+    { "direct", "sse", "sse", 0.0f, 0 },
+    { "direct", "scalar", "scalar", 0.0f, 0 },
+    { "barnes-hut", "theta=0.3", NULL, 0.3f, 0 },
+    { "barnes-hut", "theta=0.5", NULL, 0.5f, 0 },
+    { "barnes-hut", "theta=0.8", NULL, 0.8f, 0 },
+    { "pm", "grid=32", NULL, 0.0f, 32 },
+    { "pm", "grid=64", NULL, 0.0f, 64 },
+    { "pm", "grid=128", NULL, 0.0f, 128 },
+};
+
+long bench_sizes[BENCH_MAX_SIZES] = { 1024, 4096, 16384 };
+int bench_sizes_num = 3;
+unsigned long bench_seed = BENCH_DEFAULT_SEED;
+int bench_repeats = BENCH_DEFAULT_REPEATS;
+long bench_sample = BENCH_DEFAULT_SAMPLE;
+int bench_threads = 0; // 0 for one per cpu
+const char *bench_only = NULL; // run only this solver
+enum distribution bench_distribution = DISTRIBUTION_UNIFORM;
+enum format bench_format = FORMAT_CSV;
+const char *bench_output_path = NULL; // stdout if NULL
+
+static const char *distribution_names[] = {
+    [DISTRIBUTION_UNIFORM] = "uniform",
+    [DISTRIBUTION_PLUMMER] = "plummer",
+};
+
+// splitmix64, its own state so runs only depend on the seed
+static unsigned long rng_state;
+
+static double random_uniform(void) {
+    unsigned long z = (rng_state += 0x9e3779b97f4a7c15UL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+    z ^= z >> 31;
+
+    return (double) (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int generate_bodies(long num) {
+    bodies.num = 0;
+    if (reserve_bodies(num) == -1) {
+        return -1;
+    }
+
+    rng_state = bench_seed;
+
+    for (long i = 0; i < num; i++) {
+        long body = create_body(1.0f + (float) random_uniform());
+
+        if (bench_distribution == DISTRIBUTION_PLUMMER) {
+            // inverse of the cumulative mass, capped to keep the halo finite
+            double mass_fraction = 0.001 + 0.998 * random_uniform();
+            double radius = BENCH_PLUMMER_RADIUS / sqrt(pow(mass_fraction, -2.0/3.0) - 1.0);
+            double cos_theta = 2.0 * random_uniform() - 1.0;
+            double sin_theta = sqrt(1.0 - cos_theta*cos_theta);
+            double phi = 2.0 * M_PI * random_uniform();
+
+            bodies.x[body] = radius * sin_theta * cos(phi);
+            bodies.y[body] = radius * sin_theta * sin(phi);
+            bodies.z[body] = radius * cos_theta;
+        } else {
+            bodies.x[body] = BENCH_CUBE_SIDE * random_uniform();
+            bodies.y[body] = BENCH_CUBE_SIDE * random_uniform();
+            bodies.z[body] = BENCH_CUBE_SIDE * random_uniform();
+        }
+    }
+
+    return 0;
+}
+
+// double precision direct sum for every sample body
+static void reference_accelerations(long samples_num, long stride, double *reference) {
+    const double constant = (double) GRAVITY_CONSTANT * FORCE_SCALE;
+
+    for (long s = 0; s < samples_num; s++) {
+        long i = s * stride;
+        double acceleration[3] = { 0.0, 0.0, 0.0 };
+
+        for (long j = 0; j < bodies.num; j++) {
+            double dx = (double) bodies.x[j] - bodies.x[i];
+            double dy = (double) bodies.y[j] - bodies.y[i];
+            double dz = (double) bodies.z[j] - bodies.z[i];
+            double distance = sqrt(dx*dx + dy*dy + dz*dz);
+
+            if (distance == 0.0) {
+                continue;
+            }
+
+            double scale = constant * bodies.mass[j] / distance;
+            acceleration[0] += dx * scale;
+            acceleration[1] += dy * scale;
+            acceleration[2] += dz * scale;
+        }
+
+        memcpy(&reference[s*3], acceleration, sizeof(acceleration));
+    }
+}
+
+static int run_solver(struct bench_solver *solver) {
+    if (strcmp(solver->solver, "barnes-hut") == 0) {
+        return octree_accelerations(&bodies, solver->theta);
+    }
+
+    if (strcmp(solver->solver, "pm") == 0) {
+        return pm_accelerations(&bodies, solver->grid);
+    }
+
+    return calculate_accelerations(&bodies);
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end) {
+    return (double) (end->tv_sec - start->tv_sec) + (double) (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+struct bench_result {
+    double seconds; // best of all repeats
+    double rms_error; // relative to the reference, over all samples
+    double max_error; // largest relative error of a single body
+};
+
+static int measure(struct bench_solver *solver, long samples_num, long stride, const double *reference, struct bench_result *result) {
+    result->seconds = -1.0;
+
+    for (int repeat = 0; repeat < bench_repeats; repeat++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (run_solver(solver) == -1) {
+            return -1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = elapsed_seconds(&start, &end);
+        if (result->seconds < 0.0 || seconds < result->seconds) {
+            result->seconds = seconds;
+        }
+    }
+
+    double error_sum = 0.0;
+    double reference_sum = 0.0;
+    result->max_error = 0.0;
+
+    for (long s = 0; s < samples_num; s++) {
+        long i = s * stride;
+        double dx = bodies.ax[i] - reference[s*3];
+        double dy = bodies.ay[i] - reference[s*3+1];
+        double dz = bodies.az[i] - reference[s*3+2];
+        double error = dx*dx + dy*dy + dz*dz;
+        double magnitude = reference[s*3]*reference[s*3] + reference[s*3+1]*reference[s*3+1] + reference[s*3+2]*reference[s*3+2];
+
+        error_sum += error;
+        reference_sum += magnitude;
+
+        if (magnitude > 0.0 && sqrt(error / magnitude) > result->max_error) {
+            result->max_error = sqrt(error / magnitude);
+        }
+    }
+
+    result->rms_error = (reference_sum > 0.0) ? sqrt(error_sum / reference_sum) : 0.0;
+    return 0;
+}
+
+static void print_header(FILE *output) {
+    if (bench_format == FORMAT_JSON) {
+        fprintf(output, "[\n");
+        return;
+    }
+
+    fprintf(output, "solver,setting,distribution,bodies,threads,seconds,ns_per_body_step,pairs_per_sec,rms_rel_error,max_rel_error\n");
+}
+
+static void print_result(FILE *output, struct bench_solver *solver, long num, struct bench_result *result, int first) {
+    double ns_per_body = result->seconds * 1e9 / (double) num;
+    double pairs_per_sec = (result->seconds > 0.0) ? (double) num * (double) (num - 1) / result->seconds : 0.0;
+
+    if (bench_format == FORMAT_JSON) {
+        fprintf(output, "%s  {\"solver\": \"%s\", \"setting\": \"%s\", \"distribution\": \"%s\", \"bodies\": %ld, \"threads\": %d, "
+                "\"seconds\": %.9g, \"ns_per_body_step\": %.6g, \"pairs_per_sec\": %.6g, \"rms_rel_error\": %.6g, \"max_rel_error\": %.6g}",
+                (first == 1) ? "" : ",\n", solver->solver, solver->setting, distribution_names[bench_distribution], num, workers_num(),
+                result->seconds, ns_per_body, pairs_per_sec, result->rms_error, result->max_error);
+        return;
+    }
+
+    fprintf(output, "%s,%s,%s,%ld,%d,%.9g,%.6g,%.6g,%.6g,%.6g\n", solver->solver, solver->setting, distribution_names[bench_distribution], num, workers_num(),
+            result->seconds, ns_per_body, pairs_per_sec, result->rms_error, result->max_error);
+}
+
+static void print_footer(FILE *output) {
+    if (bench_format == FORMAT_JSON) {
+        fprintf(output, "\n]\n");
+    }
+}
+
+static int parse_sizes(const char *list) {
+    bench_sizes_num = 0;
+
+    while (*list != '\0') {
+        char *end;
+        long size = strtol(list, &end, 10);
+
+        if (end == list || size < 2 || bench_sizes_num == BENCH_MAX_SIZES) {
+            fprintf(stderr, "Error: invalid list of body counts '%s'\n", list);
+            return -1;
+        }
+
+        bench_sizes[bench_sizes_num++] = size;
+        list = (*end == ',') ? end + 1 : end;
+    }
+
+    return (bench_sizes_num > 0) ? 0 : -1;
+}
+
+// options that take a value, --help is the only one without
+static const char *bench_options[][2] = {
+    { "--sizes <n,n,...>", "body counts (default 1024,4096,16384)" },
+    { "--distribution <name>", "uniform (default) or plummer" },
+    { "--seed <num>", "seed of the bodies (default 1)" },
+    { "--solver <name>", "only direct, barnes-hut or pm" },
+    { "--repeats <num>", "evaluations per solver, the fastest is reported (default 3)" },
+    { "--sample <num>", "bodies compared against a double precision direct sum (default 1024)" },
+    { "--threads <num>", "threads (default: one per cpu)" },
+    { "--format <name>", "csv (default) or json" },
+    { "--output <file>", "write the report to a file" },
+};
+
+static void print_usage(FILE *fp) {
+    fprintf(fp, "Usage: gravity_bench [options]\n");
+    for (unsigned long i = 0; i < sizeof(bench_options)/sizeof(bench_options[0]); i++) {
+        fprintf(fp, "    %-24s%s\n", bench_options[i][0], bench_options[i][1]);
+    }
+    fprintf(fp, "    %-24s%s\n", "--help", "print this and exit");
+}
+
+static int known_option(const char *arg) {
+    for (unsigned long i = 0; i < sizeof(bench_options)/sizeof(bench_options[0]); i++) {
+        const char *name = bench_options[i][0];
+        size_t length = strcspn(name, " ");
+
+        if (strlen(arg) == length && strncmp(arg, name, length) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// 1 when only the usage was asked for
+int parse_arguments(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            print_usage(stdout);
+            return 1;
+        }
+
+        if (!known_option(argv[i])) {
+            fprintf(stderr, "Error: unknown option '%s'\n", argv[i]);
+            print_usage(stderr);
+            return -1;
+        }
+
+        if (i+1 >= argc) {
+            fprintf(stderr, "Error: '%s' expects a value\n", argv[i]);
+            return -1;
+        }
+
+        if (strcmp(argv[i], "--sizes") == 0) {
+            if (parse_sizes(argv[++i]) == -1) {
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            bench_seed = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--repeats") == 0) {
+            bench_repeats = atoi(argv[++i]);
+            if (bench_repeats < 1) {
+                fprintf(stderr, "Error: invalid number of repeats '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--sample") == 0) {
+            bench_sample = atol(argv[++i]);
+            if (bench_sample < 1) {
+                fprintf(stderr, "Error: invalid sample size '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            bench_threads = atoi(argv[++i]);
+            if (bench_threads < 0) {
+                fprintf(stderr, "Error: invalid number of threads '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--solver") == 0) {
+            bench_only = argv[++i];
+        } else if (strcmp(argv[i], "--distribution") == 0) {
+            i++;
+            if (strcmp(argv[i], "uniform") == 0) {
+                bench_distribution = DISTRIBUTION_UNIFORM;
+            } else if (strcmp(argv[i], "plummer") == 0) {
+                bench_distribution = DISTRIBUTION_PLUMMER;
+            } else {
+                fprintf(stderr, "Error: unknown distribution '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--format") == 0) {
+            i++;
+            if (strcmp(argv[i], "csv") == 0) {
+                bench_format = FORMAT_CSV;
+            } else if (strcmp(argv[i], "json") == 0) {
+                bench_format = FORMAT_JSON;
+            } else {
+                fprintf(stderr, "Error: unknown format '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--output") == 0) {
+            bench_output_path = argv[++i];
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int parsed = parse_arguments(argc, argv);
+    if (parsed != 0) {
+        return (parsed == 1) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (workers_init(bench_threads) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    FILE *output = stdout;
+    if (bench_output_path != NULL) {
+        output = fopen(bench_output_path, "w");
+        if (output == NULL) {
+            fprintf(stderr, "Error: cannot open '%s' for writing\n", bench_output_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int status = EXIT_FAILURE;
+    double *reference = NULL;
+    int first = 1;
+
+    print_header(output);
+
+    for (int size = 0; size < bench_sizes_num; size++) {
+        long num = bench_sizes[size];
+        long samples_num = (bench_sample < num) ? bench_sample : num;
+        long stride = num / samples_num;
+
+        if (generate_bodies(num) == -1) {
+            goto end;
+        }
+
+        double *new_reference = (double *) reallocarray(reference, samples_num*3, sizeof(double));
+        if (new_reference == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for reference accelerations\n");
+            goto end;
+        }
+
+        reference = new_reference;
+        reference_accelerations(samples_num, stride, reference);
+
+        for (unsigned long s = 0; s < sizeof(bench_solvers)/sizeof(bench_solvers[0]); s++) {
+            struct bench_solver *solver = &bench_solvers[s];
+
+            if (bench_only != NULL && strcmp(bench_only, solver->solver) != 0) {
+                continue;
+            }
+
+            // kernels the cpu lacks are skipped, not reported
+            if (solver->kernel != NULL && select_gravity_kernel(solver->kernel) != 0) {
+                continue;
+            }
+
+            struct bench_result result;
+            if (measure(solver, samples_num, stride, reference, &result) == -1) {
+                goto end;
+            }
+
+            print_result(output, solver, num, &result, first);
+            fflush(output);
+            first = 0;
+        }
+    }
+
+    print_footer(output);
+    status = EXIT_SUCCESS;
+
+end:
+    free(reference);
+    if (output != stdout) {
+        fclose(output);
+    }
+
+    return status;
+}
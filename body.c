@@ -0,0 +1,111 @@
+#include "body.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cglm/cglm.h>
+
+struct bodies bodies;
+
+static int grow_array(float **array, long max) {
+    float *new_array = (float *) reallocarray(*array, max, sizeof(float));
+    if (new_array == NULL) {
+        return -1;
+    }
+
+    *array = new_array;
+    return 0;
+}
+
+static int grow_bodies(long max) {
+    float **arrays[] = {
+        &bodies.x, &bodies.y, &bodies.z,
+        &bodies.vx, &bodies.vy, &bodies.vz,
+        &bodies.ax, &bodies.ay, &bodies.az,
+        &bodies.mass,
+    };
+
+    for (unsigned long i = 0; i < sizeof(arrays)/sizeof(arrays[0]); i++) {
+        if (grow_array(arrays[i], max) == -1) {
+            fprintf(stderr, "Error: failed allocating memory for bodies\n");
+            return -1;
+        }
+    }
+
+    long *id = (long *) reallocarray(bodies.id, max, sizeof(long));
+    if (id == NULL) {
+        fprintf(stderr, "Error: failed allocating memory for bodies\n");
+        return -1;
+    }
+
+    bodies.id = id;
+    bodies.max = max;
+    return 0;
+}
+
+// make room for at least num bodies in total
+int reserve_bodies(long num) {
+    if (num <= bodies.max) {
+        return 0;
+    }
+
+    long max = (bodies.max == 0) ? BODIES_INITIAL_MAX : bodies.max;
+    while (max < num) {
+        max *= 2;
+    }
+
+    return grow_bodies(max);
+}
+
+long create_body(float mass) {
+    if (reserve_bodies(bodies.num + 1) == -1) {
+        return -1;
+    }
+
+    long body = bodies.num++;
+
+    // initialize default values
+    bodies.x[body] = 1.0f;
+    bodies.y[body] = 1.0f;
+    bodies.z[body] = 1.0f;
+    bodies.vx[body] = 0.0f;
+    bodies.vy[body] = 0.0f;
+    bodies.vz[body] = 0.0f;
+    bodies.ax[body] = 0.0f;
+    bodies.ay[body] = 0.0f;
+    bodies.az[body] = 0.0f;
+    bodies.mass[body] = mass;
+    bodies.id[body] = bodies.next_id++;
+
+    return body;
+}
+
+// ids for the bodies added from first on without create_body
+void number_bodies(long first) {
+    for (long body = first; body < bodies.num; body++) {
+        bodies.id[body] = bodies.next_id++;
+    }
+}
+
+void body_position(long body, vec3 dest) {
+    dest[0] = bodies.x[body];
+    dest[1] = bodies.y[body];
+    dest[2] = bodies.z[body];
+}
+
+void body_velocity(long body, vec3 dest) {
+    dest[0] = bodies.vx[body];
+    dest[1] = bodies.vy[body];
+    dest[2] = bodies.vz[body];
+}
+
+void translate_body(long body, vec3 offset) {
+    bodies.x[body] += offset[0];
+    bodies.y[body] += offset[1];
+    bodies.z[body] += offset[2];
+}
+
+void boost_body(long body, vec3 boost) {
+    bodies.vx[body] += boost[0];
+    bodies.vy[body] += boost[1];
+    bodies.vz[body] += boost[2];
+}
@@ -0,0 +1,42 @@
+#ifndef BODY_H
+#define BODY_H
+
+#include <cglm/cglm.h>
+
+#define BODIES_INITIAL_MAX 64
+
+// physics state of all bodies, stored as contiguous arrays so that the
+// force loop only streams through the data it actually needs
+struct bodies {
+    float *x;
+    float *y;
+    float *z;
+
+    float *vx; // velocity
+    float *vy;
+    float *vz;
+
+    float *ax; // acceleration of the last force evaluation
+    float *ay;
+    float *az;
+
+    float *mass;
+
+    long *id; // kept for the lifetime of a body, increasing with the index
+    long next_id;
+
+    long num;
+    long max;
+};
+
+extern struct bodies bodies;
+
+int reserve_bodies(long num);
+long create_body(float mass);
+void number_bodies(long first);
+void body_position(long body, vec3 dest);
+void body_velocity(long body, vec3 dest);
+void translate_body(long body, vec3 offset);
+void boost_body(long body, vec3 boost);
+
+#endif
@@ -0,0 +1,382 @@
+#include "collision.h"
+
+#include "body.h"
+#include "object.h"
+#include "simulation.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int collisions_enabled = 0;
+long collisions_merged = 0; // bodies removed by mergers since the start
+
+static struct spatial_hash hash;
+static float *radius;
+static struct object **owners; // object of every body, NULL if it has none
+static long *parent; // union find of colliding bodies, roots survive
+static long *remap; // new index of every body after the removal
+static long scratch_max;
+
+static int reserve_scratch(long num) {
+    if (num <= scratch_max) {
+        return 0;
+    }
+
+    long buckets_num = 2;
+    while (buckets_num < 4*num) {
+        buckets_num *= 2;
+    }
+
+    float *new_radius = (float *) reallocarray(radius, num, sizeof(float));
+    if (new_radius != NULL) {
+        radius = new_radius;
+    }
+
+    struct object **new_owners = (struct object **) reallocarray(owners, num, sizeof(struct object *));
+    if (new_owners != NULL) {
+        owners = new_owners;
+    }
+
+    long *new_parent = (long *) reallocarray(parent, num, sizeof(long));
+    if (new_parent != NULL) {
+        parent = new_parent;
+    }
+
+    long *new_remap = (long *) reallocarray(remap, num, sizeof(long));
+    if (new_remap != NULL) {
+        remap = new_remap;
+    }
+
+    long *new_cells = (long *) reallocarray(hash.cells, num, sizeof(long));
+    if (new_cells != NULL) {
+        hash.cells = new_cells;
+    }
+
+    long *new_large = (long *) reallocarray(hash.large, num, sizeof(long));
+    if (new_large != NULL) {
+        hash.large = new_large;
+    }
+
+    long *new_starts = (long *) reallocarray(hash.starts, buckets_num+1, sizeof(long));
+    if (new_starts != NULL) {
+        hash.starts = new_starts;
+    }
+
+    if (new_radius == NULL || new_owners == NULL || new_parent == NULL || new_remap == NULL || new_cells == NULL || new_large == NULL || new_starts == NULL) {
+        fprintf(stderr, "Error: failed allocating memory for collisions\n");
+        return -1;
+    }
+
+    hash.buckets_num = buckets_num;
+    hash.shift = 64 - __builtin_ctzl(buckets_num);
+    scratch_max = num;
+    return 0;
+}
+
+// bounding radius of the model vertices, at scale 1
+static float model_radius(struct model *model) {
+    if (model == NULL || model->radius <= 0.0f) {
+        return COLLISION_DEFAULT_RADIUS;
+    }
+
+    return model->radius;
+}
+
+static long cell_coordinate(float position) {
+    return (long) floorf(position / hash.cell_size);
+}
+
+// multiplicative hash, the top bits of the product are well mixed
+static long bucket(long x, long y, long z) {
+    unsigned long key = (unsigned long) x * 0x9e3779b97f4a7c15UL + (unsigned long) y * 0xc2b2ae3d27d4eb4fUL + (unsigned long) z * 0x165667b19e3779f9UL;
+    return (key * 0xbf58476d1ce4e5b9UL) >> hash.shift;
+}
+
+// the radius at or above the typical share of all radii, rounded up to a
+// power of two
+static float typical_radius(void) {
+    long counts[COLLISION_RADIUS_CLASSES] = { 0 };
+
+    for (long i = 0; i < bodies.num; i++) {
+        int exponent;
+        frexpf(radius[i], &exponent);
+        exponent += COLLISION_RADIUS_CLASSES / 2;
+        counts[(exponent < 0) ? 0 : (exponent >= COLLISION_RADIUS_CLASSES) ? COLLISION_RADIUS_CLASSES - 1 : exponent]++;
+    }
+
+    long typical = (long) ceil(bodies.num * COLLISION_TYPICAL_SHARE);
+    long seen = 0;
+    int class = 0;
+
+    for (; class < COLLISION_RADIUS_CLASSES - 1; class++) {
+        seen += counts[class];
+        if (seen >= typical) {
+            break;
+        }
+    }
+
+    return ldexpf(1.0f, class - COLLISION_RADIUS_CLASSES / 2);
+}
+
+// counting sort of the bodies that fit the cells by the bucket of their
+// cell, the others go to the large list. remap holds the bucket of every
+// body until the removal.
+static void build_hash(void) {
+    memset(hash.starts, 0, (hash.buckets_num+1)*sizeof(long));
+    hash.cells_num = 0;
+    hash.large_num = 0;
+
+    for (long i = 0; i < bodies.num; i++) {
+        if (2.0f * radius[i] > hash.cell_size) {
+            hash.large[hash.large_num++] = i;
+            continue;
+        }
+
+        remap[i] = bucket(cell_coordinate(bodies.x[i]), cell_coordinate(bodies.y[i]), cell_coordinate(bodies.z[i]));
+        hash.starts[remap[i]+1]++;
+        hash.cells_num++;
+    }
+
+    for (long b = 0; b < hash.buckets_num; b++) {
+        hash.starts[b+1] += hash.starts[b];
+    }
+
+    for (long i = 0; i < bodies.num; i++) {
+        if (2.0f * radius[i] <= hash.cell_size) {
+            hash.cells[hash.starts[remap[i]]++] = i;
+        }
+    }
+
+    // filling moved every start to the end of its bucket
+    memmove(hash.starts+1, hash.starts, hash.buckets_num*sizeof(long));
+    hash.starts[0] = 0;
+}
+
+static long find_root(long i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+
+    return i;
+}
+
+// the heavier body survives, the lower index on a tie
+static void join(long i, long j) {
+    long a = find_root(i);
+    long b = find_root(j);
+
+    if (a == b) {
+        return;
+    }
+
+    if (bodies.mass[b] > bodies.mass[a] || (bodies.mass[b] == bodies.mass[a] && b < a)) {
+        long swap = a;
+        a = b;
+        b = swap;
+    }
+
+    parent[b] = a;
+}
+
+static int touch(long i, long j) {
+    float dx = bodies.x[j] - bodies.x[i];
+    float dy = bodies.y[j] - bodies.y[i];
+    float dz = bodies.z[j] - bodies.z[i];
+    float reach = radius[i] + radius[j];
+
+    if (dx*dx + dy*dy + dz*dz < reach*reach && find_root(i) != find_root(j)) {
+        join(i, j);
+        return 1;
+    }
+
+    return 0;
+}
+
+// a large body against the bodies of every cell its reach overlaps, or
+// against all of them once those are fewer than the cells
+static long find_large_collisions(long i) {
+    float reach = radius[i] + hash.cell_size / 2.0f;
+    long low[3] = { cell_coordinate(bodies.x[i] - reach), cell_coordinate(bodies.y[i] - reach), cell_coordinate(bodies.z[i] - reach) };
+    long high[3] = { cell_coordinate(bodies.x[i] + reach), cell_coordinate(bodies.y[i] + reach), cell_coordinate(bodies.z[i] + reach) };
+    double cells = (double) (high[0] - low[0] + 1) * (high[1] - low[1] + 1) * (high[2] - low[2] + 1);
+    long joined = 0;
+
+    if (cells >= (double) hash.cells_num) {
+        for (long n = 0; n < hash.cells_num; n++) {
+            joined += touch(i, hash.cells[n]);
+        }
+
+        return joined;
+    }
+
+    for (long x = low[0]; x <= high[0]; x++) {
+        for (long y = low[1]; y <= high[1]; y++) {
+            for (long z = low[2]; z <= high[2]; z++) {
+                long b = bucket(x, y, z);
+
+                for (long k = hash.starts[b]; k < hash.starts[b+1]; k++) {
+                    joined += touch(i, hash.cells[k]);
+                }
+            }
+        }
+    }
+
+    return joined;
+}
+
+// narrow phase against the bodies of the 27 surrounding cells, bodies are
+// visited bucket by bucket so the neighbouring buckets stay in cache. the
+// few large bodies are tested against each other and the cells they reach.
+static long find_collisions(void) {
+    long joined = 0;
+
+    for (long a = 0; a < hash.large_num; a++) {
+        for (long b = a+1; b < hash.large_num; b++) {
+            joined += touch(hash.large[a], hash.large[b]);
+        }
+
+        joined += find_large_collisions(hash.large[a]);
+    }
+
+    for (long n = 0; n < hash.cells_num; n++) {
+        long i = hash.cells[n];
+        long cx = cell_coordinate(bodies.x[i]);
+        long cy = cell_coordinate(bodies.y[i]);
+        long cz = cell_coordinate(bodies.z[i]);
+
+        for (long x = cx-1; x <= cx+1; x++) {
+            for (long y = cy-1; y <= cy+1; y++) {
+                for (long z = cz-1; z <= cz+1; z++) {
+                    long b = bucket(x, y, z);
+
+                    for (long k = hash.starts[b]; k < hash.starts[b+1]; k++) {
+                        long j = hash.cells[k];
+                        if (j > i) {
+                            joined += touch(i, j);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    return joined;
+}
+
+// fold every body into the survivor of its group, conserving mass and
+// momentum, the survivor keeps the combined volume
+static void merge_bodies(void) {
+    for (long i = 0; i < bodies.num; i++) {
+        long root = find_root(i);
+        if (root == i) {
+            continue;
+        }
+
+        float mass = bodies.mass[root] + bodies.mass[i];
+        float share = (mass > 0.0f) ? bodies.mass[i] / mass : 0.5f;
+
+        bodies.x[root] += (bodies.x[i] - bodies.x[root]) * share;
+        bodies.y[root] += (bodies.y[i] - bodies.y[root]) * share;
+        bodies.z[root] += (bodies.z[i] - bodies.z[root]) * share;
+        bodies.vx[root] += (bodies.vx[i] - bodies.vx[root]) * share;
+        bodies.vy[root] += (bodies.vy[i] - bodies.vy[root]) * share;
+        bodies.vz[root] += (bodies.vz[i] - bodies.vz[root]) * share;
+        bodies.mass[root] = mass;
+
+        radius[root] = cbrtf(radius[root]*radius[root]*radius[root] + radius[i]*radius[i]*radius[i]);
+    }
+
+    for (long i = 0; i < bodies.num; i++) {
+        struct object *obj = owners[i];
+        if (find_root(i) == i && obj != NULL) {
+            obj->scale = radius[i] / model_radius(obj->model);
+        }
+    }
+}
+
+// compact the body storage in order and hand the objects of merged bodies
+// over to the renderer, which releases their buffers
+static long remove_merged(void) {
+    long num = 0;
+
+    for (long i = 0; i < bodies.num; i++) {
+        if (parent[i] != i) {
+            continue;
+        }
+
+        remap[i] = num;
+        bodies.x[num] = bodies.x[i];
+        bodies.y[num] = bodies.y[i];
+        bodies.z[num] = bodies.z[i];
+        bodies.vx[num] = bodies.vx[i];
+        bodies.vy[num] = bodies.vy[i];
+        bodies.vz[num] = bodies.vz[i];
+        bodies.ax[num] = bodies.ax[i];
+        bodies.ay[num] = bodies.ay[i];
+        bodies.az[num] = bodies.az[i];
+        bodies.mass[num] = bodies.mass[i];
+        bodies.id[num] = bodies.id[i];
+        num++;
+    }
+
+    for (long i = 0; i < bodies.num; i++) {
+        if (parent[i] != i) {
+            remap[i] = remap[find_root(i)];
+        }
+    }
+
+    for (struct object *obj = first_object(); obj != NULL; obj = next_object(obj)) {
+        int merged = parent[obj->body] != obj->body;
+
+        // retired objects point at the survivor
+        obj->body = remap[obj->body];
+
+        // the state of the running step is the first without it
+        if (merged) {
+            retire_object(obj, simulation_steps + 1);
+        }
+    }
+
+    long removed = bodies.num - num;
+    bodies.num = num;
+    return removed;
+}
+
+// merge all overlapping bodies, returns the number of removed bodies
+int resolve_collisions(void) {
+    if (bodies.num < 2) {
+        return 0;
+    }
+
+    if (reserve_scratch(bodies.num) == -1) {
+        return -1;
+    }
+
+    for (long i = 0; i < bodies.num; i++) {
+        radius[i] = COLLISION_DEFAULT_RADIUS;
+        owners[i] = NULL;
+        parent[i] = i;
+    }
+
+    for (struct object *obj = first_object(); obj != NULL; obj = next_object(obj)) {
+        radius[obj->body] = obj->scale * model_radius(obj->model);
+        owners[obj->body] = obj;
+    }
+
+    // any two touching bodies that fit the cells are at most one cell apart
+    hash.cell_size = 2.0f * typical_radius();
+    build_hash();
+
+    if (find_collisions() == 0) {
+        return 0;
+    }
+
+    merge_bodies();
+
+    long removed = remove_merged();
+    collisions_merged += removed;
+
+    return removed;
+}
@@ -0,0 +1,27 @@
+#ifndef COLLISION_H
+#define COLLISION_H
+
+#define COLLISION_DEFAULT_RADIUS 1.0f // bodies without an object, unit sphere at scale 1
+#define COLLISION_TYPICAL_SHARE 0.99 // bodies the cells are sized for, larger ones are tested on their own
+#define COLLISION_RADIUS_CLASSES 256 // powers of two the radii are counted by
+
+// spatial hash of the broad phase, cells are as wide as a typical body so
+// that a few large ones do not put everything into the same cells
+struct spatial_hash {
+    long *cells; // bodies that fit the cells, sorted by the bucket of their cell
+    long cells_num;
+    long *starts; // first entry in cells of every bucket, buckets_num+1 entries
+    long buckets_num; // power of two
+    int shift; // leaves the bucket in the top bits of a hash
+    float cell_size;
+
+    long *large; // bodies wider than a cell
+    long large_num;
+};
+
+extern int collisions_enabled;
+extern long collisions_merged;
+
+int resolve_collisions(void);
+
+#endif
@@ -0,0 +1,835 @@
+#define _GNU_SOURCE // cpu sets and affinity
+
+#include "domain.h"
+
+#include "body.h"
+#include "math.h"
+#include "octree.h"
+#include "pm.h"
+#include "simulation.h"
+#include "workers.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <math.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int domain_processes = 1; // processes the bodies are split across, 1 for none
+
+static struct domains domains;
+static pid_t coordinator;
+
+// what a domain process keeps of its own bodies, which are the first
+// entries of its bodies, followed by the bodies and summaries of the
+// other domains while the forces are computed
+struct domain_worker {
+    int index;
+    long generation; // of the mapped data segment
+    long num; // own bodies
+    long *list; // 0..num-1, the bodies the forces are computed for
+    long list_max;
+    int accelerated; // accelerations belong to the current positions
+    long rounds; // exchanges taken part in
+};
+
+static struct domain_worker worker;
+
+struct copy {
+    float **from;
+    float **to;
+    int arrays;
+    long num;
+};
+
+static void wake_barrier(struct domain_barrier *barrier) {
+    syscall(SYS_futex, &barrier->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void fail(void) {
+    struct domain_control *control = domains.control;
+
+    atomic_store(&control->failed, 1);
+    wake_barrier(&control->steps);
+    wake_barrier(&control->exchange);
+}
+
+// the coordinator notices domain processes that exited, a domain process
+// notices the coordinator exiting
+static int others_alive(void) {
+    if (getpid() != coordinator) {
+        return getppid() == coordinator;
+    }
+
+    for (int i = 0; i < domains.processes_num; i++) {
+        if (domains.processes[i] > 0 && waitpid(domains.processes[i], NULL, WNOHANG) != 0) {
+            fprintf(stderr, "Error: domain process %d exited\n", i);
+            domains.processes[i] = 0;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// returns -1 if the run failed or is stopping instead
+static int wait_barrier(struct domain_barrier *barrier) {
+    struct domain_control *control = domains.control;
+    unsigned int generation = atomic_load(&barrier->generation);
+
+    if (atomic_fetch_add(&barrier->arrived, 1) + 1 == barrier->parties) {
+        atomic_store(&barrier->arrived, 0);
+        atomic_fetch_add(&barrier->generation, 1);
+        wake_barrier(barrier);
+        return 0;
+    }
+
+    struct timespec timeout = { 0, DOMAIN_POLL_MS * 1000000L };
+
+    while (atomic_load(&barrier->generation) == generation) {
+        if (atomic_load(&control->failed) == 1 || atomic_load(&control->stopping) == 1) {
+            return -1;
+        }
+
+        long result = syscall(SYS_futex, &barrier->generation, FUTEX_WAIT, generation, &timeout, NULL, 0);
+        if (result == -1 && errno == ETIMEDOUT && others_alive() == 0) {
+            fail();
+        }
+    }
+
+    return 0;
+}
+
+static void map_arrays(void *data, long capacity, struct domain_arrays *arrays) {
+    float **views[] = {
+        &arrays->x, &arrays->y, &arrays->z,
+        &arrays->vx, &arrays->vy, &arrays->vz,
+        &arrays->ax, &arrays->ay, &arrays->az,
+        &arrays->mass,
+        &arrays->exchange_x, &arrays->exchange_y, &arrays->exchange_z, &arrays->exchange_mass,
+    };
+
+    arrays->owned = (long *) data;
+    float *floats = (float *) (arrays->owned + capacity);
+
+    for (int i = 0; i < DOMAIN_ARRAYS; i++) {
+        *views[i] = floats + i * capacity;
+    }
+}
+
+static int map_data(const char *name, long capacity, int create) {
+    int fd = shm_open(name, create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+    if (fd == -1) {
+        fprintf(stderr, "Error: cannot open shared memory '%s'\n", name);
+        return -1;
+    }
+
+    size_t size = capacity * (sizeof(long) + DOMAIN_ARRAYS * sizeof(float));
+    if (create && ftruncate(fd, size) == -1) {
+        fprintf(stderr, "Error: cannot size shared memory '%s'\n", name);
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map shared memory '%s'\n", name);
+        if (create) {
+            shm_unlink(name);
+        }
+        return -1;
+    }
+
+    if (domains.data != NULL) {
+        munmap(domains.data, domains.data_size);
+    }
+
+    domains.data = data;
+    domains.data_size = size;
+    map_arrays(data, capacity, &domains.arrays);
+    return 0;
+}
+
+static void copy_task(void *arg, int thread, int threads) {
+    struct copy *c = (struct copy *) arg;
+    long start = c->num * thread / threads;
+    long end = c->num * (thread + 1) / threads;
+
+    for (int i = 0; i < c->arrays; i++) {
+        memcpy(c->to[i] + start, c->from[i] + start, (end - start) * sizeof(float));
+    }
+}
+
+// the nodes are numbered from 0 without gaps
+static int numa_nodes(void) {
+    char path[64];
+    int nodes = 0;
+
+    for (;;) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes);
+        if (access(path, R_OK) != 0) {
+            return nodes;
+        }
+
+        nodes++;
+    }
+}
+
+// the cpus of a node, listed like 0-15,32-47
+static int node_cpus(int node, cpu_set_t *cpus) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    CPU_ZERO(cpus);
+
+    int first, last;
+    while (fscanf(fp, "%d", &first) == 1) {
+        last = first;
+        int separator = fgetc(fp);
+        if (separator == '-') {
+            if (fscanf(fp, "%d", &last) != 1) {
+                break;
+            }
+            separator = fgetc(fp);
+        }
+
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+
+        if (separator != ',') {
+            break;
+        }
+    }
+
+    fclose(fp);
+    return (CPU_COUNT(cpus) > 0) ? 0 : -1;
+}
+
+// the domains are spread over the numa nodes in turn, each keeps to the
+// cpus of its node so that the memory it touches first is allocated
+// there. returns the threads the domain should use.
+static int place_domain(int index, int threads) {
+    int nodes = numa_nodes();
+    int processes = domains.processes_num;
+    cpu_set_t cpus;
+
+    if (nodes >= 2) {
+        int node = index % nodes;
+        int sharing = processes / nodes + (node < processes % nodes);
+
+        if (node_cpus(node, &cpus) == 0 && sched_setaffinity(0, sizeof(cpus), &cpus) == 0) {
+            if (threads <= 0) {
+                threads = CPU_COUNT(&cpus) / sharing;
+            }
+
+            fprintf(stdout, "Status: domain %d on numa node %d\n", index, node);
+            return (threads > 0) ? threads : 1;
+        }
+    }
+
+    if (threads <= 0) {
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN) / processes;
+    }
+
+    return (threads > 0) ? threads : 1;
+}
+
+// bounds and monopole of the own bodies
+static void summarize(struct domain_summary *summary, long num) {
+    double mass = 0.0;
+    double moment[3] = { 0.0, 0.0, 0.0 };
+    float *positions[] = { bodies.x, bodies.y, bodies.z };
+
+    for (int axis = 0; axis < 3; axis++) {
+        summary->minimum[axis] = INFINITY;
+        summary->maximum[axis] = -INFINITY;
+    }
+
+    for (long i = 0; i < num; i++) {
+        mass += bodies.mass[i];
+
+        for (int axis = 0; axis < 3; axis++) {
+            float position = positions[axis][i];
+            summary->minimum[axis] = fminf(summary->minimum[axis], position);
+            summary->maximum[axis] = fmaxf(summary->maximum[axis], position);
+            moment[axis] += (double) bodies.mass[i] * position;
+        }
+    }
+
+    summary->mass = mass;
+    for (int axis = 0; axis < 3; axis++) {
+        summary->com[axis] = (mass > 0.0) ? moment[axis] / mass : 0.0f;
+    }
+}
+
+// the other domain spans less than theta as seen from the nearest point
+// of the own bounds, the criterion of the octree nodes
+static int well_separated(const struct domain_summary *own, const struct domain_summary *other, float theta) {
+    float size = 0.0f;
+    float distance_squared = 0.0f;
+
+    for (int axis = 0; axis < 3; axis++) {
+        size = fmaxf(size, other->maximum[axis] - other->minimum[axis]);
+
+        float outside = fmaxf(own->minimum[axis] - other->com[axis], other->com[axis] - own->maximum[axis]);
+        outside = fmaxf(outside, 0.0f);
+        distance_squared += outside * outside;
+    }
+
+    return size * size < theta * theta * distance_squared;
+}
+
+// publish the own positions, then take the bodies of near domains and the
+// summaries of far ones as sources of the forces on the own bodies
+static int own_forces(void) {
+    struct domain_control *control = domains.control;
+    struct domain_arrays *arrays = &domains.arrays;
+    struct domain_summary *own = &control->summaries[worker.index];
+    long num = worker.num;
+    long first = control->first[worker.index];
+
+    summarize(own, num);
+    control->rounds[worker.index] = ++worker.rounds;
+    memcpy(arrays->exchange_x + first, bodies.x, num * sizeof(float));
+    memcpy(arrays->exchange_y + first, bodies.y, num * sizeof(float));
+    memcpy(arrays->exchange_z + first, bodies.z, num * sizeof(float));
+    memcpy(arrays->exchange_mass + first, bodies.mass, num * sizeof(float));
+
+    if (wait_barrier(&control->exchange) == -1) {
+        return -1;
+    }
+
+    // only the octree approximates, the other solvers see every body
+    float theta = (control->solver == SOLVER_BARNES_HUT) ? control->theta : 0.0f;
+
+    for (int d = 0; d < domain_processes; d++) {
+        struct domain_summary *other = &control->summaries[d];
+        long count = control->count[d];
+
+        if (d == worker.index || count == 0) {
+            continue;
+        }
+
+        if (num > 0 && well_separated(own, other, theta)) {
+            long ghost = bodies.num++;
+            bodies.x[ghost] = other->com[0];
+            bodies.y[ghost] = other->com[1];
+            bodies.z[ghost] = other->com[2];
+            bodies.mass[ghost] = other->mass;
+            continue;
+        }
+
+        memcpy(bodies.x + bodies.num, arrays->exchange_x + control->first[d], count * sizeof(float));
+        memcpy(bodies.y + bodies.num, arrays->exchange_y + control->first[d], count * sizeof(float));
+        memcpy(bodies.z + bodies.num, arrays->exchange_z + control->first[d], count * sizeof(float));
+        memcpy(bodies.mass + bodies.num, arrays->exchange_mass + control->first[d], count * sizeof(float));
+        bodies.num += count;
+    }
+
+    // a domain that published again while this one was still reading
+    // would have mixed two rounds into the sources
+    for (int d = 0; d < domain_processes; d++) {
+        if (control->rounds[d] != worker.rounds) {
+            fprintf(stderr, "Error: domain %d read the exchange of domain %d out of turn\n", worker.index, d);
+            return -1;
+        }
+    }
+
+    // nobody publishes the next round before every domain has read this one
+    if (wait_barrier(&control->exchange) == -1) {
+        return -1;
+    }
+
+    int result = 0;
+    if (num > 0) {
+        switch (control->solver) {
+            case SOLVER_BARNES_HUT:
+                result = octree_accelerations_of(&bodies, control->theta, worker.list, num);
+                break;
+            case SOLVER_PARTICLE_MESH:
+                result = pm_accelerations_of(&bodies, control->grid, worker.list, num);
+                break;
+            case SOLVER_DIRECT:
+            default:
+                result = calculate_accelerations_of(&bodies, worker.list, num);
+                break;
+        }
+    }
+
+    bodies.num = num;
+    return result;
+}
+
+static void kick_own(float dt) {
+    for (long i = 0; i < worker.num; i++) {
+        bodies.vx[i] += bodies.ax[i] * dt;
+        bodies.vy[i] += bodies.ay[i] * dt;
+        bodies.vz[i] += bodies.az[i] * dt;
+    }
+}
+
+static void drift_own(float dt) {
+    for (long i = 0; i < worker.num; i++) {
+        bodies.x[i] += bodies.vx[i] * dt;
+        bodies.y[i] += bodies.vy[i] * dt;
+        bodies.z[i] += bodies.vz[i] * dt;
+    }
+}
+
+// the integrators of the simulation on the own bodies, every domain
+// exchanges as often as the others
+static int step_own(void) {
+    struct domain_control *control = domains.control;
+    float dt = control->dt;
+
+    if (control->integrator == INTEGRATOR_LEAPFROG) {
+        if (worker.accelerated == 0 && own_forces() == -1) {
+            return -1;
+        }
+
+        kick_own(dt / 2.0f);
+        drift_own(dt);
+
+        if (own_forces() == -1) {
+            return -1;
+        }
+
+        kick_own(dt / 2.0f);
+        worker.accelerated = 1;
+        return 0;
+    }
+
+    if (own_forces() == -1) {
+        return -1;
+    }
+
+    kick_own(dt);
+    drift_own(dt);
+    worker.accelerated = 0;
+    return 0;
+}
+
+// the own bodies of the new partition, copied out of the state into
+// memory of this process
+static int load_own(void) {
+    struct domain_control *control = domains.control;
+    struct domain_arrays *arrays = &domains.arrays;
+
+    if (control->data_generation != worker.generation) {
+        if (map_data(control->data_name, control->capacity, 0) == -1) {
+            return -1;
+        }
+
+        worker.generation = control->data_generation;
+    }
+
+    long num = control->count[worker.index];
+    const long *owned = arrays->owned + control->first[worker.index];
+
+    // room for every other body, or the summary of its domain
+    if (reserve_bodies(control->bodies_num + domain_processes) == -1) {
+        return -1;
+    }
+
+    if (num > worker.list_max) {
+        long *list = (long *) reallocarray(worker.list, num, sizeof(long));
+        if (list == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for the domain bodies\n");
+            return -1;
+        }
+
+        worker.list = list;
+        worker.list_max = num;
+    }
+
+    for (long i = 0; i < num; i++) {
+        long body = owned[i];
+
+        worker.list[i] = i;
+        bodies.x[i] = arrays->x[body];
+        bodies.y[i] = arrays->y[body];
+        bodies.z[i] = arrays->z[body];
+        bodies.vx[i] = arrays->vx[body];
+        bodies.vy[i] = arrays->vy[body];
+        bodies.vz[i] = arrays->vz[body];
+        bodies.ax[i] = arrays->ax[body];
+        bodies.ay[i] = arrays->ay[body];
+        bodies.az[i] = arrays->az[body];
+        bodies.mass[i] = arrays->mass[body];
+    }
+
+    bodies.num = num;
+    worker.num = num;
+    worker.accelerated = control->accelerations_valid;
+    return 0;
+}
+
+static void store_own(void) {
+    struct domain_arrays *arrays = &domains.arrays;
+    const long *owned = arrays->owned + domains.control->first[worker.index];
+
+    for (long i = 0; i < worker.num; i++) {
+        long body = owned[i];
+
+        arrays->x[body] = bodies.x[i];
+        arrays->y[body] = bodies.y[i];
+        arrays->z[body] = bodies.z[i];
+        arrays->vx[body] = bodies.vx[i];
+        arrays->vy[body] = bodies.vy[i];
+        arrays->vz[body] = bodies.vz[i];
+        arrays->ax[body] = bodies.ax[i];
+        arrays->ay[body] = bodies.ay[i];
+        arrays->az[body] = bodies.az[i];
+    }
+}
+
+// body of a domain process, steps its bodies whenever the coordinator
+// does until it stops
+static void run_domain(int index, int threads) {
+    worker.index = index;
+
+    if (workers_init(place_domain(index, threads)) != 0) {
+        fail();
+        _exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        if (wait_barrier(&domains.control->steps) == -1) {
+            _exit((atomic_load(&domains.control->stopping) == 1) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        int result = 0;
+        if (domains.control->command == DOMAIN_LOAD) {
+            result = load_own();
+        }
+
+        if (result == 0) {
+            result = step_own();
+        }
+
+        if (result == -1) {
+            fail();
+            _exit(EXIT_FAILURE);
+        }
+
+        store_own();
+
+        if (wait_barrier(&domains.control->steps) == -1) {
+            _exit((atomic_load(&domains.control->stopping) == 1) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+}
+
+// forks the domain processes, before any thread is started so that they
+// begin with a single thread
+int domain_start(int processes, int threads) {
+    if (processes < 2 || processes > DOMAIN_MAX_PROCESSES) {
+        fprintf(stderr, "Error: invalid number of processes %d, expected 2 to %d\n", processes, DOMAIN_MAX_PROCESSES);
+        return -1;
+    }
+
+    struct domain_control *control = (struct domain_control *) mmap(NULL, sizeof(struct domain_control),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (control == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map shared memory for the domains\n");
+        return -1;
+    }
+
+    control->steps.parties = processes + 1;
+    control->exchange.parties = processes;
+
+    domains.control = control;
+    domains.processes_num = processes;
+    domains.loaded_num = -1;
+    domain_processes = processes;
+    coordinator = getpid();
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (int i = 0; i < processes; i++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            fprintf(stderr, "Error: cannot start domain process %d\n", i);
+            domain_stop();
+            return -1;
+        }
+
+        if (pid == 0) {
+            run_domain(i, threads);
+        }
+
+        domains.processes[i] = pid;
+    }
+
+    fprintf(stdout, "Status: splitting the bodies across %d domain processes\n", processes);
+    return 0;
+}
+
+// no body before k is further along the axis than order[k] and none after
+// it is nearer
+static void select_bodies(long *order, long num, long k, const float *values) {
+    long low = 0;
+    long high = num - 1;
+
+    while (low < high) {
+        float pivot = values[order[(low + high) / 2]];
+        long i = low;
+        long j = high;
+
+        while (i <= j) {
+            while (values[order[i]] < pivot) {
+                i++;
+            }
+            while (values[order[j]] > pivot) {
+                j--;
+            }
+
+            if (i <= j) {
+                long swap = order[i];
+                order[i] = order[j];
+                order[j] = swap;
+                i++;
+                j--;
+            }
+        }
+
+        if (k <= j) {
+            high = j;
+        } else if (k >= i) {
+            low = i;
+        } else {
+            break;
+        }
+    }
+}
+
+// recursive coordinate bisection across the longest side, each half gets
+// bodies in proportion to its domains
+static void bisect(long *order, long num, int first, int count) {
+    if (count == 1) {
+        for (long i = 0; i < num; i++) {
+            domains.owners[order[i]] = first;
+        }
+        return;
+    }
+
+    float *positions[] = { bodies.x, bodies.y, bodies.z };
+    float minimum[3] = { INFINITY, INFINITY, INFINITY };
+    float maximum[3] = { -INFINITY, -INFINITY, -INFINITY };
+
+    for (long i = 0; i < num; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            minimum[axis] = fminf(minimum[axis], positions[axis][order[i]]);
+            maximum[axis] = fmaxf(maximum[axis], positions[axis][order[i]]);
+        }
+    }
+
+    int longest = 0;
+    for (int axis = 1; axis < 3; axis++) {
+        if (maximum[axis] - minimum[axis] > maximum[longest] - minimum[longest]) {
+            longest = axis;
+        }
+    }
+
+    int left = count / 2;
+    long split = num * left / count;
+
+    if (num > 0) {
+        select_bodies(order, num, split, positions[longest]);
+    }
+
+    bisect(order, split, first, left);
+    bisect(order + split, num - split, first + left, count - left);
+}
+
+// the domain of every body, then the bodies of every domain in their order
+static int partition(void) {
+    struct domain_control *control = domains.control;
+    long num = bodies.num;
+
+    if (num > domains.scratch_max) {
+        unsigned short *owners = (unsigned short *) reallocarray(domains.owners, num, sizeof(unsigned short));
+        if (owners != NULL) {
+            domains.owners = owners;
+        }
+
+        long *order = (long *) reallocarray(domains.order, num, sizeof(long));
+        if (order != NULL) {
+            domains.order = order;
+        }
+
+        if (owners == NULL || order == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for the domain partition\n");
+            return -1;
+        }
+
+        domains.scratch_max = num;
+    }
+
+    for (long i = 0; i < num; i++) {
+        domains.order[i] = i;
+    }
+
+    bisect(domains.order, num, 0, domains.processes_num);
+
+    long next[DOMAIN_MAX_PROCESSES];
+    memset(control->count, 0, sizeof(control->count));
+
+    for (long i = 0; i < num; i++) {
+        control->count[domains.owners[i]]++;
+    }
+
+    for (int d = 0; d < domains.processes_num; d++) {
+        control->first[d] = (d == 0) ? 0 : control->first[d-1] + control->count[d-1];
+        next[d] = control->first[d];
+    }
+
+    for (long i = 0; i < num; i++) {
+        domains.arrays.owned[next[domains.owners[i]]++] = i;
+    }
+
+    return 0;
+}
+
+// repartition the bodies of the coordinator and hand them over through the
+// state, in a larger data segment if they no longer fit
+static int load_domains(int *created) {
+    struct domain_control *control = domains.control;
+
+    if (bodies.num > control->capacity) {
+        long capacity = (bodies.num * 2 > DOMAIN_MIN_CAPACITY) ? bodies.num * 2 : DOMAIN_MIN_CAPACITY;
+        char name[DOMAIN_NAME_MAX];
+        snprintf(name, sizeof(name), "/gravity-%d-%ld", (int) coordinator, control->data_generation + 1);
+
+        if (map_data(name, capacity, 1) == -1) {
+            return -1;
+        }
+
+        strcpy(control->data_name, name);
+        control->data_generation++;
+        control->capacity = capacity;
+        *created = 1;
+    }
+
+    if (partition() == -1) {
+        return -1;
+    }
+
+    struct domain_arrays *arrays = &domains.arrays;
+    float *from[] = { bodies.x, bodies.y, bodies.z, bodies.vx, bodies.vy, bodies.vz, bodies.ax, bodies.ay, bodies.az, bodies.mass };
+    float *to[] = { arrays->x, arrays->y, arrays->z, arrays->vx, arrays->vy, arrays->vz, arrays->ax, arrays->ay, arrays->az, arrays->mass };
+    struct copy copy = { from, to, sizeof(from)/sizeof(from[0]), bodies.num };
+    workers_run(copy_task, &copy);
+
+    // the accelerations of the last step stay valid unless bodies changed
+    control->accelerations_valid = domains.stale == 0 && bodies.num == domains.loaded_num;
+    control->bodies_num = bodies.num;
+    domains.loaded_num = bodies.num;
+    domains.stale = 0;
+    domains.unbalanced_steps = 0;
+    return 0;
+}
+
+// one step of all bodies across the domain processes, the bodies of the
+// coordinator are the result as if it had stepped them itself
+int domain_step(float dt) {
+    struct domain_control *control = domains.control;
+    int created = 0;
+
+    if (bodies.num == 0) {
+        return 0;
+    }
+
+    control->command = DOMAIN_STEP;
+    if (bodies.num != domains.loaded_num || domains.stale == 1 || domains.unbalanced_steps >= DOMAIN_REBALANCE_STEPS) {
+        if (load_domains(&created) == -1) {
+            return -1;
+        }
+
+        control->command = DOMAIN_LOAD;
+    }
+
+    control->dt = dt;
+    control->integrator = integrator;
+    control->solver = force_solver;
+    control->theta = barnes_hut_theta;
+    control->grid = particle_mesh_grid;
+
+    int evaluations = (integrator == INTEGRATOR_LEAPFROG && control->command == DOMAIN_LOAD && control->accelerations_valid == 0) ? 2 : 1;
+
+    // the domains step between the two
+    if (wait_barrier(&control->steps) == -1 || wait_barrier(&control->steps) == -1) {
+        fprintf(stderr, "Error: a domain process failed\n");
+        return -1;
+    }
+
+    // every domain process has it mapped by now
+    if (created == 1) {
+        shm_unlink(control->data_name);
+    }
+
+    struct domain_arrays *arrays = &domains.arrays;
+    float *from[] = { arrays->x, arrays->y, arrays->z, arrays->vx, arrays->vy, arrays->vz, arrays->ax, arrays->ay, arrays->az };
+    float *to[] = { bodies.x, bodies.y, bodies.z, bodies.vx, bodies.vy, bodies.vz, bodies.ax, bodies.ay, bodies.az };
+    struct copy copy = { from, to, sizeof(from)/sizeof(from[0]), bodies.num };
+    workers_run(copy_task, &copy);
+
+    force_evaluations += evaluations * bodies.num;
+    domains.unbalanced_steps++;
+    return 0;
+}
+
+// bodies were removed or reordered outside of a step
+void domain_invalidate(void) {
+    domains.stale = 1;
+}
+
+void domain_stop(void) {
+    struct domain_control *control = domains.control;
+
+    if (control == NULL || getpid() != coordinator) {
+        return;
+    }
+
+    atomic_store(&control->stopping, 1);
+    wake_barrier(&control->steps);
+    wake_barrier(&control->exchange);
+
+    for (int i = 0; i < domains.processes_num; i++) {
+        if (domains.processes[i] > 0) {
+            waitpid(domains.processes[i], NULL, 0);
+        }
+    }
+
+    // a segment is left linked if the step that created it failed
+    if (control->data_name[0] != '\0') {
+        shm_unlink(control->data_name);
+    }
+
+    if (domains.data != NULL) {
+        munmap(domains.data, domains.data_size);
+    }
+
+    munmap(control, sizeof(*control));
+    domains.control = NULL;
+    domains.data = NULL;
+    domains.processes_num = 0;
+}
@@ -0,0 +1,110 @@
+#ifndef DOMAIN_H
+#define DOMAIN_H
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define DOMAIN_MAX_PROCESSES 64
+#define DOMAIN_REBALANCE_STEPS 32 // steps between repartitions of the bodies
+#define DOMAIN_POLL_MS 100 // how often a waiting process checks on the others
+#define DOMAIN_NAME_MAX 64
+#define DOMAIN_MIN_CAPACITY 1024 // bodies of the smallest data segment
+#define DOMAIN_ARRAYS 14 // float arrays of the data segment
+
+enum domain_command {
+    DOMAIN_STEP,
+    DOMAIN_LOAD, // take the bodies of the new partition from the state, then step
+};
+
+// bounds and monopole of the bodies of a domain, far domains are only
+// seen through it
+struct domain_summary {
+    float minimum[3];
+    float maximum[3];
+    float com[3];
+    float mass;
+};
+
+// every process waits until all parties arrived. nothing is held while
+// waiting, so a process that dies cannot block the others.
+struct domain_barrier {
+    int parties;
+    atomic_int arrived;
+    atomic_uint generation; // futex word, advanced by the last party to arrive
+};
+
+// shared by the coordinator and the domain processes, mapped before they
+// are forked. the bodies themselves are in the data segment, which is
+// recreated under a new name whenever it has to grow.
+struct domain_control {
+    struct domain_barrier steps; // coordinator and domains, at the start and end of every step
+    struct domain_barrier exchange; // domains, around reading the published positions
+    atomic_int failed;
+    atomic_int stopping;
+
+    enum domain_command command;
+    int accelerations_valid; // the loaded accelerations belong to the positions
+    float dt;
+    int integrator;
+    int solver;
+    float theta;
+    int grid;
+
+    char data_name[DOMAIN_NAME_MAX];
+    long data_generation;
+    long capacity; // bodies the data segment holds
+    long bodies_num;
+
+    long first[DOMAIN_MAX_PROCESSES]; // first entry of every domain in owned
+    long count[DOMAIN_MAX_PROCESSES];
+    struct domain_summary summaries[DOMAIN_MAX_PROCESSES];
+    long rounds[DOMAIN_MAX_PROCESSES]; // exchange each domain published last
+};
+
+// views of the data segment. the state is in the order of the bodies of
+// the coordinator, owned and the exchanged arrays are grouped by domain.
+struct domain_arrays {
+    long *owned; // body indices, increasing within a domain
+
+    float *x;
+    float *y;
+    float *z;
+    float *vx;
+    float *vy;
+    float *vz;
+    float *ax;
+    float *ay;
+    float *az;
+    float *mass;
+
+    float *exchange_x; // positions and masses published for the other domains
+    float *exchange_y;
+    float *exchange_z;
+    float *exchange_mass;
+};
+
+struct domains {
+    struct domain_control *control;
+    void *data;
+    size_t data_size;
+    struct domain_arrays arrays;
+
+    pid_t processes[DOMAIN_MAX_PROCESSES];
+    int processes_num;
+
+    long loaded_num; // bodies at the last load
+    long unbalanced_steps; // steps since the last load
+    int stale; // bodies were reordered since the last load
+    unsigned short *owners; // domain of every body, scratch of the partition
+    long *order;
+    long scratch_max;
+};
+
+extern int domain_processes; // processes the bodies are split across, 1 for none
+
+int domain_start(int processes, int threads);
+int domain_step(float dt);
+void domain_invalidate(void);
+void domain_stop(void);
+
+#endif
@@ -0,0 +1,334 @@
+#include "export.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+const char *export_directory = NULL; // frames are written here, NULL for no export
+long export_interval = 1; // steps between exported frames
+int export_width = EXPORT_DEFAULT_WIDTH;
+int export_height = EXPORT_DEFAULT_HEIGHT;
+enum export_format export_format = EXPORT_PPM;
+
+static struct exporter exporter = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .filled = PTHREAD_COND_INITIALIZER,
+    .emptied = PTHREAD_COND_INITIALIZER,
+};
+
+static struct timespec export_start;
+
+int select_export_format(const char *name) {
+    if (strcmp(name, "ppm") == 0) {
+        export_format = EXPORT_PPM;
+    } else if (strcmp(name, "raw") == 0) {
+        export_format = EXPORT_RAW;
+    } else {
+        fprintf(stderr, "Error: unknown export format '%s', expected ppm or raw\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+// an opengl context without a window, the scene is drawn into a
+// framebuffer object so no surface is needed
+int export_context(void) {
+    EGLDisplay display = EGL_NO_DISPLAY;
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display != NULL) {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+#endif
+
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+    if (display == EGL_NO_DISPLAY || eglInitialize(display, NULL, NULL) != EGL_TRUE) {
+        fprintf(stderr, "Error: no egl display for offscreen rendering\n");
+        return -1;
+    }
+
+    if (eglBindAPI(EGL_OPENGL_API) != EGL_TRUE) {
+        fprintf(stderr, "Error: egl display does not support opengl\n");
+        return -1;
+    }
+
+    EGLint attributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint configs_num = 0;
+
+    if (eglChooseConfig(display, attributes, &config, 1, &configs_num) != EGL_TRUE || configs_num == 0) {
+        config = (EGLConfig) 0; // EGL_NO_CONFIG_KHR
+    }
+
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT) {
+        fprintf(stderr, "Error: failed creating an offscreen opengl context (egl error 0x%x)\n", eglGetError());
+        return -1;
+    }
+
+    if (eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context) != EGL_TRUE) {
+        fprintf(stderr, "Error: failed making the offscreen context current (egl error 0x%x)\n", eglGetError());
+        return -1;
+    }
+
+    return 0;
+}
+
+static long frame_size(void) {
+    return (long) export_width * export_height * 4;
+}
+
+static int write_frame(struct export_slot *slot, unsigned char *row) {
+    char path[EXPORT_PATH_MAX];
+    const char *extension = (export_format == EXPORT_PPM) ? "ppm" : "rgb";
+    snprintf(path, sizeof(path), "%s/frame_%06ld.%s", export_directory, slot->frame, extension);
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: cannot open frame '%s' for writing\n", path);
+        return -1;
+    }
+
+    int failed = 0;
+    if (export_format == EXPORT_PPM) {
+        failed |= fprintf(fp, "P6\n%d %d\n255\n", export_width, export_height) < 0;
+    }
+
+    // read back bottom row first, written top row first without alpha
+    for (int y = export_height - 1; y >= 0 && failed == 0; y--) {
+        unsigned char *pixel = slot->pixels + (long) y * export_width * 4;
+
+        for (int x = 0; x < export_width; x++) {
+            row[x*3] = pixel[x*4];
+            row[x*3 + 1] = pixel[x*4 + 1];
+            row[x*3 + 2] = pixel[x*4 + 2];
+        }
+
+        failed |= fwrite(row, 3, export_width, fp) != (size_t) export_width;
+    }
+
+    failed |= fclose(fp) != 0;
+
+    if (failed) {
+        fprintf(stderr, "Error: failed writing frame '%s'\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// writes queued frames until the queue is closed and empty
+static void *write_frames(void *arg) {
+    unsigned char *row = (unsigned char *) malloc((long) export_width * 3);
+
+    pthread_mutex_lock(&exporter.lock);
+
+    while (1) {
+        while (exporter.queue_num == 0 && exporter.closing == 0) {
+            pthread_cond_wait(&exporter.filled, &exporter.lock);
+        }
+
+        if (exporter.queue_num == 0) {
+            break;
+        }
+
+        // the head slot is not touched by the main thread until it is released
+        struct export_slot *slot = &exporter.queue[exporter.queue_head];
+        pthread_mutex_unlock(&exporter.lock);
+
+        int result = (row == NULL) ? -1 : write_frame(slot, row);
+
+        pthread_mutex_lock(&exporter.lock);
+        if (result == -1) {
+            exporter.failed = 1;
+        } else {
+            exporter.written++;
+        }
+
+        exporter.queue_head = (exporter.queue_head + 1) % EXPORT_QUEUE;
+        exporter.queue_num--;
+        pthread_cond_signal(&exporter.emptied);
+    }
+
+    pthread_mutex_unlock(&exporter.lock);
+    free(row);
+    return NULL;
+}
+
+// the framebuffer stays bound, everything drawn afterwards goes into it
+int export_open(void) {
+    if (mkdir(export_directory, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error: cannot create export directory '%s'\n", export_directory);
+        return -1;
+    }
+
+    glGenFramebuffers(1, &exporter.framebuffer);
+    glGenRenderbuffers(1, &exporter.color);
+    glGenRenderbuffers(1, &exporter.depth);
+
+    glBindRenderbuffer(GL_RENDERBUFFER, exporter.color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, export_width, export_height);
+    glBindRenderbuffer(GL_RENDERBUFFER, exporter.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, export_width, export_height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, exporter.framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, exporter.color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, exporter.depth);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Error: incomplete framebuffer for exporting %dx%d frames\n", export_width, export_height);
+        return -1;
+    }
+
+    glViewport(0, 0, export_width, export_height);
+
+    glGenBuffers(EXPORT_PBOS, exporter.pbos);
+    for (int i = 0; i < EXPORT_PBOS; i++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, exporter.pbos[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frame_size(), NULL, GL_STREAM_READ);
+        exporter.pbo_frames[i] = -1;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    for (int i = 0; i < EXPORT_QUEUE; i++) {
+        exporter.queue[i].pixels = (unsigned char *) malloc(frame_size());
+        if (exporter.queue[i].pixels == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for exported frames\n");
+            return -1;
+        }
+    }
+
+    if (pthread_create(&exporter.writer, NULL, write_frames, NULL) != 0) {
+        fprintf(stderr, "Error: failed starting the frame writer\n");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &export_start);
+    fprintf(stdout, "Status: exporting %dx%d %s frames every %ld steps to '%s'\n", export_width, export_height,
+            (export_format == EXPORT_PPM) ? "ppm" : "raw", export_interval, export_directory);
+    return 0;
+}
+
+// copy a finished readback into the queue, waits for the writer only when
+// it falls EXPORT_QUEUE frames behind
+static int queue_frame(int pbo) {
+    GLenum status;
+    do {
+        status = glClientWaitSync(exporter.fences[pbo], GL_SYNC_FLUSH_COMMANDS_BIT, EXPORT_FENCE_TIMEOUT);
+    } while (status == GL_TIMEOUT_EXPIRED);
+
+    glDeleteSync(exporter.fences[pbo]);
+
+    if (status == GL_WAIT_FAILED) {
+        fprintf(stderr, "Error: waiting for frame %ld failed\n", exporter.pbo_frames[pbo]);
+        return -1;
+    }
+
+    pthread_mutex_lock(&exporter.lock);
+    while (exporter.queue_num == EXPORT_QUEUE && exporter.failed == 0) {
+        pthread_cond_wait(&exporter.emptied, &exporter.lock);
+    }
+
+    int failed = exporter.failed;
+    struct export_slot *slot = &exporter.queue[(exporter.queue_head + exporter.queue_num) % EXPORT_QUEUE];
+    pthread_mutex_unlock(&exporter.lock);
+
+    if (failed == 1) {
+        return -1;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, exporter.pbos[pbo]);
+    void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame_size(), GL_MAP_READ_BIT);
+    if (pixels == NULL) {
+        fprintf(stderr, "Error: failed mapping frame %ld\n", exporter.pbo_frames[pbo]);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        return -1;
+    }
+
+    memcpy(slot->pixels, pixels, frame_size());
+    slot->frame = exporter.pbo_frames[pbo];
+
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    exporter.pbo_frames[pbo] = -1;
+
+    pthread_mutex_lock(&exporter.lock);
+    exporter.queue_num++;
+    pthread_cond_signal(&exporter.filled);
+    pthread_mutex_unlock(&exporter.lock);
+
+    return 0;
+}
+
+// start the readback of the frame just drawn into the framebuffer
+int export_frame(void) {
+    int pbo = exporter.frames % EXPORT_PBOS;
+
+    // the oldest frame in flight, done by now unless the gpu is far behind
+    if (exporter.pbo_frames[pbo] >= 0 && queue_frame(pbo) != 0) {
+        return -1;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, exporter.pbos[pbo]);
+    glReadPixels(0, 0, export_width, export_height, GL_RGBA, GL_UNSIGNED_BYTE, (void *) 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    exporter.fences[pbo] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    exporter.pbo_frames[pbo] = exporter.frames++;
+    glFlush();
+
+    return 0;
+}
+
+// queue the frames still in flight, oldest first, and wait for the writer
+int export_close(void) {
+    int result = 0;
+
+    for (long frame = exporter.frames - EXPORT_PBOS; frame < exporter.frames; frame++) {
+        if (frame < 0) {
+            continue;
+        }
+
+        int pbo = frame % EXPORT_PBOS;
+        if (exporter.pbo_frames[pbo] == frame && queue_frame(pbo) != 0) {
+            result = -1;
+        }
+    }
+
+    pthread_mutex_lock(&exporter.lock);
+    exporter.closing = 1;
+    pthread_cond_signal(&exporter.filled);
+    pthread_mutex_unlock(&exporter.lock);
+
+    pthread_join(exporter.writer, NULL);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double) (end.tv_sec - export_start.tv_sec) + (double) (end.tv_nsec - export_start.tv_nsec) * 1e-9;
+
+    fprintf(stdout, "Status: exported %ld frames in %.3f s (%.1f frames/sec)\n", exporter.written, seconds,
+            (seconds > 0.0) ? (double) exporter.written / seconds : 0.0);
+
+    for (int i = 0; i < EXPORT_QUEUE; i++) {
+        free(exporter.queue[i].pixels);
+    }
+
+    glDeleteBuffers(EXPORT_PBOS, exporter.pbos);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &exporter.framebuffer);
+    glDeleteRenderbuffers(1, &exporter.color);
+    glDeleteRenderbuffers(1, &exporter.depth);
+
+    return (result == 0 && exporter.failed == 0) ? 0 : -1;
+}
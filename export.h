@@ -0,0 +1,65 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <GL/glew.h>
+#include <pthread.h>
+
+#define EXPORT_PBOS 3 // frames in flight between the gpu and the cpu
+#define EXPORT_QUEUE 8 // frames waiting for the writer thread
+#define EXPORT_DEFAULT_WIDTH 1280
+#define EXPORT_DEFAULT_HEIGHT 720
+#define EXPORT_PATH_MAX 512
+#define EXPORT_FENCE_TIMEOUT 1000000000 // nanoseconds per wait on a readback
+
+enum export_format {
+    EXPORT_PPM, // binary ppm, one file per frame
+    EXPORT_RAW, // rgb bytes, top row first, one file per frame
+};
+
+struct export_slot {
+    unsigned char *pixels; // rgba, bottom row first as read back
+    long frame;
+};
+
+// frames are drawn into a framebuffer object and read back into a ring of
+// pixel buffer objects. a buffer is only mapped once the ring comes back to
+// it, EXPORT_PBOS-1 frames later, so the copy never waits for the gpu. the
+// writer thread converts and writes the copies while the next steps run.
+struct exporter {
+    GLuint framebuffer;
+    GLuint color;
+    GLuint depth;
+
+    GLuint pbos[EXPORT_PBOS];
+    GLsync fences[EXPORT_PBOS];
+    long pbo_frames[EXPORT_PBOS]; // frame read into each buffer, -1 if free
+    long frames; // frames read back so far
+
+    // bounded queue to the writer thread
+    struct export_slot queue[EXPORT_QUEUE];
+    int queue_head;
+    int queue_num;
+    int closing;
+    int failed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+    pthread_t writer;
+
+    long written;
+};
+
+extern const char *export_directory;
+extern long export_interval;
+extern int export_width;
+extern int export_height;
+extern enum export_format export_format;
+
+int select_export_format(const char *name);
+int export_context(void);
+int export_open(void);
+int export_frame(void);
+int export_close(void);
+
+#endif
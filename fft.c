@@ -0,0 +1,80 @@
+#include "fft.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int fft_prepare(struct fft_plan *plan, long n) {
+    if (n < 2 || (n & (n-1)) != 0) {
+        fprintf(stderr, "Error: fft length %ld is not a power of two\n", n);
+        return -1;
+    }
+
+    double *twiddles = (double *) reallocarray(plan->twiddles, n, sizeof(double));
+    if (twiddles == NULL) {
+        fprintf(stderr, "Error: failed allocating memory for fft\n");
+        return -1;
+    }
+
+    for (long k = 0; k < n/2; k++) {
+        double angle = -2.0 * M_PI * (double) k / (double) n;
+        twiddles[2*k] = cos(angle);
+        twiddles[2*k+1] = sin(angle);
+    }
+
+    plan->n = n;
+    plan->twiddles = twiddles;
+    return 0;
+}
+
+void fft_release(struct fft_plan *plan) {
+    free(plan->twiddles);
+    plan->twiddles = NULL;
+    plan->n = 0;
+}
+
+// in place, the inverse is not normalized
+void fft(const struct fft_plan *plan, double *data, int inverse) {
+    long n = plan->n;
+    double sign = (inverse == 1) ? -1.0 : 1.0;
+
+    // bit reversed order
+    for (long i = 1, j = 0; i < n; i++) {
+        long bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+
+        if (i < j) {
+            double re = data[2*i];
+            double im = data[2*i+1];
+            data[2*i] = data[2*j];
+            data[2*i+1] = data[2*j+1];
+            data[2*j] = re;
+            data[2*j+1] = im;
+        }
+    }
+
+    for (long length = 2; length <= n; length <<= 1) {
+        long half = length / 2;
+        long step = n / length;
+
+        for (long start = 0; start < n; start += length) {
+            for (long k = 0; k < half; k++) {
+                double wr = plan->twiddles[2*k*step];
+                double wi = plan->twiddles[2*k*step+1] * sign;
+
+                double *u = &data[2*(start+k)];
+                double *v = &data[2*(start+k+half)];
+                double vr = v[0]*wr - v[1]*wi;
+                double vi = v[0]*wi + v[1]*wr;
+
+                v[0] = u[0] - vr;
+                v[1] = u[1] - vi;
+                u[0] += vr;
+                u[1] += vi;
+            }
+        }
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef FFT_H
+#define FFT_H
+
+// radix-2 fft of a fixed power of two length, complex values are stored
+// as interleaved real and imaginary parts
+struct fft_plan {
+    long n;
+    double *twiddles; // n/2 roots of unity, exp(-2 pi i k/n)
+};
+
+int fft_prepare(struct fft_plan *plan, long n);
+void fft_release(struct fft_plan *plan);
+void fft(const struct fft_plan *plan, double *data, int inverse);
+
+#endif
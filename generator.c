@@ -0,0 +1,347 @@
+#include "generator.h"
+
+#include "body.h"
+#include "math.h"
+#include "workers.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const char *distribution_names[] = {
+    [DISTRIBUTION_PLUMMER] = "plummer",
+    [DISTRIBUTION_CUBE] = "cube",
+    [DISTRIBUTION_DISK] = "disk",
+};
+
+struct generation {
+    struct generator *settings;
+    unsigned long key; // mixed seed
+    long first; // index of the first body of the batch
+    float body_mass;
+    float *disk_accelerations; // inwards, at DISK_RINGS+1 evenly spaced radii
+    float *plummer_dispersions; // per axis and squared, at PLUMMER_SHELLS+1 evenly spaced enclosed masses
+};
+
+int select_distribution(struct generator *settings, const char *name) {
+    for (unsigned long i = 0; i < sizeof(distribution_names)/sizeof(distribution_names[0]); i++) {
+        if (strcmp(distribution_names[i], name) == 0) {
+            settings->distribution = i;
+            settings->size = distribution_size(i);
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Error: unknown distribution '%s'\n", name);
+    return -1;
+}
+
+const char *distribution_name(enum distribution distribution) {
+    return distribution_names[distribution];
+}
+
+float distribution_size(enum distribution distribution) {
+    switch (distribution) {
+        case DISTRIBUTION_PLUMMER:
+            return PLUMMER_DEFAULT_RADIUS;
+        case DISTRIBUTION_CUBE:
+            return CUBE_DEFAULT_SIDE;
+        case DISTRIBUTION_DISK:
+            return DISK_DEFAULT_RADIUS;
+    }
+
+    return 0.0f;
+}
+
+// splitmix64 finalizer
+static unsigned long mix(unsigned long z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+    return z ^ (z >> 31);
+}
+
+// in [0, 1), depends only on the key and the counter so that any thread
+// can draw the numbers of any body
+static float counter_uniform(unsigned long key, unsigned long counter) {
+    return (float) (mix(key + (counter + 1) * 0x9e3779b97f4a7c15UL) >> 40) * 0x1.0p-24f;
+}
+
+// enclosed mass at a position of the plummer table, as a share of the
+// batch
+static float plummer_fraction(float shell) {
+    return PLUMMER_CUT + (1.0f - 2.0f * PLUMMER_CUT) * shell / PLUMMER_SHELLS;
+}
+
+// inverse of the enclosed mass
+static float plummer_radius(float radius_scale, float mass_fraction) {
+    return radius_scale / sqrtf(powf(mass_fraction, -2.0f / 3.0f) - 1.0f);
+}
+
+// a pair of independent standard normal numbers from two draws
+static void counter_normals(unsigned long key, unsigned long counter, float *first, float *second) {
+    float length = sqrtf(-2.0f * logf(1.0f - counter_uniform(key, counter)));
+    float angle = 2.0f * (float) M_PI * counter_uniform(key, counter + 1);
+
+    *first = length * cosf(angle);
+    *second = length * sinf(angle);
+}
+
+static void generate_plummer(struct generation *g, long i, vec3 position, vec3 velocity) {
+    unsigned long counter = (unsigned long) i * GENERATOR_DRAWS;
+    float radius_scale = g->settings->size;
+
+    float shell = PLUMMER_SHELLS * counter_uniform(g->key, counter);
+    float radius = plummer_radius(radius_scale, plummer_fraction(shell));
+    float cos_theta = 2.0f * counter_uniform(g->key, counter + 1) - 1.0f;
+    float sin_theta = sqrtf(1.0f - cos_theta * cos_theta);
+    float phi = 2.0f * (float) M_PI * counter_uniform(g->key, counter + 2);
+
+    position[0] = radius * sin_theta * cosf(phi);
+    position[1] = radius * sin_theta * sinf(phi);
+    position[2] = radius * cos_theta;
+
+    // isotropic gaussian velocities with the dispersion at this radius
+    int inner = (int) shell;
+    if (inner >= PLUMMER_SHELLS) {
+        inner = PLUMMER_SHELLS - 1;
+    }
+
+    float t = shell - inner;
+    float dispersion = (1.0f - t) * g->plummer_dispersions[inner] + t * g->plummer_dispersions[inner + 1];
+    float speed = sqrtf(fmaxf(dispersion, 0.0f));
+    float unused;
+
+    counter_normals(g->key, counter + 3, &velocity[0], &velocity[1]);
+    counter_normals(g->key, counter + 5, &velocity[2], &unused);
+    glm_vec3_scale(velocity, speed, velocity);
+}
+
+static void generate_cube(struct generation *g, long i, vec3 position) {
+    unsigned long counter = (unsigned long) i * GENERATOR_DRAWS;
+
+    for (int axis = 0; axis < 3; axis++) {
+        position[axis] = g->settings->size * (counter_uniform(g->key, counter + axis) - 0.5f);
+    }
+}
+
+static void generate_disk(struct generation *g, long i, vec3 position, vec3 velocity) {
+    unsigned long counter = (unsigned long) i * GENERATOR_DRAWS;
+    float disk_radius = g->settings->size;
+
+    float radius = disk_radius * sqrtf(counter_uniform(g->key, counter));
+    float phi = 2.0f * (float) M_PI * counter_uniform(g->key, counter + 1);
+    float height = disk_radius * DISK_THICKNESS * (counter_uniform(g->key, counter + 2) - 0.5f);
+
+    position[0] = radius * cosf(phi);
+    position[1] = radius * sinf(phi);
+    position[2] = height;
+
+    // circular orbit for the pull of the batch at this radius
+    float ring = radius / disk_radius * DISK_RINGS;
+    int inner = (int) ring;
+    if (inner >= DISK_RINGS) {
+        inner = DISK_RINGS - 1;
+    }
+
+    float t = ring - inner;
+    float acceleration = (1.0f - t) * g->disk_accelerations[inner] + t * g->disk_accelerations[inner + 1];
+    float speed = sqrtf(fmaxf(acceleration, 0.0f) * radius);
+
+    velocity[0] = -speed * sinf(phi);
+    velocity[1] = speed * cosf(phi);
+    velocity[2] = 0.0f;
+}
+
+static void generate_task(void *arg, int thread, int threads) {
+    struct generation *g = (struct generation *) arg;
+    long num = g->settings->num;
+
+    for (long start = (long) thread * GENERATOR_BLOCK; start < num; start += (long) threads * GENERATOR_BLOCK) {
+        long end = (start + GENERATOR_BLOCK < num) ? start + GENERATOR_BLOCK : num;
+
+        for (long i = start; i < end; i++) {
+            vec3 position = { 0.0f, 0.0f, 0.0f };
+            vec3 velocity = { 0.0f, 0.0f, 0.0f };
+
+            switch (g->settings->distribution) {
+                case DISTRIBUTION_PLUMMER:
+                    generate_plummer(g, i, position, velocity);
+                    break;
+                case DISTRIBUTION_CUBE:
+                    generate_cube(g, i, position);
+                    break;
+                case DISTRIBUTION_DISK:
+                    generate_disk(g, i, position, velocity);
+                    break;
+            }
+
+            long body = g->first + i;
+            bodies.x[body] = g->settings->center[0] + position[0];
+            bodies.y[body] = g->settings->center[1] + position[1];
+            bodies.z[body] = g->settings->center[2] + position[2];
+            bodies.vx[body] = velocity[0];
+            bodies.vy[body] = velocity[1];
+            bodies.vz[body] = velocity[2];
+            bodies.ax[body] = 0.0f;
+            bodies.ay[body] = 0.0f;
+            bodies.az[body] = 0.0f;
+            bodies.mass[body] = g->body_mass;
+        }
+    }
+}
+
+// the disk as DISK_RINGS rings of point masses at the expected surface
+// density, summed with the force law of the solvers instead of assuming
+// newtonian gravity, tabulated between the rings
+static void disk_task(void *arg, int thread, int threads) {
+    struct generation *g = (struct generation *) arg;
+    float disk_radius = g->settings->size;
+    float cos_phi[DISK_ANGLES];
+    float sin_phi[DISK_ANGLES];
+
+    for (int angle = 0; angle < DISK_ANGLES; angle++) {
+        float phi = 2.0f * (float) M_PI * (angle + 0.5f) / DISK_ANGLES;
+        cos_phi[angle] = cosf(phi);
+        sin_phi[angle] = sinf(phi);
+    }
+
+    for (int i = thread; i <= DISK_RINGS; i += threads) {
+        float radius = disk_radius * i / DISK_RINGS;
+        vec3 acceleration = { 0.0f, 0.0f, 0.0f };
+
+        for (int ring = 0; ring < DISK_RINGS; ring++) {
+            float ring_radius = disk_radius * (ring + 0.5f) / DISK_RINGS;
+            float ring_mass = g->settings->mass * (2 * ring + 1) / ((float) DISK_RINGS * DISK_RINGS);
+
+            for (int angle = 0; angle < DISK_ANGLES; angle++) {
+                gravity_acceleration(ring_radius * cos_phi[angle] - radius, ring_radius * sin_phi[angle], 0.0f,
+                        ring_mass / DISK_ANGLES, acceleration);
+            }
+        }
+
+        g->disk_accelerations[i] = -acceleration[0];
+    }
+}
+
+// the sphere as PLUMMER_SHELLS shells of equal mass, each of point masses
+// spread evenly over it, summed with the force law of the solvers. the
+// inwards acceleration at the table radii is left in the table.
+static void plummer_task(void *arg, int thread, int threads) {
+    struct generation *g = (struct generation *) arg;
+    float radius_scale = g->settings->size;
+    float shell_mass = g->settings->mass / PLUMMER_SHELLS;
+    vec3 points[PLUMMER_POINTS];
+
+    // fibonacci lattice on the unit sphere
+    for (int point = 0; point < PLUMMER_POINTS; point++) {
+        float z = 1.0f - (2.0f * point + 1.0f) / PLUMMER_POINTS;
+        float ring = sqrtf(1.0f - z * z);
+        float phi = (float) M_PI * (3.0f - sqrtf(5.0f)) * point;
+
+        points[point][0] = ring * cosf(phi);
+        points[point][1] = ring * sinf(phi);
+        points[point][2] = z;
+    }
+
+    for (int i = thread; i <= PLUMMER_SHELLS; i += threads) {
+        float radius = plummer_radius(radius_scale, plummer_fraction(i));
+        vec3 acceleration = { 0.0f, 0.0f, 0.0f };
+
+        for (int shell = 0; shell < PLUMMER_SHELLS; shell++) {
+            float shell_radius = plummer_radius(radius_scale, plummer_fraction(shell + 0.5f));
+
+            for (int point = 0; point < PLUMMER_POINTS; point++) {
+                gravity_acceleration(shell_radius * points[point][0] - radius, shell_radius * points[point][1],
+                        shell_radius * points[point][2], shell_mass / PLUMMER_POINTS, acceleration);
+            }
+        }
+
+        g->plummer_dispersions[i] = -acceleration[0];
+    }
+}
+
+// jeans equation of an isotropic sphere, the pressure rho*sigma^2 at a
+// radius holds up the weight of everything outside of it. integrated
+// over the enclosed mass m from the edge inwards, where rho dr is
+// dm / (4 pi r^2), and divided by the plummer density.
+static void plummer_dispersions(struct generation *g) {
+    float radius_scale = g->settings->size;
+    float mass_step = (1.0f - 2.0f * PLUMMER_CUT) / PLUMMER_SHELLS;
+    float pressure = 0.0f;
+    float outer_weight = 0.0f;
+
+    for (int i = PLUMMER_SHELLS; i >= 0; i--) {
+        float radius = plummer_radius(radius_scale, plummer_fraction(i));
+        float weight = g->plummer_dispersions[i] / (radius * radius);
+
+        if (i < PLUMMER_SHELLS) {
+            pressure += 0.5f * (weight + outer_weight) * mass_step;
+        }
+
+        // 4 pi and the mass of the batch cancel
+        float scaled = radius / radius_scale;
+        float density = 3.0f / (radius_scale * radius_scale * radius_scale) * powf(1.0f + scaled * scaled, -2.5f);
+
+        g->plummer_dispersions[i] = pressure / density;
+        outer_weight = weight;
+    }
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end) {
+    return (double) (end->tv_sec - start->tv_sec) + (double) (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+// appends a batch of bodies, with objects of the model if one is given,
+// returns the index of the first body
+long generate_bodies(struct generator *settings, struct model *model) {
+    struct timespec start, end;
+    float disk_accelerations[DISK_RINGS + 1];
+    float plummer_table[PLUMMER_SHELLS + 1];
+
+    if (settings->num <= 0 || settings->mass <= 0.0f || settings->size <= 0.0f) {
+        fprintf(stderr, "Error: invalid batch of bodies to generate\n");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (reserve_bodies(bodies.num + settings->num) == -1) {
+        return -1;
+    }
+
+    struct generation g = {
+        .settings = settings,
+        .key = mix(settings->seed),
+        .first = bodies.num,
+        .body_mass = settings->mass / settings->num,
+        .disk_accelerations = disk_accelerations,
+        .plummer_dispersions = plummer_table,
+    };
+
+    if (settings->distribution == DISTRIBUTION_DISK) {
+        workers_run(disk_task, &g);
+    }
+
+    if (settings->distribution == DISTRIBUTION_PLUMMER) {
+        workers_run(plummer_task, &g);
+        plummer_dispersions(&g);
+    }
+
+    workers_run(generate_task, &g);
+    bodies.num += settings->num;
+    number_bodies(g.first);
+
+    if (model != NULL) {
+        for (long body = g.first; body < bodies.num; body++) {
+            if (attach_object(body, model) == NULL) {
+                return -1;
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stdout, "Status: generated %ld bodies of a %s distribution in %.3f s (seed %lu)\n",
+            settings->num, distribution_name(settings->distribution), elapsed_seconds(&start, &end), settings->seed);
+
+    return g.first;
+}
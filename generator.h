@@ -0,0 +1,43 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include "object.h"
+#include <cglm/cglm.h>
+
+#define GENERATOR_DEFAULT_BODIES 10000
+#define GENERATOR_DEFAULT_MASS 1e9f // of the whole batch, shared equally
+#define GENERATOR_DRAWS 8 // random numbers per body
+#define GENERATOR_BLOCK 4096 // bodies per task of a worker
+#define PLUMMER_DEFAULT_RADIUS 100.0f
+#define PLUMMER_CUT 0.001f // share of the mass left out at the centre and at the edge, which is at infinity
+#define PLUMMER_SHELLS 256 // enclosed masses the velocity dispersions are tabulated at
+#define PLUMMER_POINTS 256 // point masses per shell of the table
+#define CUBE_DEFAULT_SIDE 1000.0f
+#define DISK_DEFAULT_RADIUS 500.0f
+#define DISK_THICKNESS 0.02f // relative to the radius
+#define DISK_RINGS 256 // radii the orbital velocities are tabulated at
+#define DISK_ANGLES 128 // point masses per ring of the table
+
+enum distribution {
+    DISTRIBUTION_PLUMMER, // dense core and sparse halo, random velocities in equilibrium
+    DISTRIBUTION_CUBE, // uniform, at rest
+    DISTRIBUTION_DISK, // uniform surface density in the xy plane, on circular orbits
+};
+
+// a batch of bodies, the same seed gives the same bodies on any number of
+// threads
+struct generator {
+    enum distribution distribution;
+    long num;
+    unsigned long seed;
+    float mass; // total
+    float size; // plummer radius, side of the cube or radius of the disk
+    vec3 center;
+};
+
+int select_distribution(struct generator *settings, const char *name);
+const char *distribution_name(enum distribution distribution);
+float distribution_size(enum distribution distribution);
+long generate_bodies(struct generator *settings, struct model *model);
+
+#endif
@@ -6,7 +6,25 @@
 #include <GL/freeglut.h>
 #include <cglm/cglm.h>
 #include "math.h"
+#include "body.h"
+#include "collision.h"
+#include "domain.h"
+#include "export.h"
+#include "generator.h"
 #include "object.h"
+#include "physics.h"
+#include "pm.h"
+#include "profiler.h"
+#include "replay.h"
+#include "scene.h"
+#include "shader.h"
+#include "simulation.h"
+#include "snapshot.h"
+#include "trajectory.h"
+#include "workers.h"
+
+#define CAMERA_NEAR 0.01f // clipping planes of the projection
+#define CAMERA_FAR 100000.0f
 
 // global settings
 float fov = 80.0f; // default fov
@@ -14,133 +32,467 @@ float fov_change = 1.0f;
 vec3 camera_pos = { 0.0f, 0.0f, 0.0f };
 vec3 camera_front = { 0.0f, 0.0f, -1.0f };
 vec3 camera_up = { 0.0f, 1.0f, 0.0f }; 
-struct object *camera_lock = NULL; // is camera locked to any object?
+long camera_lock = OBJECT_HANDLE_NONE; // handle of the object the camera follows
+vec3 lock_position; // last drawn position of the followed object
+int lock_known = 0;
 float camera_yaw = -90.0f; // x rotation
 float camera_pitch = 0.0f; // y rotation
 float camera_sensitivity = 0.01f;
 float movement_speed = 2.0f;
 GLint screen_viewport[4]; // viewport: x,y,width,height
-int toggle_tracing = 0; // true or false
 long added_particles = 0;
+float simulation_dt = DEFAULT_TIMESTEP; // timestep of a single physics step
+float physics_rate = PHYSICS_DEFAULT_RATE; // physics steps per second, 0 for unlimited
+long headless_steps = 0; // run without a window for this many steps
+int simulation_threads = 0; // physics threads, 0 for one per cpu
+const char *scene_path = NULL; // .grv scene to load instead of the default one
+const char *restore_path = NULL; // snapshot to continue from
+const char *default_snapshot_path = "gravity.snapshot";
+const char *default_model_path = "assets/models/sphere.obj";
+const char *profile_path = NULL; // csv file for per frame records
+int generating = 0; // start with a generated batch of bodies
+struct generator generator = {
+    .distribution = DISTRIBUTION_PLUMMER,
+    .num = GENERATOR_DEFAULT_BODIES,
+    .seed = 1,
+    .mass = GENERATOR_DEFAULT_MASS,
+    .size = PLUMMER_DEFAULT_RADIUS,
+};
+long generated_batches = 0; // later batches continue from the seed
+
+// gpu timestamps around the drawing of a frame, read back
+// PROFILE_GPU_LATENCY frames later so that they never stall
+enum gpu_mark {
+    MARK_START,
+    MARK_INSTANCES,
+    MARK_PATHS,
+    MARKS_NUM,
+};
+
+GLuint gpu_queries[PROFILE_GPU_LATENCY][MARKS_NUM];
+long gpu_query_frames[PROFILE_GPU_LATENCY]; // frame of each set, -1 if unused
+int gpu_timers = 0; // timer queries are supported
 
 // tmp
 struct model *sphere_model;
 
 // opengl
 unsigned int shader_program;
-unsigned int vertex_shader;
-unsigned int fragment_shader;
+unsigned int instanced_program;
+unsigned int impostor_program;
+
+// uniform locations, queried once per shader (re)load
+GLint view_uniform;
+GLint projection_uniform;
+GLint translation_uniform;
+GLint color_uniform;
+GLint scale_uniform;
+GLint instanced_view_uniform;
+GLint instanced_projection_uniform;
+GLint impostor_view_uniform;
+GLint impostor_projection_uniform;
+GLint impostor_radius_uniform;
+GLint impostor_point_scale_uniform;
 
 // shaders
 const char *object_vertex_shader_location = "assets/shaders/shader.vert";
 const char *object_fragment_shader_location = "assets/shaders/shader.frag";
+const char *instanced_vertex_shader_location = "assets/shaders/instanced.vert";
+const char *impostor_vertex_shader_location = "assets/shaders/impostor.vert";
+const char *impostor_fragment_shader_location = "assets/shaders/impostor.frag";
 
-int load_shader(const char *path, unsigned int shader) {
-    FILE *fp = fopen(path, "r");
-    int len = 0;
-    char *ftext;
-
-    if (fp == NULL) {
-        fprintf(stderr, "Error: Cannot open file '%s'\n", path);
+int load_shaders() {
+    if (load_program(object_vertex_shader_location, object_fragment_shader_location, &shader_program) == -1) {
         return -1;
     }
 
-    fseek(fp, 0L, SEEK_END);
-    len = ftell(fp);
+    if (load_program(instanced_vertex_shader_location, object_fragment_shader_location, &instanced_program) == -1) {
+        return -1;
+    }
 
-    if (len == -1) {
-        fprintf(stderr, "Error: Cannot fetch length of file '%s'\n", path);
+    if (load_program(impostor_vertex_shader_location, impostor_fragment_shader_location, &impostor_program) == -1) {
         return -1;
     }
 
-    fseek(fp, 0L, SEEK_SET);
+    view_uniform = glGetUniformLocation(shader_program, "view");
+    projection_uniform = glGetUniformLocation(shader_program, "projection");
+    translation_uniform = glGetUniformLocation(shader_program, "translation");
+    color_uniform = glGetUniformLocation(shader_program, "color");
+    scale_uniform = glGetUniformLocation(shader_program, "scale");
+
+    instanced_view_uniform = glGetUniformLocation(instanced_program, "view");
+    instanced_projection_uniform = glGetUniformLocation(instanced_program, "projection");
 
-    ftext = (char *) malloc(len);
-    if (ftext == NULL) {
-        fprintf(stderr, "Error: Cannot allocate enough memory for file's contents '%s'\n", path);
-        return -1;
+    impostor_view_uniform = glGetUniformLocation(impostor_program, "view");
+    impostor_projection_uniform = glGetUniformLocation(impostor_program, "projection");
+    impostor_radius_uniform = glGetUniformLocation(impostor_program, "radius");
+    impostor_point_scale_uniform = glGetUniformLocation(impostor_program, "point_scale");
+
+    return 0;
+}
+
+void upload_model(struct model *model);
+
+// entry of an object in a state, the entries are ordered by increasing handles
+struct state_object *find_state_object(struct physics_state *state, long handle) {
+    long low = 0;
+    long high = (state->step < 0) ? 0 : state->objects_num;
+
+    while (low < high) {
+        long middle = (low + high) / 2;
+        if (state->objects[middle].handle < handle) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (low < state->objects_num && state->step >= 0 && state->objects[low].handle == handle) {
+        return &state->objects[low];
     }
 
-    fread(ftext, sizeof(char), len, fp);
-    fclose(fp);
+    return NULL;
+}
+
+// follow object if camera locked
+void follow_camera_lock(struct physics_state *current, struct physics_state *previous, float alpha) {
+    if (camera_lock == OBJECT_HANDLE_NONE || current->step < 0) {
+        return;
+    }
 
-    glShaderSource(shader, 1, (const char **) &ftext,  &len);
-    glCompileShader(shader);
+    // the followed object was merged into another one
+    struct state_object *entry = find_state_object(current, camera_lock);
+    if (entry == NULL) {
+        camera_lock = OBJECT_HANDLE_NONE;
+        lock_known = 0;
+        return;
+    }
 
-    int success;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    vec3 position;
+    struct state_object *old = find_state_object(previous, camera_lock);
+    if (old != NULL) {
+        glm_vec3_lerp(old->position, entry->position, alpha, position);
+    } else {
+        glm_vec3_copy(entry->position, position);
+    }
 
-    if (success != GL_TRUE) {
-        int log_length;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_length);
+    if (lock_known == 1) {
+        vec3 camera_movement;
+        glm_vec3_sub(position, lock_position, camera_movement);
+        glm_vec3_add(camera_pos, camera_movement, camera_pos);
+    }
 
-        char log[log_length];
-        glGetShaderInfoLog(shader, log_length, NULL, log);
+    glm_vec3_copy(position, lock_position);
+    lock_known = 1;
+}
 
-        fprintf(stderr, "Shader Compilation Error: %s\n", log);
-        return -1;
+// coarsest level that still looks like the full mesh at this size
+struct model_lod *select_lod(struct model *model, float pixels) {
+    if (pixels < model->impostors.max_pixels) {
+        return &model->impostors;
     }
 
-    free(ftext);
+    for (int level = model->lods_num - 1; level > 0; level--) {
+        if (pixels <= model->lods[level].max_pixels) {
+            return &model->lods[level];
+        }
+    }
+
+    return &model->lods[0];
+}
+
+float *add_instance(struct model_lod *lod) {
+    if (lod->instances_num == lod->instances_max) {
+        long max = (lod->instances_max == 0) ? 64 : lod->instances_max*2;
+        float *instances = (float *) reallocarray(lod->instances, max*INSTANCE_FLOATS, sizeof(float));
+        if (instances == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for instances\n");
+            return NULL;
+        }
+
+        lod->instances = instances;
+        lod->instances_max = max;
+    }
+
+    return &lod->instances[(lod->instances_num++)*INSTANCE_FLOATS];
+}
+
+// gather the per instance data of every visible object into the level of
+// detail of its model that fits its size on screen, with the positions
+// interpolated between the two latest physics states
+int prepare_instances(struct physics_state *current, struct physics_state *previous, float alpha, mat4 view, mat4 projection) {
+    struct state_object *old = previous->objects;
+    struct state_object *old_end = previous->objects + ((previous->step < 0) ? 0 : previous->objects_num);
+
+    mat4 view_projection;
+    vec4 planes[6];
+    glm_mat4_mul(projection, view, view_projection);
+    glm_frustum_planes(view_projection, planes);
+
+    // projected radius in pixels of a unit radius at unit distance
+    float pixels_per_unit = projection[1][1] * screen_viewport[3] / 2.0f;
+
+    for (struct model *model = models; model != NULL; model = model->next) {
+        for (int level = 0; level < model->lods_num; level++) {
+            model->lods[level].instances_num = 0;
+        }
+
+        model->impostors.instances_num = 0;
+    }
+
+    for (long i = 0; i < current->objects_num; i++) {
+        struct state_object *entry = &current->objects[i];
+        struct object *obj = entry->object;
+        struct model *model = obj->model;
+
+        // spawned since the last frame
+        if (model->lods[0].vao == 0) {
+            upload_model(model);
+        }
+
+        while (old < old_end && old->handle < entry->handle) {
+            old++;
+        }
+
+        vec3 position;
+        if (old < old_end && old->handle == entry->handle) {
+            glm_vec3_lerp(old->position, entry->position, alpha, position);
+        } else {
+            glm_vec3_copy(entry->position, position);
+        }
+
+        // bounding sphere entirely outside of a plane of the frustum
+        float radius = model->radius * entry->scale;
+        int outside = 0;
+        for (int plane = 0; plane < 6 && outside == 0; plane++) {
+            outside = glm_vec3_dot(planes[plane], position) + planes[plane][3] < -radius;
+        }
+
+        if (outside == 1) {
+            continue;
+        }
+
+        float depth = -(view[0][2]*position[0] + view[1][2]*position[1] + view[2][2]*position[2] + view[3][2]);
+        float pixels = radius * pixels_per_unit / fmaxf(depth, CAMERA_NEAR);
+
+        float *instance = add_instance(select_lod(model, pixels));
+        if (instance == NULL) {
+            return -1;
+        }
+
+        glm_vec3_copy(position, instance);
+        instance[3] = entry->scale;
+        memcpy(&instance[4], obj->color, 3*sizeof(float));
+    }
 
     return 0;
 }
 
-int load_shaders() {
-    glDeleteProgram(shader_program);
-    shader_program = glCreateProgram();
+void draw_lod(struct model_lod *lod) {
+    glBindBuffer(GL_ARRAY_BUFFER, lod->ibo);
+    glBufferData(GL_ARRAY_BUFFER, lod->instances_num*INSTANCE_FLOATS*sizeof(float), lod->instances, GL_STREAM_DRAW);
 
-    // create and load new shaders
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    glBindVertexArray(lod->vao);
+    if (lod->indices_num == 0) {
+        glDrawArrays(GL_POINTS, 0, lod->instances_num);
+    } else {
+        glDrawElementsInstanced(GL_TRIANGLES, lod->indices_num, GL_UNSIGNED_INT, (void *) 0, lod->instances_num);
+    }
+}
 
-    if (load_shader(object_vertex_shader_location, vertex_shader) == -1) {
-        return -1;
+// one draw call per level of detail of every model, then the impostors
+void draw_instances(mat4 view, mat4 projection) {
+    glUseProgram(instanced_program);
+    glUniformMatrix4fv(instanced_view_uniform, 1, GL_FALSE, (float *) view);
+    glUniformMatrix4fv(instanced_projection_uniform, 1, GL_FALSE, (float *) projection);
+
+    for (struct model *model = models; model != NULL; model = model->next) {
+        for (int level = 0; level < model->lods_num; level++) {
+            if (model->lods[level].instances_num != 0) {
+                draw_lod(&model->lods[level]);
+            }
+        }
     }
 
-    if (load_shader(object_fragment_shader_location, fragment_shader) == -1) {
-        return -1;
+    glUseProgram(impostor_program);
+    glUniformMatrix4fv(impostor_view_uniform, 1, GL_FALSE, (float *) view);
+    glUniformMatrix4fv(impostor_projection_uniform, 1, GL_FALSE, (float *) projection);
+    glUniform1f(impostor_point_scale_uniform, projection[1][1] * screen_viewport[3] / 2.0f);
+
+    for (struct model *model = models; model != NULL; model = model->next) {
+        if (model->impostors.instances_num != 0) {
+            glUniform1f(impostor_radius_uniform, model->radius);
+            draw_lod(&model->impostors);
+        }
+    }
+}
+
+void upload_range(int first, int count, const float *positions) {
+    glBufferSubData(GL_ARRAY_BUFFER, first*3*sizeof(float), count*3*sizeof(float), positions);
+}
+
+// upload only the positions recorded since the last upload, from the copies
+// in the state. the ring of the object belongs to the physics thread.
+void upload_path(struct physics_state *state, struct state_object *entry) {
+    struct object *obj = entry->object;
+    int max = obj->paths_max;
+
+    // the buffer is allocated once, with one extra slot that mirrors the
+    // first position so the strip continues across the wrap point
+    if (obj->pvao == 0) {
+        glGenVertexArrays(1, &obj->pvao);
+        glGenBuffers(1, &obj->pbo);
+
+        glBindVertexArray(obj->pvao);
+        glBindBuffer(GL_ARRAY_BUFFER, obj->pbo);
+        glBufferData(GL_ARRAY_BUFFER, (max+1)*3*sizeof(float), NULL, GL_DYNAMIC_DRAW);
+
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(float), (void *) 0);
+        glEnableVertexAttribArray(0);
     }
 
-    // compile object shader program
-    glAttachShader(shader_program, vertex_shader);
-    glAttachShader(shader_program, fragment_shader);
-    glLinkProgram(shader_program);
+    // cleared since the last upload, the ring starts over
+    if (obj->paths_uploaded_clears != entry->paths_clears) {
+        obj->paths_uploaded_clears = entry->paths_clears;
+        obj->paths_uploaded = 0;
+    }
+
+    long pending = entry->paths_recorded - obj->paths_uploaded;
+    if (pending > entry->paths_new) {
+        pending = entry->paths_new;
+    }
 
-    int success;
-    glGetProgramiv(shader_program, GL_LINK_STATUS, &success);
+    if (pending <= 0) {
+        return;
+    }
 
-    if (success != GL_TRUE) {
-        int log_length;
-        glGetProgramiv(shader_program, GL_INFO_LOG_LENGTH, &log_length);
+    glBindBuffer(GL_ARRAY_BUFFER, obj->pbo);
 
-        char log[log_length];
-        glGetProgramInfoLog(shader_program, log_length, NULL, log);
+    // the newest positions are the last ones of the copy
+    float *positions = state->paths + (entry->paths_first + entry->paths_new - pending)*3;
+    int first = (entry->paths_head - pending + max) % max;
+    int wrapped = (first + pending > max) ? first + pending - max : 0;
 
-        fprintf(stderr, "[object program] Shader Compilation Error: %s\n", log);
-        return -1;
+    upload_range(first, pending - wrapped, positions);
+    if (wrapped > 0) {
+        upload_range(0, wrapped, positions + (pending - wrapped)*3);
     }
 
-    glDeleteShader(vertex_shader);
-    glDeleteShader(fragment_shader);
+    // the ring slot 0 holds the position at index max - first of the copy
+    if (first == 0 || wrapped > 0) {
+        upload_range(max, 1, positions + ((max - first) % max)*3);
+    }
 
-    return 0;
+    obj->paths_uploaded = entry->paths_recorded;
 }
 
-void display() {
+void draw_path(struct state_object *entry) {
+    struct object *obj = entry->object;
+    glBindVertexArray(obj->pvao);
+
+    // not wrapped yet, or the oldest position is at the start
+    if (entry->paths_num < obj->paths_max || entry->paths_head == 0) {
+        glDrawArrays(GL_LINE_STRIP, 0, entry->paths_num);
+        return;
+    }
+
+    // oldest part up to the mirrored first position, then the newest part
+    GLint firsts[2] = { entry->paths_head, 0 };
+    GLsizei counts[2] = { obj->paths_max - entry->paths_head + 1, entry->paths_head };
+    glMultiDrawArrays(GL_LINE_STRIP, firsts, counts, 2);
+}
+
+// release the buffers of objects the simulation removed, once no state
+// held by the renderer refers to them
+void release_object(struct object *obj) {
+    if (obj->pvao != 0) {
+        glDeleteVertexArrays(1, &obj->pvao);
+        glDeleteBuffers(1, &obj->pbo);
+    }
+}
+
+void setup_gpu_timers() {
+    if (!GLEW_ARB_timer_query) {
+        fprintf(stdout, "Status: no gpu timer queries, profiling the cpu only\n");
+        return;
+    }
+
+    for (int i = 0; i < PROFILE_GPU_LATENCY; i++) {
+        glGenQueries(MARKS_NUM, gpu_queries[i]);
+        gpu_query_frames[i] = -1;
+    }
+
+    gpu_timers = 1;
+}
+
+void mark_gpu(enum gpu_mark mark) {
+    if (gpu_timers == 1) {
+        glQueryCounter(gpu_queries[profile_frame() % PROFILE_GPU_LATENCY][mark], GL_TIMESTAMP);
+    }
+}
+
+// results of the frame that used this set of queries before
+void read_gpu_timers() {
+    if (gpu_timers == 0) {
+        return;
+    }
+
+    int set = profile_frame() % PROFILE_GPU_LATENCY;
+    long frame = gpu_query_frames[set];
+    gpu_query_frames[set] = profile_frame();
+
+    if (frame < 0) {
+        return;
+    }
+
+    GLint available = 0;
+    glGetQueryObjectiv(gpu_queries[set][MARKS_NUM-1], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available == 0) {
+        return;
+    }
+
+    GLuint64 times[MARKS_NUM];
+    for (int mark = 0; mark < MARKS_NUM; mark++) {
+        glGetQueryObjectui64v(gpu_queries[set][mark], GL_QUERY_RESULT, &times[mark]);
+    }
+
+    profile_record(frame, PHASE_GPU_INSTANCES, (times[MARK_INSTANCES] - times[MARK_START]) * 1e-9);
+    profile_record(frame, PHASE_GPU_PATHS, (times[MARK_PATHS] - times[MARK_INSTANCES]) * 1e-9);
+    profile_record(frame, PHASE_GPU_FRAME, (times[MARK_PATHS] - times[MARK_START]) * 1e-9);
+}
+
+// text drawn with the fixed function pipeline, line by line from the top
+void draw_overlay() {
+    char report[2048];
+    profile_report(report, sizeof(report));
+
+    glUseProgram(0);
+    glDisable(GL_DEPTH_TEST);
+    glColor3f(0.9f, 0.9f, 0.9f);
+
+    int line = 0;
+    for (char *text = strtok(report, "\n"); text != NULL; text = strtok(NULL, "\n")) {
+        glWindowPos2i(10, screen_viewport[3] - 20 - line*15);
+        glutBitmapString(GLUT_BITMAP_8_BY_13, (const unsigned char *) text);
+        line++;
+    }
+
+    glEnable(GL_DEPTH_TEST);
+}
+
+// the scene between two states into the bound framebuffer
+int draw_scene(struct physics_state *current, struct physics_state *previous, float alpha) {
+    // objects, culled and drawn at the level of detail of their size
+    profile_begin(PHASE_INSTANCES);
+
+    follow_camera_lock(current, previous, alpha);
+
     mat4 view;
     mat4 projection;
 
-    GLint translation_uniform;
-    GLint view_uniform;
-    GLint projection_uniform;
-    GLint color_uniform;
-    GLint scale_uniform;
-
     glClearColor(0.13f, 0.13f, 0.13f, 0.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glGetIntegerv(GL_VIEWPORT, screen_viewport);
-    glUseProgram(shader_program);
 
     glm_mat4_identity(view);
     vec3 camera_center;
@@ -148,131 +500,314 @@ void display() {
     glm_lookat(camera_pos, camera_center, camera_up, view);
 
     glm_mat4_identity(projection);
-    glm_perspective(glm_rad(fov), (float) screen_viewport[2]/(float) screen_viewport[3], 0.01f, 100000.0f, projection);
+    glm_perspective(glm_rad(fov), (float) screen_viewport[2]/(float) screen_viewport[3], CAMERA_NEAR, CAMERA_FAR, projection);
 
-    view_uniform = glGetUniformLocation(shader_program, "view");
-    projection_uniform = glGetUniformLocation(shader_program, "projection");
-    translation_uniform = glGetUniformLocation(shader_program, "translation");
-    color_uniform = glGetUniformLocation(shader_program, "color");
-    scale_uniform = glGetUniformLocation(shader_program, "scale");
+    if (prepare_instances(current, previous, alpha, view, projection) == -1) {
+        return -1;
+    }
+
+    mark_gpu(MARK_START);
+    draw_instances(view, projection);
+
+    mark_gpu(MARK_INSTANCES);
+    profile_end(PHASE_INSTANCES);
+
+    // paths
+    mat4 translation_matrix;
+    glm_mat4_identity(translation_matrix);
 
+    glUseProgram(shader_program);
     glUniformMatrix4fv(view_uniform, 1, GL_FALSE, (float *) view);
     glUniformMatrix4fv(projection_uniform, 1, GL_FALSE, (float *) projection);
+    glUniformMatrix4fv(translation_uniform, 1, GL_FALSE, (float *) translation_matrix);
+    glUniform1f(scale_uniform, 1.0f);
+
+    // all uploads first, so they can be timed apart from the draws
+    profile_begin(PHASE_PATH_UPLOADS);
+    for (long i = 0; i < current->objects_num; i++) {
+        if (current->objects[i].paths_num != 0) {
+            upload_path(current, &current->objects[i]);
+        }
+    }
+    profile_end(PHASE_PATH_UPLOADS);
 
-    for (struct object *obj = objects; obj != NULL; obj = obj->next) {
-        mat4 translation_matrix;
-        glm_mat4_identity(translation_matrix);
-        struct model *obj_model = obj->model;
+    profile_begin(PHASE_PATH_DRAWS);
+    for (long i = 0; i < current->objects_num; i++) {
+        struct state_object *entry = &current->objects[i];
+        if (entry->paths_num == 0) {
+            continue;
+        }
 
-        // calculate gravity
-        for (struct object *target = objects; target != NULL; target = target->next) {
-            if (target == obj) {
-                continue;
-            }
+        glUniform3fv(color_uniform, 1, (float *) entry->object->color);
+        draw_path(entry);
+    }
+    profile_end(PHASE_PATH_DRAWS);
 
-            vec3 force;
-            glm_vec3_zero(force);
-            calculate_gravity(obj, target, force);
+    mark_gpu(MARK_PATHS);
 
-            vec4 force_new;
-            for (int i = 0; i < 3; i++) {
-                force_new[i] = force[i];
-            }
-            force_new[3] = 0.0f;
+    return 0;
+}
 
-            float n = obj->mass;
-            vec4 scaler = {n,n,n,1.0f};
-            glm_vec4_div(force_new, scaler, force_new);
+void display() {
+    profile_begin(PHASE_FRAME);
+    read_gpu_timers();
 
-            glm_vec4_add(force_new, obj->translation_force, obj->translation_force);
-        }
+    if (physics_failed() == 1) {
+        exit(EXIT_FAILURE);
+    }
 
-        glm_vec4_add(obj->position, obj->translation_force, obj->position);
+    struct physics_state *current;
+    struct physics_state *previous;
+    float alpha = 1.0f;
 
-        // follow object if camera locked 
-        if (camera_lock == obj) {
-            glm_vec3_add(camera_pos, obj->translation_force, camera_pos);
+    // a replay is drawn from its recorded frames, nothing is stepped
+    if (replay_path != NULL) {
+        if (replay_take(&current, &previous, &alpha) == -1) {
+            exit(EXIT_FAILURE);
         }
-
-        // record path
-        if (toggle_tracing == 1) {
-            if (record_path(obj) == -1) {
-                exit(EXIT_FAILURE);
-            }
+    } else {
+        physics_take(&current, &previous);
+        physics_release_objects(release_object);
+
+        // draw between the two latest steps, a step behind the physics
+        double interval = current->published - previous->published;
+        if (previous->step >= 0 && interval > 0.0) {
+            alpha = glm_clamp((float) ((physics_time() - current->published) / interval), 0.0f, 1.0f);
         }
+    }
 
-        glm_translate(translation_matrix, obj->position);
+    if (draw_scene(current, previous, alpha) == -1) {
+        exit(EXIT_FAILURE);
+    }
 
-        glUniformMatrix4fv(translation_uniform, 1, GL_FALSE, (float *) translation_matrix);
+    if (profile_overlay == 1) {
+        draw_overlay();
+    }
 
-        glUniform3fv(color_uniform, 1, (float *) obj->color);
-        glUniform1f(scale_uniform, obj->scale);
+    glutPostRedisplay();
 
-        glBindVertexArray(obj->vao);
-        glDrawElements(GL_TRIANGLES, obj_model->indices_num, GL_UNSIGNED_INT, (void *) 0);
+    profile_begin(PHASE_SWAP);
+    glutSwapBuffers();
+    profile_end(PHASE_SWAP);
 
-        glBindVertexArray(obj->pvao);
+    profile_end(PHASE_FRAME);
+    profile_end_frame();
+}
 
-        glBindBuffer(GL_ARRAY_BUFFER, obj->pbo);
-        glBufferData(GL_ARRAY_BUFFER, obj->paths_num*3*sizeof(float),obj->paths, GL_STATIC_DRAW);
+// release retired objects right away, the exported frames are drawn from
+// states captured on the same thread
+void release_retired_objects() {
+    struct object *obj = take_retired_objects();
 
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(float), (void *) 0);
-        glEnableVertexAttribArray(0);
+    while (obj != NULL) {
+        struct object *next = obj->next;
+        release_object(obj);
+        free_object(obj);
+        obj = next;
+    }
+}
+
+// every export_interval-th step is drawn offscreen and read back
+int export_step(long step) {
+    static struct physics_state state;
 
-        glm_mat4_identity(translation_matrix);
-        glUniformMatrix4fv(translation_uniform, 1, GL_FALSE, (float *) translation_matrix);
-        glUniform1f(scale_uniform, 1.0f);
+    release_retired_objects();
 
-        glDrawArrays(GL_LINE_STRIP, 0, obj->paths_num);
+    if ((step + 1) % export_interval != 0) {
+        return 0;
     }
 
-    glutPostRedisplay();
-    glutSwapBuffers();
+    read_gpu_timers();
+
+    if (physics_capture(&state, 1) == -1 || draw_scene(&state, &state, 1.0f) == -1) {
+        return -1;
+    }
+
+    profile_begin(PHASE_EXPORT);
+    int result = export_frame();
+    profile_end(PHASE_EXPORT);
+
+    return result;
 }
 
-void setup() {
-    // setup default mouse position
-    glGetIntegerv(GL_VIEWPORT, screen_viewport);
+// impostors have no mesh, their instance data is per point
+void upload_lod(struct model_lod *lod) {
+    glGenVertexArrays(1, &lod->vao);
+    glGenBuffers(1, &lod->ibo);
 
-    for (struct object *obj = objects; obj != NULL; obj = obj->next) {
-        struct model *obj_model = obj->model;
-        glGenVertexArrays(1, &obj->vao);
-        glGenVertexArrays(1, &obj->pvao);
-        glGenBuffers(1, &obj->vbo);
-        glGenBuffers(1, &obj->ebo);
-        glGenBuffers(1, &obj->nbo);
-        glGenBuffers(1, &obj->pbo);
+    glBindVertexArray(lod->vao);
 
-        glBindVertexArray(obj->vao);
+    if (lod->indices_num > 0) {
+        glGenBuffers(1, &lod->vbo);
+        glGenBuffers(1, &lod->ebo);
+        glGenBuffers(1, &lod->nbo);
 
-        glBindBuffer(GL_ARRAY_BUFFER,obj->vbo);
-        glBufferData(GL_ARRAY_BUFFER,obj_model->vertices_num*3*sizeof(float),obj_model->vertices, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, lod->vbo);
+        glBufferData(GL_ARRAY_BUFFER, lod->vertices_num*3*sizeof(float), lod->vertices, GL_STATIC_DRAW);
 
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(float), (void *) 0);
         glEnableVertexAttribArray(0);
 
-        glBindBuffer(GL_ARRAY_BUFFER, obj->nbo);
-        glBufferData(GL_ARRAY_BUFFER, obj_model->normals_num*3*sizeof(float), obj_model->normals, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, lod->nbo);
+        glBufferData(GL_ARRAY_BUFFER, lod->vertices_num*3*sizeof(float), lod->normals, GL_STATIC_DRAW);
 
         glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3*sizeof(float), (void *) 0);
         glEnableVertexAttribArray(1);
+    }
+
+    // per instance position, scale and color
+    GLuint divisor = (lod->indices_num > 0) ? 1 : 0;
+    glBindBuffer(GL_ARRAY_BUFFER, lod->ibo);
+
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, INSTANCE_FLOATS*sizeof(float), (void *) 0);
+    glEnableVertexAttribArray(2);
+    glVertexAttribDivisor(2, divisor);
+
+    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, INSTANCE_FLOATS*sizeof(float), (void *) (3*sizeof(float)));
+    glEnableVertexAttribArray(3);
+    glVertexAttribDivisor(3, divisor);
+
+    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, INSTANCE_FLOATS*sizeof(float), (void *) (4*sizeof(float)));
+    glEnableVertexAttribArray(4);
+    glVertexAttribDivisor(4, divisor);
+
+    if (lod->indices_num > 0) {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lod->ebo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, lod->indices_num*sizeof(unsigned int), lod->indices, GL_STATIC_DRAW);
+    }
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER,obj->ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, obj_model->indices_num*sizeof(unsigned int), obj_model->indices, GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// upload a model once, all of its objects share the buffers
+void upload_model(struct model *model) {
+    if (model->lods[0].vao != 0) {
+        return;
+    }
 
-        glBindVertexArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    for (int level = 0; level < model->lods_num; level++) {
+        upload_lod(&model->lods[level]);
+    }
+
+    upload_lod(&model->impostors);
+}
+
+void setup() {
+    // setup default mouse position
+    glGetIntegerv(GL_VIEWPORT, screen_viewport);
+
+    for (struct model *model = models; model != NULL; model = model->next) {
+        upload_model(model);
     }
 
     glEnable(GL_DEPTH_TEST);
+    glEnable(GL_PROGRAM_POINT_SIZE);
+}
+
+// a batch in front of the camera, far enough to be seen whole
+void place_in_view(struct generator *settings) {
+    glm_vec3_scale(camera_front, 2.0f * settings->size, settings->center);
+    glm_vec3_add(camera_pos, settings->center, settings->center);
+}
+
+// every export_interval-th frame of the replayed recording
+int export_replay(void) {
+    if (export_open() != 0) {
+        return -1;
+    }
+
+    int result = 0;
+    for (long frame = 0; frame < replay_frames() && result == 0; frame += export_interval) {
+        struct physics_state *state;
+
+        read_gpu_timers();
+        if (replay_frame(frame, &state) == -1 || draw_scene(state, state, 1.0f) == -1) {
+            result = -1;
+            break;
+        }
+
+        profile_begin(PHASE_EXPORT);
+        result = export_frame();
+        profile_end(PHASE_EXPORT);
+    }
+
+    result |= export_close();
+    return result;
+}
+
+// playback keys while replaying, the keys that change the simulation do
+// nothing. returns 1 if the key was taken.
+int replay_keyboard(unsigned char key) {
+    if (key >= '0' && key <= '9') {
+        replay_seek((key - '0') / 10.0 * (replay_frames() - 1));
+        return 1;
+    }
+
+    switch (key) {
+        case ' ':
+            replay_toggle();
+            return 1;
+        case '+':
+            replay_scale_speed(2.0);
+            return 1;
+        case '-':
+            replay_scale_speed(0.5);
+            return 1;
+        case 'v':
+        case 'V':
+            replay_reverse();
+            return 1;
+        case ',':
+            replay_step(-1);
+            return 1;
+        case '.':
+            replay_step(1);
+            return 1;
+        case '<':
+            replay_seek(replay_position() - replay_frames() / 10.0);
+            return 1;
+        case '>':
+            replay_seek(replay_position() + replay_frames() / 10.0);
+            return 1;
+        case 't':
+        case 'T':
+        case 'p':
+        case 'P':
+        case 'b':
+        case 'B':
+        case 'm':
+        case 'M':
+        case 'g':
+        case 'G':
+        case 'c':
+        case 'C':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// also the exit handler, closing the window exits from within glut while
+// the physics thread may still be stepping
+static void stop_physics(void) {
+    physics_stop();
+    wait_snapshot();
+    trajectory_close();
 }
 
 void keyboard(unsigned char key, int x, int y) {
+    if (replay_path != NULL && replay_keyboard(key) == 1) {
+        return;
+    }
+
     switch (key) {
         case '\x1B':
         {
-            exit(EXIT_SUCCESS);
+            physics_stop();
+            wait_snapshot();
+            exit((trajectory_close() == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
             break;
         }
         case 'r':
@@ -319,33 +854,56 @@ void keyboard(unsigned char key, int x, int y) {
             glm_vec3_add(camera_pos, front_scalar, camera_pos);
             break;
         }
+        // the simulation belongs to the physics thread, changes are queued
         case 't':
         case 'T':
-            toggle_tracing = !toggle_tracing;
-            if (toggle_tracing == 0) {
-                break;
-            }
-
-            // remove all the recorded paths of objects
-            for (struct object *obj = objects; obj != NULL; obj = obj->next) {
-                obj->paths_num=0;
-                free(obj->paths);
-                obj->paths = NULL;
-            }
+            physics_send(&(struct physics_command) { .type = COMMAND_TRACING });
+            break;
+        case 'p':
+        case 'P': {
+            const char *path = (checkpoint_path != NULL) ? checkpoint_path : default_snapshot_path;
+            physics_send(&(struct physics_command) { .type = COMMAND_SNAPSHOT, .path = path });
+            break;
+        }
+        case 'b':
+        case 'B':
+            physics_send(&(struct physics_command) { .type = COMMAND_SOLVER });
             break;
+        case 'o':
+        case 'O':
+            profile_overlay = !profile_overlay;
+            break;
+        case 'm':
+        case 'M':
+            physics_send(&(struct physics_command) { .type = COMMAND_COLLISIONS });
+            break;
+        case 'g':
+        case 'G': {
+            struct physics_command generate = {
+                .type = COMMAND_GENERATE,
+                .model = sphere_model,
+                .generator = generator,
+            };
+
+            generate.generator.seed = generator.seed + (++generated_batches);
+            place_in_view(&generate.generator);
+            physics_send(&generate);
+            break;
+        }
         case 'c':
         case 'C': {
             added_particles++;
             fprintf(stdout, "INFO: ADDED PARTICLES COUNT %ld\n", added_particles);
-            struct object *a = create_object(1000000.0f, sphere_model);
-
-            float n = 0.05f;
-            vec4 a_pos = {frand48() * 100, frand48() * 100, -150.0f, 0.0f};
-            glm_vec4_add(a->position, a_pos, a->position);
+            struct physics_command spawn = {
+                .type = COMMAND_SPAWN,
+                .model = sphere_model,
+                .mass = 1000000.0f,
+                .position = {frand48() * 100, frand48() * 100, -150.0f},
+            };
 
             //vec3 a_boost = {-10 * n, 0.0f, 0.0f};
-            //glm_vec3_add(a->translation_force, a_boost, a->translation_force);
-            setup();
+            //boost_body(a->body, a_boost);
+            physics_send(&spawn);
             break;
         }
         default:
@@ -411,25 +969,541 @@ void mouse_motion(int x, int y) {
     glm_normalize_to(view_direction, camera_front);
 }
 
+void setup_scene(struct model *model) {
+    struct object *a = create_object(100000000.0f, model);
+    struct object *b = create_object(100000.0f, model);
+    float distance = -500.0f;
+
+    vec3 a_pos = {0.0f, 0.0f, distance};
+    translate_body(a->body, a_pos);
+    vec3 b_pos= {100.0f, 300.0f, distance};
+    translate_body(b->body, b_pos);
+    //vec3 a_pos = {0.0f, -0.0f, -150.0f};
+    //translate_body(a->body, a_pos);
+
+    // vec3 b_pos = {0.0f, -75.0f, -150.0f};
+    // translate_body(b->body, b_pos);
+
+    float n = 0.05f;
+
+    vec3 b_boost = {-70*n, 0.0f, 0.0f};
+
+    boost_body(b->body, b_boost);
+
+    // b->scale = 2.0f;
+    a->scale = 5.0f;
+    b->scale = 10.0f;
+//    camera_lock = b->handle;
+}
+
+// the trajectory starts with the initial state
+int start_trajectory(void) {
+    if (trajectory_path == NULL) {
+        return 0;
+    }
+
+    if (trajectory_open(simulation_dt) != 0) {
+        return -1;
+    }
+
+    return record_trajectory(simulation_steps);
+}
+
+int parse_arguments(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--headless' expects a number of steps\n");
+                return -1;
+            }
+
+            headless_steps = strtol(argv[++i], NULL, 10);
+            if (headless_steps <= 0) {
+                fprintf(stderr, "Error: invalid number of headless steps '%s'\n", argv[i]);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--kernel") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--kernel' expects a kernel name\n");
+                return -1;
+            }
+
+            if (select_gravity_kernel(argv[++i]) != 0) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--solver") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--solver' expects a solver name\n");
+                return -1;
+            }
+
+            if (select_force_solver(argv[++i]) != 0) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--grid") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--grid' expects a number of cells\n");
+                return -1;
+            }
+
+            particle_mesh_grid = atoi(argv[++i]);
+            if (particle_mesh_grid < PM_MIN_GRID || (particle_mesh_grid & (particle_mesh_grid-1)) != 0) {
+                fprintf(stderr, "Error: invalid grid size '%s', expected a power of two of at least %d\n", argv[i], PM_MIN_GRID);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--theta") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--theta' expects an opening angle\n");
+                return -1;
+            }
+
+            barnes_hut_theta = strtof(argv[++i], NULL);
+            if (barnes_hut_theta < 0.0f) {
+                fprintf(stderr, "Error: invalid opening angle '%s'\n", argv[i]);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--threads") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--threads' expects a number of threads\n");
+                return -1;
+            }
+
+            simulation_threads = strtol(argv[++i], NULL, 10);
+            if (simulation_threads < 0) {
+                fprintf(stderr, "Error: invalid number of threads '%s'\n", argv[i]);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--processes") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--processes' expects a number of processes\n");
+                return -1;
+            }
+
+            domain_processes = strtol(argv[++i], NULL, 10);
+            if (domain_processes < 1 || domain_processes > DOMAIN_MAX_PROCESSES) {
+                fprintf(stderr, "Error: invalid number of processes '%s', expected 1 to %d\n", argv[i], DOMAIN_MAX_PROCESSES);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--scene") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--scene' expects a scene file\n");
+                return -1;
+            }
+
+            scene_path = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--checkpoint") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--checkpoint' expects a snapshot file\n");
+                return -1;
+            }
+
+            checkpoint_path = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--checkpoint-every") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--checkpoint-every' expects a number of steps\n");
+                return -1;
+            }
+
+            checkpoint_interval = strtol(argv[++i], NULL, 10);
+            if (checkpoint_interval <= 0) {
+                fprintf(stderr, "Error: invalid checkpoint interval '%s'\n", argv[i]);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--restore") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--restore' expects a snapshot file\n");
+                return -1;
+            }
+
+            restore_path = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--integrator") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--integrator' expects an integrator name\n");
+                return -1;
+            }
+
+            if (select_integrator(argv[++i]) != 0) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--eta") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--eta' expects an accuracy parameter\n");
+                return -1;
+            }
+
+            block_eta = strtof(argv[++i], NULL);
+            if (block_eta <= 0.0f) {
+                fprintf(stderr, "Error: invalid accuracy parameter '%s'\n", argv[i]);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--profile") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--profile' expects a file name\n");
+                return -1;
+            }
+
+            profile_path = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--collisions") == 0) {
+            collisions_enabled = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--export") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--export' expects a directory\n");
+                return -1;
+            }
+
+            export_directory = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--export-every") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--export-every' expects a number of steps\n");
+                return -1;
+            }
+
+            export_interval = strtol(argv[++i], NULL, 10);
+            if (export_interval <= 0) {
+                fprintf(stderr, "Error: invalid export interval '%s'\n", argv[i]);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--export-size") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--export-size' expects a size like 1280x720\n");
+                return -1;
+            }
+
+            if (sscanf(argv[++i], "%dx%d", &export_width, &export_height) != 2 || export_width <= 0 || export_height <= 0) {
+                fprintf(stderr, "Error: invalid export size '%s'\n", argv[i]);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--export-format") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--export-format' expects a format name\n");
+                return -1;
+            }
+
+            if (select_export_format(argv[++i]) != 0) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--rate") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--rate' expects a number of steps per second\n");
+                return -1;
+            }
+
+            physics_rate = strtof(argv[++i], NULL);
+            if (physics_rate < 0.0f) {
+                fprintf(stderr, "Error: invalid physics rate '%s'\n", argv[i]);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--replay") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--replay' expects a trajectory file\n");
+                return -1;
+            }
+
+            replay_path = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--trajectory") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--trajectory' expects a file name\n");
+                return -1;
+            }
+
+            trajectory_path = argv[++i];
+            continue;
+        }
+
+        if (strcmp(argv[i], "--trajectory-every") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--trajectory-every' expects a number of steps\n");
+                return -1;
+            }
+
+            trajectory_interval = strtol(argv[++i], NULL, 10);
+            if (trajectory_interval <= 0) {
+                fprintf(stderr, "Error: invalid trajectory interval '%s'\n", argv[i]);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--trajectory-format") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--trajectory-format' expects a format name\n");
+                return -1;
+            }
+
+            if (select_trajectory_encoding(argv[++i]) != 0) {
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--generate") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--generate' expects a distribution name\n");
+                return -1;
+            }
+
+            if (select_distribution(&generator, argv[++i]) != 0) {
+                return -1;
+            }
+
+            generating = 1;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--generate-bodies") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--generate-bodies' expects a number of bodies\n");
+                return -1;
+            }
+
+            generator.num = strtol(argv[++i], NULL, 10);
+            if (generator.num <= 0) {
+                fprintf(stderr, "Error: invalid number of bodies '%s'\n", argv[i]);
+                return -1;
+            }
+
+            continue;
+        }
+
+        if (strcmp(argv[i], "--seed") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--seed' expects a number\n");
+                return -1;
+            }
+
+            generator.seed = strtoul(argv[++i], NULL, 10);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--dt") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "Error: '--dt' expects a timestep\n");
+                return -1;
+            }
+
+            simulation_dt = strtof(argv[++i], NULL);
+            if (simulation_dt <= 0.0f) {
+                fprintf(stderr, "Error: invalid timestep '%s'\n", argv[i]);
+                return -1;
+            }
+
+            continue;
+        }
+    }
+
+    return 0;
+}
+
 int main(int argc, char **argv) {
     srandom(time(NULL));
 
-    glutInit(&argc, argv);
-    glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE);
-    glutCreateWindow("gravity");
+    if (parse_arguments(argc, argv) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    // the domain processes are forked before any thread is started
+    if (domain_processes > 1 && replay_path == NULL) {
+        if (integrator == INTEGRATOR_BLOCK) {
+            fprintf(stderr, "Error: the block integrator cannot be split across processes\n");
+            return EXIT_FAILURE;
+        }
+
+        if (domain_start(domain_processes, simulation_threads) != 0) {
+            return EXIT_FAILURE;
+        }
+
+        atexit(domain_stop);
+    }
+
+    if (workers_init(simulation_threads) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    // records still waiting for gpu times are written on exit
+    if (profile_path != NULL) {
+        if (profile_open(profile_path) != 0) {
+            return EXIT_FAILURE;
+        }
+
+        atexit(profile_close);
+    }
+
+    if (export_directory != NULL && headless_steps == 0 && replay_path == NULL) {
+        fprintf(stderr, "Error: '--export' expects '--headless <steps>' or '--replay <file>'\n");
+        return EXIT_FAILURE;
+    }
 
+    // a replay only draws, it steps and records nothing
+    if (replay_path != NULL) {
+        if (headless_steps > 0 || trajectory_path != NULL) {
+            fprintf(stderr, "Error: '--replay' cannot be combined with '--headless' or '--trajectory'\n");
+            return EXIT_FAILURE;
+        }
+
+        if (replay_open(replay_path, (physics_rate > 0.0f) ? physics_rate : PHYSICS_DEFAULT_RATE) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // run physics only, without touching GLUT or GLEW
+    if (headless_steps > 0 && export_directory == NULL) {
+        if (restore_path != NULL) {
+            if (load_snapshot(restore_path, 0, NULL, &simulation_steps) != 0) {
+                return EXIT_FAILURE;
+            }
+        } else if (scene_path != NULL && load_scene(scene_path, 0) != 0) {
+            return EXIT_FAILURE;
+        } else if (scene_path == NULL && generating == 0) {
+            setup_scene(NULL);
+        }
+
+        // generated bodies replace the default scene or join the loaded one
+        if (generating == 1) {
+            place_in_view(&generator);
+            if (generate_bodies(&generator, NULL) == -1) {
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (start_trajectory() != 0) {
+            return EXIT_FAILURE;
+        }
+
+        int result = run_headless(headless_steps, simulation_dt, NULL);
+        if (trajectory_close() != 0 || result != 0) {
+            return EXIT_FAILURE;
+        }
+
+        if (profile_path != NULL) {
+            char report[2048];
+            profile_report(report, sizeof(report));
+            fprintf(stdout, "%s", report);
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    // models are read on other threads while the context and the shaders
+    // are set up
+    if (queue_model_load(default_model_path) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    // the bodies of the scene are read here, the objects are attached once
+    // the models are loaded
+    if (replay_path == NULL && restore_path == NULL && scene_path != NULL && load_scene(scene_path, 1) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (start_model_loads() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    // frames are exported without a window
+    if (export_directory != NULL) {
+        if (export_context() != 0) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        glutInit(&argc, argv);
+        glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE);
+        glutCreateWindow("gravity");
+    }
+
+    // without a window there is no glx display, the functions load regardless
     GLenum err = glewInit();
-    if (err != GLEW_OK) {
+    if (err != GLEW_OK && !(export_directory != NULL && err == GLEW_ERROR_NO_GLX_DISPLAY)) {
         fprintf(stderr, "Error: %s\n", glewGetErrorString(err));
         return EXIT_FAILURE;
     }
 
     fprintf(stdout, "Status: using with GLEW %s\n", glewGetString(GLEW_VERSION));
 
-    glutKeyboardFunc(&keyboard);
-    glutMouseFunc(&mouse);
-    glutPassiveMotionFunc(&mouse_motion);
-    glutDisplayFunc(&display);
+    if (export_directory == NULL) {
+        glutKeyboardFunc(&keyboard);
+        glutMouseFunc(&mouse);
+        glutPassiveMotionFunc(&mouse_motion);
+        glutDisplayFunc(&display);
+    }
 
     if (load_shaders() != 0) {
         fprintf(stderr, "Error: loading shaders\n");
@@ -437,39 +1511,87 @@ int main(int argc, char **argv) {
     }
 
     // scene setup
-    sphere_model = load_model("assets/models/sphere.obj");
+    wait_model_loads();
+    sphere_model = load_model(default_model_path);
     if (sphere_model == NULL) {
         fprintf(stderr, "Error: loading model");
         return EXIT_FAILURE;
     }
 
-    struct object *a = create_object(100000000.0f, sphere_model);
-    struct object *b = create_object(100000.0f, sphere_model);
-    float distance = -500.0f;
+    if (replay_path != NULL) {
+        if (replay_attach(sphere_model) != 0) {
+            return EXIT_FAILURE;
+        }
+    } else if (restore_path != NULL) {
+        if (load_snapshot(restore_path, 1, sphere_model, &simulation_steps) != 0) {
+            return EXIT_FAILURE;
+        }
+    } else if (scene_path != NULL && attach_scene_models() != 0) {
+        return EXIT_FAILURE;
+    } else if (scene_path == NULL && generating == 0) {
+        setup_scene(sphere_model);
+    }
 
-    vec4 a_pos = {0.0f, 0.0f, distance, 0.0f};
-    glm_vec4_add(a->position, a_pos, a->position);
-    vec4 b_pos= {100.0f, 300.0f, distance, 0.0f};
-    glm_vec4_add(b->position, b_pos, b->position);
-    //vec4 a_pos = {0.0f, -0.0f, -150.0f, 0.0f};
-    //glm_vec4_add(a->position, a_pos, a->position);
+    if (generating == 1 && replay_path == NULL) {
+        place_in_view(&generator);
+        if (generate_bodies(&generator, sphere_model) == -1) {
+            return EXIT_FAILURE;
+        }
+    }
 
-    // vec4 b_pos = {0.0f, -75.0f, -150.0f, 0.0f};
-    // glm_vec4_add(b->position, b_pos, b->position);
+    setup();
+    setup_gpu_timers();
 
-    float n = 0.05f;
+    if (replay_path != NULL && export_directory != NULL) {
+        int result = export_replay();
+        replay_close();
+        return (result == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    vec3 b_boost = {-70*n, 0.0f, 0.0f};
+    // steps on the main thread, which also draws and reads back the frames
+    if (export_directory != NULL) {
+        if (export_open() != 0) {
+            return EXIT_FAILURE;
+        }
 
-    glm_vec3_add(b->translation_force, b_boost , b->translation_force);
+        if (start_trajectory() != 0) {
+            return EXIT_FAILURE;
+        }
 
-    // b->scale = 2.0f;
-    a->scale = 5.0f;
-    b->scale = 10.0f;
-//    camera_lock = b;
+        int result = run_headless(headless_steps, simulation_dt, export_step);
+        result |= export_close();
+        if (trajectory_close() != 0 || result != 0) {
+            return EXIT_FAILURE;
+        }
 
+        if (profile_path != NULL) {
+            char report[2048];
+            profile_report(report, sizeof(report));
+            fprintf(stdout, "%s", report);
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    if (replay_path != NULL) {
+        glutMainLoop();
+        return EXIT_SUCCESS;
+    }
+
+    if (start_trajectory() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    // the physics steps on its own thread from here on, the main thread
+    // only draws the states it publishes
+    if (physics_start(simulation_dt, physics_rate, 0) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    // runs before the handlers registered earlier, which close the files
+    // the physics thread writes to
+    atexit(stop_physics);
 
-    setup();
     glutMainLoop();
 
     return EXIT_SUCCESS;
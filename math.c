@@ -1,6 +1,13 @@
 #include "math.h"
-#include "object.h"
+#include "body.h"
+#include "workers.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
 #include <cglm/cglm.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 float frand48(void) {
     float number = (float) rand() / (float) (RAND_MAX + 1.0);
@@ -12,31 +19,445 @@ float frand48(void) {
     return number;
 }
 
-void calculate_gravity(struct object *src, struct object *target, vec3 force) {
-    vec4 v4distance;
-    glm_vec4_sub(target->position, src->position, v4distance);
+// the force law of gravity_acceleration. every pair is evaluated once and
+// the equal and opposite contribution is applied to both bodies. the
+// kernels handle the rows first, first+stride, ... and accumulate into the
+// given arrays, which are private to the calling thread when several
+// threads share the work.
+static void accumulate_row_scalar(struct bodies *b, long i, long j, vec3 acceleration, float *bx, float *by, float *bz) {
+    const float k = GRAVITY_CONSTANT * FORCE_SCALE;
+    float xi = b->x[i];
+    float yi = b->y[i];
+    float zi = b->z[i];
+    float mi = k * b->mass[i];
 
-    vec3 v3distance;
-    glm_vec3(v4distance, v3distance);
+    for (; j < b->num; j++) {
+        float dx = b->x[j] - xi;
+        float dy = b->y[j] - yi;
+        float dz = b->z[j] - zi;
+        float distance_squared = dx*dx + dy*dy + dz*dz;
 
-    float distance_xy = sqrt((v3distance[0] * v3distance[0]) + (v3distance[1] * v3distance[1]));
-    float distance_xyz = sqrt((distance_xy * distance_xy) + (v3distance[2] * v3distance[2]));
-    float force_scale = 4.0f;
+        if (distance_squared == 0.0f) {
+            continue;
+        }
+
+        float inverse = 1.0f / sqrtf(distance_squared);
+        float sj = k * b->mass[j] * inverse;
+        float si = mi * inverse;
+
+        acceleration[0] += dx * sj;
+        acceleration[1] += dy * sj;
+        acceleration[2] += dz * sj;
+
+        bx[j] -= dx * si;
+        by[j] -= dy * si;
+        bz[j] -= dz * si;
+    }
+}
+
+static void accumulate_scalar(struct bodies *b, long first, long stride, float *bx, float *by, float *bz) {
+    for (long i = first; i < b->num; i += stride) {
+        vec3 acceleration = {0.0f, 0.0f, 0.0f};
+        accumulate_row_scalar(b, i, i+1, acceleration, bx, by, bz);
+
+        bx[i] += acceleration[0];
+        by[i] += acceleration[1];
+        bz[i] += acceleration[2];
+    }
+}
+
+// the acceleration of a single target from the bodies from j on, no other
+// body is written to
+static void row_remainder(struct bodies *b, long i, long j, vec3 acceleration) {
+    float xi = b->x[i];
+    float yi = b->y[i];
+    float zi = b->z[i];
+
+    for (; j < b->num; j++) {
+        gravity_acceleration(b->x[j] - xi, b->y[j] - yi, b->z[j] - zi, b->mass[j], acceleration);
+    }
+}
+
+static void row_scalar(struct bodies *b, long i, vec3 acceleration) {
+    row_remainder(b, i, 0, acceleration);
+}
+
+#if defined(__x86_64__)
+static float horizontal_sum_sse(__m128 v) {
+    __m128 shuffled = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(v, shuffled);
+    shuffled = _mm_movehl_ps(shuffled, sums);
+    sums = _mm_add_ss(sums, shuffled);
+    return _mm_cvtss_f32(sums);
+}
+
+// 4 targets per iteration, 1/sqrt from rsqrt refined by one newton step
+static void accumulate_sse(struct bodies *b, long first, long stride, float *bx, float *by, float *bz) {
+    const float k = GRAVITY_CONSTANT * FORCE_SCALE;
+    const __m128 vk = _mm_set1_ps(k);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 three = _mm_set1_ps(3.0f);
+    const __m128 zero = _mm_setzero_ps();
+
+    for (long i = first; i < b->num; i += stride) {
+        __m128 xi = _mm_set1_ps(b->x[i]);
+        __m128 yi = _mm_set1_ps(b->y[i]);
+        __m128 zi = _mm_set1_ps(b->z[i]);
+        __m128 mi = _mm_set1_ps(k * b->mass[i]);
+        __m128 ax = zero;
+        __m128 ay = zero;
+        __m128 az = zero;
+
+        long j = i+1;
+        for (; j+4 <= b->num; j += 4) {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(&b->x[j]), xi);
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(&b->y[j]), yi);
+            __m128 dz = _mm_sub_ps(_mm_loadu_ps(&b->z[j]), zi);
+            __m128 distance_squared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+            __m128 inverse = _mm_rsqrt_ps(distance_squared);
+            __m128 correction = _mm_sub_ps(three, _mm_mul_ps(distance_squared, _mm_mul_ps(inverse, inverse)));
+            inverse = _mm_mul_ps(_mm_mul_ps(half, inverse), correction);
+            inverse = _mm_and_ps(inverse, _mm_cmpneq_ps(distance_squared, zero));
+
+            __m128 sj = _mm_mul_ps(_mm_mul_ps(vk, _mm_loadu_ps(&b->mass[j])), inverse);
+            __m128 si = _mm_mul_ps(mi, inverse);
+
+            ax = _mm_add_ps(ax, _mm_mul_ps(dx, sj));
+            ay = _mm_add_ps(ay, _mm_mul_ps(dy, sj));
+            az = _mm_add_ps(az, _mm_mul_ps(dz, sj));
+
+            _mm_storeu_ps(&bx[j], _mm_sub_ps(_mm_loadu_ps(&bx[j]), _mm_mul_ps(dx, si)));
+            _mm_storeu_ps(&by[j], _mm_sub_ps(_mm_loadu_ps(&by[j]), _mm_mul_ps(dy, si)));
+            _mm_storeu_ps(&bz[j], _mm_sub_ps(_mm_loadu_ps(&bz[j]), _mm_mul_ps(dz, si)));
+        }
+
+        vec3 acceleration = {horizontal_sum_sse(ax), horizontal_sum_sse(ay), horizontal_sum_sse(az)};
+
+        // remaining targets
+        accumulate_row_scalar(b, i, j, acceleration, bx, by, bz);
+
+        bx[i] += acceleration[0];
+        by[i] += acceleration[1];
+        bz[i] += acceleration[2];
+    }
+}
+
+static void row_sse(struct bodies *b, long i, vec3 acceleration) {
+    const float k = GRAVITY_CONSTANT * FORCE_SCALE;
+    const __m128 vk = _mm_set1_ps(k);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 three = _mm_set1_ps(3.0f);
+    const __m128 zero = _mm_setzero_ps();
+    __m128 xi = _mm_set1_ps(b->x[i]);
+    __m128 yi = _mm_set1_ps(b->y[i]);
+    __m128 zi = _mm_set1_ps(b->z[i]);
+    __m128 ax = zero;
+    __m128 ay = zero;
+    __m128 az = zero;
+
+    long j = 0;
+    for (; j+4 <= b->num; j += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(&b->x[j]), xi);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(&b->y[j]), yi);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(&b->z[j]), zi);
+        __m128 distance_squared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+        __m128 inverse = _mm_rsqrt_ps(distance_squared);
+        __m128 correction = _mm_sub_ps(three, _mm_mul_ps(distance_squared, _mm_mul_ps(inverse, inverse)));
+        inverse = _mm_mul_ps(_mm_mul_ps(half, inverse), correction);
+        inverse = _mm_and_ps(inverse, _mm_cmpneq_ps(distance_squared, zero));
+
+        __m128 sj = _mm_mul_ps(_mm_mul_ps(vk, _mm_loadu_ps(&b->mass[j])), inverse);
+
+        ax = _mm_add_ps(ax, _mm_mul_ps(dx, sj));
+        ay = _mm_add_ps(ay, _mm_mul_ps(dy, sj));
+        az = _mm_add_ps(az, _mm_mul_ps(dz, sj));
+    }
+
+    acceleration[0] += horizontal_sum_sse(ax);
+    acceleration[1] += horizontal_sum_sse(ay);
+    acceleration[2] += horizontal_sum_sse(az);
+
+    row_remainder(b, i, j, acceleration);
+}
+
+__attribute__((target("avx2,fma")))
+static float horizontal_sum_avx(__m256 v) {
+    __m128 sums = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    return horizontal_sum_sse(sums);
+}
+
+// 8 targets per iteration, 1/sqrt from rsqrt refined by one newton step
+__attribute__((target("avx2,fma")))
+static void accumulate_avx2(struct bodies *b, long first, long stride, float *bx, float *by, float *bz) {
+    const float k = GRAVITY_CONSTANT * FORCE_SCALE;
+    const __m256 vk = _mm256_set1_ps(k);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three = _mm256_set1_ps(3.0f);
+    const __m256 zero = _mm256_setzero_ps();
+
+    for (long i = first; i < b->num; i += stride) {
+        __m256 xi = _mm256_set1_ps(b->x[i]);
+        __m256 yi = _mm256_set1_ps(b->y[i]);
+        __m256 zi = _mm256_set1_ps(b->z[i]);
+        __m256 mi = _mm256_set1_ps(k * b->mass[i]);
+        __m256 ax = zero;
+        __m256 ay = zero;
+        __m256 az = zero;
 
-    float g = 6.67f * 1e-11f;
-    float top = g * src->mass * target->mass;
+        long j = i+1;
+        for (; j+8 <= b->num; j += 8) {
+            __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&b->x[j]), xi);
+            __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&b->y[j]), yi);
+            __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&b->z[j]), zi);
+            __m256 distance_squared = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
 
-    for (int i = 0; i < 3; i++) {
-        v3distance[i] = (v3distance[i] * v3distance[i] * v3distance[i]);
+            __m256 inverse = _mm256_rsqrt_ps(distance_squared);
+            __m256 correction = _mm256_fnmadd_ps(distance_squared, _mm256_mul_ps(inverse, inverse), three);
+            inverse = _mm256_mul_ps(_mm256_mul_ps(half, inverse), correction);
+            inverse = _mm256_and_ps(inverse, _mm256_cmp_ps(distance_squared, zero, _CMP_NEQ_OQ));
+
+            __m256 sj = _mm256_mul_ps(_mm256_mul_ps(vk, _mm256_loadu_ps(&b->mass[j])), inverse);
+            __m256 si = _mm256_mul_ps(mi, inverse);
+
+            ax = _mm256_fmadd_ps(dx, sj, ax);
+            ay = _mm256_fmadd_ps(dy, sj, ay);
+            az = _mm256_fmadd_ps(dz, sj, az);
+
+            _mm256_storeu_ps(&bx[j], _mm256_fnmadd_ps(dx, si, _mm256_loadu_ps(&bx[j])));
+            _mm256_storeu_ps(&by[j], _mm256_fnmadd_ps(dy, si, _mm256_loadu_ps(&by[j])));
+            _mm256_storeu_ps(&bz[j], _mm256_fnmadd_ps(dz, si, _mm256_loadu_ps(&bz[j])));
+        }
+
+        vec3 acceleration = {horizontal_sum_avx(ax), horizontal_sum_avx(ay), horizontal_sum_avx(az)};
+
+        // remaining targets
+        accumulate_row_scalar(b, i, j, acceleration, bx, by, bz);
+
+        bx[i] += acceleration[0];
+        by[i] += acceleration[1];
+        bz[i] += acceleration[2];
     }
+}
+
+__attribute__((target("avx2,fma")))
+static void row_avx2(struct bodies *b, long i, vec3 acceleration) {
+    const float k = GRAVITY_CONSTANT * FORCE_SCALE;
+    const __m256 vk = _mm256_set1_ps(k);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three = _mm256_set1_ps(3.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 xi = _mm256_set1_ps(b->x[i]);
+    __m256 yi = _mm256_set1_ps(b->y[i]);
+    __m256 zi = _mm256_set1_ps(b->z[i]);
+    __m256 ax = zero;
+    __m256 ay = zero;
+    __m256 az = zero;
+
+    long j = 0;
+    for (; j+8 <= b->num; j += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&b->x[j]), xi);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&b->y[j]), yi);
+        __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&b->z[j]), zi);
+        __m256 distance_squared = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+
+        __m256 inverse = _mm256_rsqrt_ps(distance_squared);
+        __m256 correction = _mm256_fnmadd_ps(distance_squared, _mm256_mul_ps(inverse, inverse), three);
+        inverse = _mm256_mul_ps(_mm256_mul_ps(half, inverse), correction);
+        inverse = _mm256_and_ps(inverse, _mm256_cmp_ps(distance_squared, zero, _CMP_NEQ_OQ));
+
+        __m256 sj = _mm256_mul_ps(_mm256_mul_ps(vk, _mm256_loadu_ps(&b->mass[j])), inverse);
+
+        ax = _mm256_fmadd_ps(dx, sj, ax);
+        ay = _mm256_fmadd_ps(dy, sj, ay);
+        az = _mm256_fmadd_ps(dz, sj, az);
+    }
+
+    acceleration[0] += horizontal_sum_avx(ax);
+    acceleration[1] += horizontal_sum_avx(ay);
+    acceleration[2] += horizontal_sum_avx(az);
 
-    for (int i = 0; i < 3; i++) {
-        if (v3distance[i] == 0) {
-            force[i] = 0.0f;
+    row_remainder(b, i, j, acceleration);
+}
+#endif
+
+struct gravity_kernel {
+    const char *name;
+    void (*accumulate)(struct bodies *b, long first, long stride, float *bx, float *by, float *bz);
+    void (*row)(struct bodies *b, long i, vec3 acceleration); // from all bodies, for single targets
+    int (*supported)(void);
+};
+
+static int always_supported(void) {
+    return 1;
+}
+
+#if defined(__x86_64__)
+static int avx2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+
+// ordered from the fastest to the slowest
+static struct gravity_kernel gravity_kernels[] = {
+#if defined(__x86_64__)
+    { "avx2", accumulate_avx2, row_avx2, avx2_supported },
+    { "sse", accumulate_sse, row_sse, always_supported },
+#endif
+    { "scalar", accumulate_scalar, row_scalar, always_supported },
+};
+
+static struct gravity_kernel *gravity_kernel;
+
+int select_gravity_kernel(const char *name) {
+    for (unsigned long i = 0; i < sizeof(gravity_kernels)/sizeof(gravity_kernels[0]); i++) {
+        struct gravity_kernel *kernel = &gravity_kernels[i];
+
+        if (name != NULL && strcmp(kernel->name, name) != 0) {
             continue;
         }
 
-        force[i] = (top / (distance_xyz / (target->position[i] - src->position[i]))) * force_scale;
+        if (kernel->supported() == 0) {
+            if (name != NULL) {
+                fprintf(stderr, "Error: gravity kernel '%s' is not supported by this cpu\n", name);
+                return -1;
+            }
+
+            continue;
+        }
+
+        gravity_kernel = kernel;
+        return 0;
+    }
+
+    fprintf(stderr, "Error: unknown gravity kernel '%s'\n", name);
+    return -1;
+}
+
+const char *gravity_kernel_name(void) {
+    if (gravity_kernel == NULL) {
+        select_gravity_kernel(NULL);
     }
+
+    return gravity_kernel->name;
 }
 
+// per thread acceleration arrays of the parallel direct summation
+static float *accumulators;
+static long accumulators_max;
+
+static float *accumulator(int thread, int axis, long num) {
+    return accumulators + ((long) thread*3 + axis) * num;
+}
+
+static void accumulate_task(void *arg, int thread, int threads) {
+    struct bodies *b = (struct bodies *) arg;
+    float *bx = accumulator(thread, 0, b->num);
+    float *by = accumulator(thread, 1, b->num);
+    float *bz = accumulator(thread, 2, b->num);
+
+    memset(bx, 0, b->num*sizeof(float));
+    memset(by, 0, b->num*sizeof(float));
+    memset(bz, 0, b->num*sizeof(float));
+
+    // interleaved rows keep the triangular pair loop balanced
+    gravity_kernel->accumulate(b, thread, threads, bx, by, bz);
+}
+
+// sum the per thread arrays in thread order, so the result only depends
+// on the number of threads and not on their scheduling
+static void reduce_task(void *arg, int thread, int threads) {
+    struct bodies *b = (struct bodies *) arg;
+    long first = b->num * thread / threads;
+    long last = b->num * (thread+1) / threads;
+    float *destinations[3] = {b->ax, b->ay, b->az};
+
+    for (int axis = 0; axis < 3; axis++) {
+        float *destination = destinations[axis];
+
+        for (long i = first; i < last; i++) {
+            float sum = 0.0f;
+            for (int t = 0; t < threads; t++) {
+                sum += accumulator(t, axis, b->num)[i];
+            }
+
+            destination[i] = sum;
+        }
+    }
+}
+
+int calculate_accelerations(struct bodies *b) {
+    if (gravity_kernel == NULL) {
+        select_gravity_kernel(NULL);
+    }
+
+    int threads = workers_num();
+
+    if (threads == 1 || b->num < PARALLEL_MIN_BODIES) {
+        memset(b->ax, 0, b->num*sizeof(float));
+        memset(b->ay, 0, b->num*sizeof(float));
+        memset(b->az, 0, b->num*sizeof(float));
+
+        gravity_kernel->accumulate(b, 0, 1, b->ax, b->ay, b->az);
+        return 0;
+    }
+
+    long accumulators_num = (long) threads * 3 * b->num;
+    if (accumulators_num > accumulators_max) {
+        float *new_accumulators = (float *) reallocarray(accumulators, accumulators_num, sizeof(float));
+        if (new_accumulators == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for force accumulators\n");
+            return -1;
+        }
+
+        accumulators = new_accumulators;
+        accumulators_max = accumulators_num;
+    }
+
+    workers_run(accumulate_task, b);
+    workers_run(reduce_task, b);
+
+    return 0;
+}
+
+struct rows_arguments {
+    struct bodies *b;
+    const long *list;
+    long num;
+};
+
+static void rows_task(void *arg, int thread, int threads) {
+    struct rows_arguments *rows = (struct rows_arguments *) arg;
+    struct bodies *b = rows->b;
+
+    for (long k = thread; k < rows->num; k += threads) {
+        long i = rows->list[k];
+        vec3 acceleration = {0.0f, 0.0f, 0.0f};
+
+        gravity_kernel->row(b, i, acceleration);
+
+        b->ax[i] = acceleration[0];
+        b->ay[i] = acceleration[1];
+        b->az[i] = acceleration[2];
+    }
+}
+
+// accelerations of the listed bodies only, each one from a full row so no
+// other body is written to
+int calculate_accelerations_of(struct bodies *b, const long *list, long num) {
+    struct rows_arguments rows = { b, list, num };
+
+    if (gravity_kernel == NULL) {
+        select_gravity_kernel(NULL);
+    }
+
+    if (num < PARALLEL_MIN_BODIES) {
+        rows_task(&rows, 0, 1);
+        return 0;
+    }
+
+    workers_run(rows_task, &rows);
+    return 0;
+}
@@ -1,10 +1,33 @@
 #ifndef MATH_H
 #define MATH_H
 
-#include "object.h"
+#include "body.h"
+#include <math.h>
 #include <cglm/cglm.h>
 
+#define GRAVITY_CONSTANT (6.67f * 1e-11f)
+#define FORCE_SCALE 4.0f
+#define PARALLEL_MIN_BODIES 256 // below this the threads cost more than they save
+
+// acceleration towards a point mass at the given offset, the force law of
+// all solvers
+static inline void gravity_acceleration(float dx, float dy, float dz, float mass, vec3 acceleration) {
+    float distance_squared = dx*dx + dy*dy + dz*dz;
+
+    if (distance_squared == 0.0f) {
+        return;
+    }
+
+    float scale = GRAVITY_CONSTANT * FORCE_SCALE * mass / sqrtf(distance_squared);
+    acceleration[0] += dx * scale;
+    acceleration[1] += dy * scale;
+    acceleration[2] += dz * scale;
+}
+
 float frand48(void);
-void calculate_gravity(struct object *src, struct object *target, vec3 force);
+int select_gravity_kernel(const char *name);
+const char *gravity_kernel_name(void);
+int calculate_accelerations(struct bodies *b);
+int calculate_accelerations_of(struct bodies *b, const long *list, long num);
 
 #endif 
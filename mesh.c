@@ -0,0 +1,398 @@
+#include "mesh.h"
+
+#include "object.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static char *cache_path(const char *path) {
+    char *cache = (char *) malloc(strlen(path) + sizeof(MESH_CACHE_SUFFIX));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    strcpy(cache, path);
+    strcat(cache, MESH_CACHE_SUFFIX);
+    return cache;
+}
+
+static long blocks_size(int64_t vertices_num, int64_t normals_num, int64_t indices_num) {
+    return (vertices_num*3 + normals_num*3) * sizeof(float) + indices_num * sizeof(unsigned int);
+}
+
+// the full mesh as the first level, shared with the model arrays
+static void full_lod(struct model *model) {
+    struct model_lod *full = &model->lods[0];
+    full->vertices = model->vertices;
+    full->normals = model->normals;
+    full->indices = model->indices;
+    full->vertices_num = model->vertices_num;
+    full->indices_num = model->indices_num;
+    full->max_pixels = FLT_MAX;
+    model->lods_num = 1;
+
+    model->impostors.max_pixels = LOD_IMPOSTOR_PIXELS;
+}
+
+static int lod_settings_match(const struct mesh_header *header) {
+    return header->lod_finest_grid == LOD_FINEST_GRID && header->lod_coarsest_grid == LOD_COARSEST_GRID
+        && header->lod_min_reduction == LOD_MIN_REDUCTION && header->lod_error_pixels == LOD_ERROR_PIXELS;
+}
+
+// the blocks of all levels, -1 if a count is out of range
+static long cache_size(const struct mesh_header *header) {
+    if (header->lods_num > MODEL_LODS - 1 || header->vertices_num < 0 || header->normals_num < 0 || header->indices_num < 0) {
+        return -1;
+    }
+
+    long size = sizeof(struct mesh_header) + blocks_size(header->vertices_num, header->normals_num, header->indices_num);
+
+    for (uint32_t level = 0; level < header->lods_num; level++) {
+        const struct mesh_lod *lod = &header->lods[level];
+        if (lod->vertices_num < 0 || lod->indices_num < 0) {
+            return -1;
+        }
+
+        size += blocks_size(lod->vertices_num, lod->vertices_num, lod->indices_num);
+    }
+
+    return size;
+}
+
+// map the cache of an asset, the model arrays and its levels of detail
+// then point straight into the mapping. fails when there is no cache or it
+// is stale.
+int map_mesh_cache(const char *path, struct model *model) {
+    char *cache = cache_path(path);
+    if (cache == NULL) {
+        return -1;
+    }
+
+    int fd = open(cache, O_RDONLY);
+    free(cache);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat cache_stat;
+    if (fstat(fd, &cache_stat) == -1 || cache_stat.st_size < (off_t) sizeof(struct mesh_header)) {
+        close(fd);
+        return -1;
+    }
+
+    void *mapping = mmap(NULL, cache_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+
+    struct mesh_header *header = (struct mesh_header *) mapping;
+    if (memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(header->magic)) != 0 || header->version != MESH_CACHE_VERSION
+            || !lod_settings_match(header)) {
+        goto stale;
+    }
+
+    if (cache_stat.st_size != (off_t) cache_size(header)) {
+        goto stale;
+    }
+
+    // a cache without its source is still usable
+    struct stat source_stat;
+    if (stat(path, &source_stat) == 0) {
+        if (source_stat.st_size != header->source_size || source_stat.st_mtime != header->source_mtime) {
+            goto stale;
+        }
+    }
+
+    char *blocks = (char *) mapping + sizeof(struct mesh_header);
+
+    model->vertices_num = header->vertices_num;
+    model->normals_num = header->normals_num;
+    model->indices_num = header->indices_num;
+
+    model->vertices = (float *) blocks;
+    model->normals = model->vertices + model->vertices_num*3;
+    model->indices = (unsigned int *) (model->normals + model->normals_num*3);
+    full_lod(model);
+
+    blocks = (char *) (model->indices + model->indices_num);
+    for (uint32_t level = 0; level < header->lods_num; level++) {
+        struct model_lod *lod = &model->lods[model->lods_num++];
+        lod->vertices_num = header->lods[level].vertices_num;
+        lod->indices_num = header->lods[level].indices_num;
+        lod->max_pixels = header->lods[level].max_pixels;
+
+        lod->vertices = (float *) blocks;
+        lod->normals = lod->vertices + lod->vertices_num*3;
+        lod->indices = (unsigned int *) (lod->normals + lod->vertices_num*3);
+        blocks = (char *) (lod->indices + lod->indices_num);
+    }
+
+    model->mapping = mapping;
+    model->mapping_size = cache_stat.st_size;
+
+    return 0;
+
+stale:
+    munmap(mapping, cache_stat.st_size);
+    return -1;
+}
+
+int write_mesh_cache(const char *path, struct model *model) {
+    struct stat source_stat;
+    if (stat(path, &source_stat) == -1) {
+        return -1;
+    }
+
+    char *cache = cache_path(path);
+    if (cache == NULL) {
+        return -1;
+    }
+
+    // write to a temporary file first, so a reader never maps half a cache
+    char temporary[strlen(cache) + sizeof(".tmp")];
+    strcpy(temporary, cache);
+    strcat(temporary, ".tmp");
+
+    FILE *fp = fopen(temporary, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Warning: cannot write mesh cache '%s'\n", cache);
+        free(cache);
+        return -1;
+    }
+
+    struct mesh_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    header.source_size = source_stat.st_size;
+    header.source_mtime = source_stat.st_mtime;
+    header.vertices_num = model->vertices_num;
+    header.normals_num = model->normals_num;
+    header.indices_num = model->indices_num;
+    header.lod_finest_grid = LOD_FINEST_GRID;
+    header.lod_coarsest_grid = LOD_COARSEST_GRID;
+    header.lod_min_reduction = LOD_MIN_REDUCTION;
+    header.lod_error_pixels = LOD_ERROR_PIXELS;
+    header.lods_num = model->lods_num - 1;
+
+    for (int level = 1; level < model->lods_num; level++) {
+        header.lods[level-1].vertices_num = model->lods[level].vertices_num;
+        header.lods[level-1].indices_num = model->lods[level].indices_num;
+        header.lods[level-1].max_pixels = model->lods[level].max_pixels;
+    }
+
+    int failed = 0;
+    failed |= fwrite(&header, sizeof(header), 1, fp) != 1;
+    failed |= fwrite(model->vertices, sizeof(float), model->vertices_num*3, fp) != (size_t) model->vertices_num*3;
+    failed |= fwrite(model->normals, sizeof(float), model->normals_num*3, fp) != (size_t) model->normals_num*3;
+    failed |= fwrite(model->indices, sizeof(unsigned int), model->indices_num, fp) != (size_t) model->indices_num;
+
+    for (int level = 1; level < model->lods_num; level++) {
+        struct model_lod *lod = &model->lods[level];
+        failed |= fwrite(lod->vertices, sizeof(float), lod->vertices_num*3, fp) != (size_t) lod->vertices_num*3;
+        failed |= fwrite(lod->normals, sizeof(float), lod->vertices_num*3, fp) != (size_t) lod->vertices_num*3;
+        failed |= fwrite(lod->indices, sizeof(unsigned int), lod->indices_num, fp) != (size_t) lod->indices_num;
+    }
+
+    failed |= fclose(fp) != 0;
+
+    if (failed || rename(temporary, cache) == -1) {
+        fprintf(stderr, "Warning: failed writing mesh cache '%s'\n", cache);
+        unlink(temporary);
+        free(cache);
+        return -1;
+    }
+
+    free(cache);
+    return 0;
+}
+
+struct cell_vertex {
+    long cell;
+    long vertex;
+};
+
+struct triangle {
+    unsigned int corners[3];
+};
+
+static int compare_cells(const void *a, const void *b) {
+    long difference = ((const struct cell_vertex *) a)->cell - ((const struct cell_vertex *) b)->cell;
+    return (difference > 0) - (difference < 0);
+}
+
+static int compare_triangles(const void *a, const void *b) {
+    return memcmp(a, b, sizeof(struct triangle));
+}
+
+static void free_lod(struct model_lod *lod) {
+    free(lod->vertices);
+    free(lod->normals);
+    free(lod->indices);
+    memset(lod, 0, sizeof(*lod));
+}
+
+// vertex clustering: the vertices in a cell of a grid over the bounding box
+// merge into their average and triangles that collapse are dropped, so the
+// error is at most about a cell
+static int decimate_mesh(struct model *model, int grid, struct model_lod *lod) {
+    long n = model->vertices_num;
+    vec3 min = { FLT_MAX, FLT_MAX, FLT_MAX };
+    vec3 max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+    for (long i = 0; i < n; i++) {
+        glm_vec3_minv(min, &model->vertices[i*3], min);
+        glm_vec3_maxv(max, &model->vertices[i*3], max);
+    }
+
+    float extent = fmaxf(max[0] - min[0], fmaxf(max[1] - min[1], max[2] - min[2]));
+    float cell = extent / grid;
+
+    struct cell_vertex *order = (struct cell_vertex *) calloc(n, sizeof(struct cell_vertex));
+    unsigned int *clusters = (unsigned int *) calloc(n, sizeof(unsigned int));
+    struct triangle *triangles = (struct triangle *) calloc(model->indices_num/3 + 1, sizeof(struct triangle));
+    long *counts = NULL;
+
+    memset(lod, 0, sizeof(*lod));
+
+    if (order == NULL || clusters == NULL || triangles == NULL) {
+        goto error;
+    }
+
+    for (long i = 0; i < n; i++) {
+        long key = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            long index = (cell > 0.0f) ? (long) ((model->vertices[i*3 + axis] - min[axis]) / cell) : 0;
+            key = key*grid + ((index < grid) ? index : grid-1);
+        }
+
+        order[i].cell = key;
+        order[i].vertex = i;
+    }
+
+    qsort(order, n, sizeof(struct cell_vertex), compare_cells);
+
+    long clusters_num = 0;
+    for (long i = 0; i < n; i++) {
+        if (i > 0 && order[i].cell != order[i-1].cell) {
+            clusters_num++;
+        }
+
+        clusters[order[i].vertex] = clusters_num;
+    }
+    clusters_num = (n > 0) ? clusters_num + 1 : 0;
+
+    lod->vertices = (float *) calloc(clusters_num*3, sizeof(float));
+    lod->normals = (float *) calloc(clusters_num*3, sizeof(float));
+    counts = (long *) calloc(clusters_num, sizeof(long));
+
+    if (lod->vertices == NULL || lod->normals == NULL || counts == NULL) {
+        goto error;
+    }
+
+    // average positions, the summed normals are normalized
+    for (long i = 0; i < n; i++) {
+        unsigned int c = clusters[i];
+        glm_vec3_add(&lod->vertices[c*3], &model->vertices[i*3], &lod->vertices[c*3]);
+        if (model->normals_num == n) {
+            glm_vec3_add(&lod->normals[c*3], &model->normals[i*3], &lod->normals[c*3]);
+        }
+        counts[c]++;
+    }
+
+    for (long c = 0; c < clusters_num; c++) {
+        glm_vec3_scale(&lod->vertices[c*3], 1.0f / counts[c], &lod->vertices[c*3]);
+        glm_normalize(&lod->normals[c*3]);
+    }
+
+    lod->vertices_num = clusters_num;
+
+    // the smallest corner first keeps the winding and makes duplicates equal
+    long triangles_num = 0;
+    for (long i = 0; i + 2 < model->indices_num; i += 3) {
+        unsigned int a = clusters[model->indices[i]];
+        unsigned int b = clusters[model->indices[i+1]];
+        unsigned int c = clusters[model->indices[i+2]];
+
+        if (a == b || b == c || a == c) {
+            continue;
+        }
+
+        struct triangle *triangle = &triangles[triangles_num++];
+        if (a < b && a < c) {
+            *triangle = (struct triangle) { { a, b, c } };
+        } else if (b < c) {
+            *triangle = (struct triangle) { { b, c, a } };
+        } else {
+            *triangle = (struct triangle) { { c, a, b } };
+        }
+    }
+
+    qsort(triangles, triangles_num, sizeof(struct triangle), compare_triangles);
+
+    long unique = 0;
+    for (long i = 0; i < triangles_num; i++) {
+        if (unique == 0 || compare_triangles(&triangles[unique-1], &triangles[i]) != 0) {
+            triangles[unique++] = triangles[i];
+        }
+    }
+
+    lod->indices = (unsigned int *) triangles;
+    lod->indices_num = unique*3;
+
+    free(order);
+    free(clusters);
+    free(counts);
+    return 0;
+
+error:
+    fprintf(stderr, "Error: failed allocating memory for the levels of detail of '%s'\n", model->path);
+    free(order);
+    free(clusters);
+    free(triangles);
+    free(counts);
+    free(lod->vertices);
+    free(lod->normals);
+    memset(lod, 0, sizeof(*lod));
+    return -1;
+}
+
+// decimated versions of the mesh for objects covering few pixels, a level
+// is kept only if it saves enough triangles over the previous one
+int build_lods(struct model *model) {
+    full_lod(model);
+
+    for (int grid = LOD_FINEST_GRID; grid >= LOD_COARSEST_GRID && model->lods_num < MODEL_LODS; grid /= 2) {
+        struct model_lod *previous = &model->lods[model->lods_num - 1];
+        struct model_lod *lod = &model->lods[model->lods_num];
+
+        if (decimate_mesh(model, grid, lod) == -1) {
+            return -1;
+        }
+
+        // a vertex moves by up to about half a cell, 1/grid of the radius
+        lod->max_pixels = grid * LOD_ERROR_PIXELS;
+
+        if (lod->indices_num == 0) {
+            free_lod(lod);
+            break;
+        }
+
+        if (lod->indices_num >= previous->indices_num * LOD_MIN_REDUCTION) {
+            free_lod(lod);
+            continue;
+        }
+
+        model->lods_num++;
+    }
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "object.h"
+#include <stdint.h>
+
+#define MESH_CACHE_MAGIC "GRVMESH"
+#define MESH_CACHE_VERSION 2
+#define MESH_CACHE_SUFFIX ".mesh"
+
+// a decimated level in the cache, its normals are per vertex
+struct mesh_lod {
+    int64_t vertices_num;
+    int64_t indices_num;
+    float max_pixels;
+    uint32_t reserved;
+};
+
+// binary mesh cache written next to the source asset, followed by the
+// vertex, normal and index blocks of the full mesh and then of every
+// decimated level
+struct mesh_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t lods_num; // decimated levels after the full mesh
+
+    int64_t source_size; // source asset the cache was built from
+    int64_t source_mtime;
+
+    int64_t vertices_num;
+    int64_t normals_num;
+    int64_t indices_num;
+
+    // the levels are rebuilt when any of these changed
+    int32_t lod_finest_grid;
+    int32_t lod_coarsest_grid;
+    float lod_min_reduction;
+    float lod_error_pixels;
+
+    struct mesh_lod lods[MODEL_LODS - 1];
+};
+
+// the cache also holds the levels of detail, build_lods is only needed
+// when it cannot be mapped
+int map_mesh_cache(const char *path, struct model *model);
+int write_mesh_cache(const char *path, struct model *model);
+int build_lods(struct model *model);
+
+#endif
@@ -1,12 +1,50 @@
 #include "object.h"
 
 #include "math.h"
+#include "body.h"
+#include "mesh.h"
+#include "workers.h"
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
 #include <assimp/cimport.h>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 
-struct object *objects;
+struct model *models;
+
+// chunked arenas of objects, only the thread that steps the simulation
+// allocates, walks and retires. released slots come back from any thread.
+struct object_pool {
+    struct object **chunks;
+    long chunks_num;
+    long slots_num; // slots handed out at least once
+    long alive;
+    unsigned long *live; // a bit per slot, set while its object is alive
+
+    struct object *free; // reusable slots, owned by the allocating thread
+    _Atomic(struct object *) released; // moved to free once it runs dry
+};
+
+static struct object_pool pool;
+
+// removed from the scene, pushed by the physics and taken by the renderer
+static _Atomic(struct object *) retired_objects;
+
+// models read on their own threads while the caller does something else,
+// linked into models once waited for
+struct model_loads {
+    char **paths;
+    struct model **loaded; // NULL if reading failed
+    int num;
+    atomic_int next; // first path not taken by a thread yet
+
+    pthread_t threads[MODEL_LOADERS];
+    int threads_num;
+};
+
+static struct model_loads loads;
 
 /*int load_model_to_object(const char *path, struct object *obj) {
     const struct aiScene *scene = aiImportFile(path, aiProcess_Triangulate);
@@ -66,77 +104,244 @@ struct object *objects;
     return 0;
 }*/
 
-struct model *load_model(const char *path) {
-    struct model *new_model = (struct model *) calloc(1, sizeof(struct model));
+struct model *find_model(const char *path) {
+    for (struct model *model = models; model != NULL; model = model->next) {
+        if (strcmp(model->path, path) == 0) {
+            return model;
+        }
+    }
+
+    return NULL;
+}
+
+static int import_model(const char *path, struct model *model) {
     const struct aiScene *scene = aiImportFile(path, aiProcess_Triangulate);
 
     if (scene == NULL) {
-        fprintf(stderr, "Error: failed importing file from path '%s'", path);
+        fprintf(stderr, "Error: failed importing file from path '%s'\n", path);
+        return -1;
     }
 
-    for (int mesh_index = 0; mesh_index < scene->mNumMeshes; mesh_index++) {
+    // size all arrays up front
+    for (unsigned int mesh_index = 0; mesh_index < scene->mNumMeshes; mesh_index++) {
         struct aiMesh *mesh = scene->mMeshes[mesh_index];
+        model->vertices_num += mesh->mNumVertices;
 
-        // fetch vertices
-        for (int vertex_index = 0; vertex_index < mesh->mNumVertices; vertex_index++) {
-            struct aiVector3D *vertex = &(mesh->mVertices[vertex_index]);
-            long start = new_model->vertices_num*3;
+        for (unsigned int face_index = 0; face_index < mesh->mNumFaces; face_index++) {
+            model->indices_num += mesh->mFaces[face_index].mNumIndices;
+        }
+    }
 
-            new_model->vertices_num++;
-            new_model->vertices = (float *) realloc(new_model->vertices, new_model->vertices_num*3*sizeof(float));
-            if (new_model->vertices == NULL) {
-                fprintf(stderr, "Error: failed allocating memory for vertices\n");
-                goto error;
-            }
+    model->normals_num = model->vertices_num;
+    model->vertices = (float *) calloc(model->vertices_num*3, sizeof(float));
+    model->normals = (float *) calloc(model->normals_num*3, sizeof(float));
+    model->indices = (unsigned int *) calloc(model->indices_num, sizeof(unsigned int));
+
+    if (model->vertices == NULL || model->normals == NULL || model->indices == NULL) {
+        fprintf(stderr, "Error: failed allocating memory for model '%s'\n", path);
+        goto error;
+    }
+
+    long vertex_start = 0;
+    long index_start = 0;
 
-            memcpy(&new_model->vertices[start], vertex, sizeof(float)*3);
+    for (unsigned int mesh_index = 0; mesh_index < scene->mNumMeshes; mesh_index++) {
+        struct aiMesh *mesh = scene->mMeshes[mesh_index];
+
+        // fetch vertices and normals
+        memcpy(&model->vertices[vertex_start*3], mesh->mVertices, mesh->mNumVertices*3*sizeof(float));
+        if (mesh->mNormals != NULL) {
+            memcpy(&model->normals[vertex_start*3], mesh->mNormals, mesh->mNumVertices*3*sizeof(float));
         }
 
-        // fetch indices
-        for (int face_index = 0; face_index < mesh->mNumFaces; face_index++) {
+        // fetch indices, relative to the vertices of all meshes
+        for (unsigned int face_index = 0; face_index < mesh->mNumFaces; face_index++) {
             struct aiFace *face = &(mesh->mFaces[face_index]);
-            long start = new_model->indices_num;
 
-            new_model->indices_num += face->mNumIndices;
-            new_model->indices = (unsigned int *) realloc(new_model->indices, sizeof(unsigned int)*new_model->indices_num);
-            if (new_model->indices == NULL) {
-                fprintf(stderr, "Error: failed allocating memory for indices\n");
-                goto error;
+            for (unsigned int i = 0; i < face->mNumIndices; i++) {
+                model->indices[index_start++] = face->mIndices[i] + vertex_start;
             }
+        }
+
+        vertex_start += mesh->mNumVertices;
+    }
+
+    aiReleaseImport(scene);
+    return 0;
 
-            memcpy(&new_model->indices[start], face->mIndices, sizeof(unsigned int)*face->mNumIndices);
+error:
+    aiReleaseImport(scene);
+    free(model->vertices);
+    free(model->indices);
+    free(model->normals);
+    return -1;
+}
+
+static float bounding_radius(struct model *model) {
+    float max = 0.0f;
+
+    for (long i = 0; i < model->vertices_num; i++) {
+        float *vertex = &model->vertices[i*3];
+        float squared = vertex[0]*vertex[0] + vertex[1]*vertex[1] + vertex[2]*vertex[2];
+        if (squared > max) {
+            max = squared;
         }
+    }
 
-        // fetch normals
-        for (int normal_index = 0; normal_index < mesh->mNumVertices; normal_index++) {
-            struct aiVector3D *normal = &(mesh->mNormals[normal_index]);
-            long start = new_model->normals_num*3;
+    return sqrtf(max);
+}
 
-            new_model->normals_num++;
-            new_model->normals = (float *) realloc(new_model->normals, new_model->normals_num*3*sizeof(float));
-            if (new_model->normals == NULL) {
-                fprintf(stderr, "Error: failed allocating memory for normals\n");
-                goto error;
-            }
+// everything but linking into models, safe on any thread
+static struct model *read_model(const char *path) {
+    struct model *new_model = (struct model *) calloc(1, sizeof(struct model));
+    if (new_model == NULL) {
+        fprintf(stderr, "Error: failed allocating memory for a new model\n");
+        return NULL;
+    }
 
-            memcpy(&new_model->normals[start], normal, sizeof(float)*3);
+    // parse the asset and decimate it only when there is no up to date
+    // binary cache
+    if (map_mesh_cache(path, new_model) == -1) {
+        if (import_model(path, new_model) == -1) {
+            free(new_model);
+            return NULL;
         }
+
+        if (build_lods(new_model) == -1) {
+            return NULL;
+        }
+
+        write_mesh_cache(path, new_model);
+    }
+
+    new_model->radius = bounding_radius(new_model);
+
+    new_model->path = strdup(path);
+    if (new_model->path == NULL) {
+        fprintf(stderr, "Error: failed allocating memory for model path\n");
+        return NULL;
     }
 
     return new_model;
+}
+
+struct model *load_model(const char *path) {
+    struct model *cached_model = find_model(path);
+    if (cached_model != NULL) {
+        return cached_model;
+    }
+
+    struct model *new_model = read_model(path);
+    if (new_model == NULL) {
+        return NULL;
+    }
+
+    new_model->next = models;
+    models = new_model;
+
+    return new_model;
+}
+
+// read the model with the next start_model_loads, unless it is known
+int queue_model_load(const char *path) {
+    if (find_model(path) != NULL) {
+        return 0;
+    }
+
+    for (int i = 0; i < loads.num; i++) {
+        if (strcmp(loads.paths[i], path) == 0) {
+            return 0;
+        }
+    }
+
+    char **paths = (char **) reallocarray(loads.paths, loads.num + 1, sizeof(char *));
+    if (paths == NULL) {
+        goto error;
+    }
+
+    loads.paths = paths;
+    loads.paths[loads.num] = strdup(path);
+    if (loads.paths[loads.num] == NULL) {
+        goto error;
+    }
+
+    loads.num++;
+    return 0;
 
 error:
-    aiReleaseImport(scene);
-    free(new_model->vertices);
-    free(new_model->indices);
-    free(new_model->normals);
-    free(new_model);
+    fprintf(stderr, "Error: failed allocating memory for loading model '%s'\n", path);
+    return -1;
+}
+
+static void *model_loader(void *arg) {
+    int i;
+
+    while ((i = atomic_fetch_add(&loads.next, 1)) < loads.num) {
+        loads.loaded[i] = read_model(loads.paths[i]);
+    }
+
     return NULL;
 }
 
+// one thread per queued model up to one per worker, nothing may call
+// load_model until wait_model_loads
+int start_model_loads(void) {
+    if (loads.num == 0) {
+        return 0;
+    }
+
+    loads.loaded = (struct model **) calloc(loads.num, sizeof(struct model *));
+    if (loads.loaded == NULL) {
+        fprintf(stderr, "Error: failed allocating memory for loading models\n");
+        return -1;
+    }
+
+    int threads = (loads.num < workers_num()) ? loads.num : workers_num();
+    if (threads > MODEL_LOADERS) {
+        threads = MODEL_LOADERS;
+    }
+
+    atomic_store(&loads.next, 0);
+
+    // whatever no thread takes is read by wait_model_loads
+    for (loads.threads_num = 0; loads.threads_num < threads; loads.threads_num++) {
+        if (pthread_create(&loads.threads[loads.threads_num], NULL, model_loader, NULL) != 0) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// models that failed to load are left out, load_model reports them
+void wait_model_loads(void) {
+    if (loads.loaded == NULL) {
+        return;
+    }
+
+    model_loader(NULL);
+    for (int i = 0; i < loads.threads_num; i++) {
+        pthread_join(loads.threads[i], NULL);
+    }
+
+    for (int i = 0; i < loads.num; i++) {
+        struct model *model = loads.loaded[i];
+        if (model != NULL) {
+            model->next = models;
+            models = model;
+        }
+
+        free(loads.paths[i]);
+    }
+
+    free(loads.paths);
+    free(loads.loaded);
+    memset(&loads, 0, sizeof(loads));
+}
+
 int record_path(struct object *obj) {
-    if (obj->paths_num <= obj->paths_max) {
-        obj->paths = (float *) reallocarray(obj->paths, (obj->paths_num+1)*3, sizeof(float));
+    if (obj->paths == NULL) {
+        obj->paths = (float *) calloc(obj->paths_max*3, sizeof(float));
     }
 
     if (obj->paths == NULL) {
@@ -144,22 +349,147 @@ int record_path(struct object *obj) {
         return -1;
     }
 
-    memcpy(obj->paths+(obj->paths_num*3), obj->position, 3*sizeof(float));
+    // overwrite the oldest position once full
+    body_position(obj->body, obj->paths+(obj->paths_head*3));
+    obj->paths_head = (obj->paths_head + 1) % obj->paths_max;
 
     if (obj->paths_num < obj->paths_max) {
         obj->paths_num++;
-        goto end;
     }
 
-    // pop first element 
-    memmove(obj->paths, &obj->paths[3], (obj->paths_num)*3*sizeof(float));
+    obj->paths_recorded++;
+    return 0;
+}
 
-end:
+void clear_path(struct object *obj) {
+    obj->paths_num = 0;
+    obj->paths_head = 0;
+    obj->paths_recorded = 0;
+    obj->paths_clears++;
+    obj->paths_captured = 0;
+    obj->paths_taken = 0;
+}
+
+static long handle_slot(long handle) {
+    return (long) ((unsigned long) handle >> 32);
+}
+
+static struct object *slot_object(long slot) {
+    return &pool.chunks[slot / OBJECT_CHUNK][slot % OBJECT_CHUNK];
+}
+
+static int grow_pool(void) {
+    long words = (pool.chunks_num + 1) * OBJECT_CHUNK / OBJECT_LIVE_BITS;
+    unsigned long *live = (unsigned long *) reallocarray(pool.live, words, sizeof(unsigned long));
+    if (live == NULL) {
+        return -1;
+    }
+
+    memset(live + pool.chunks_num * OBJECT_CHUNK / OBJECT_LIVE_BITS, 0, OBJECT_CHUNK / OBJECT_LIVE_BITS * sizeof(unsigned long));
+    pool.live = live;
+
+    struct object **chunks = (struct object **) reallocarray(pool.chunks, pool.chunks_num + 1, sizeof(struct object *));
+    if (chunks == NULL) {
+        return -1;
+    }
+
+    pool.chunks = chunks;
+    pool.chunks[pool.chunks_num] = (struct object *) calloc(OBJECT_CHUNK, sizeof(struct object));
+    if (pool.chunks[pool.chunks_num] == NULL) {
+        return -1;
+    }
+
+    pool.chunks_num++;
     return 0;
 }
 
-struct object *create_object(float mass, struct model *model) {
-    struct object *new_object = (struct object *) calloc(1, sizeof(struct object));
+// a released slot with the next generation, or a slot never used before
+static struct object *allocate_object(void) {
+    if (pool.free == NULL) {
+        pool.free = atomic_exchange(&pool.released, NULL);
+    }
+
+    struct object *obj = pool.free;
+    long slot;
+    unsigned int generation;
+
+    if (obj != NULL) {
+        pool.free = obj->next;
+        slot = handle_slot(obj->handle);
+        generation = (unsigned int) obj->handle + 1;
+    } else {
+        if (pool.slots_num == pool.chunks_num * OBJECT_CHUNK && grow_pool() == -1) {
+            return NULL;
+        }
+
+        slot = pool.slots_num++;
+        generation = 0;
+        obj = slot_object(slot);
+    }
+
+    // the trail buffer stays with the slot
+    float *paths = obj->paths;
+    memset(obj, 0, sizeof(*obj));
+    obj->handle = (long) (((unsigned long) slot << 32) | generation);
+    obj->paths = paths;
+    obj->alive = 1;
+    pool.alive++;
+    pool.live[slot / OBJECT_LIVE_BITS] |= 1UL << (slot % OBJECT_LIVE_BITS);
+
+    return obj;
+}
+
+// the first live object at or after the slot, a word of slots at a time so
+// that walking the objects does not depend on how many slots were ever used
+static struct object *live_object(long slot) {
+    long word = slot / OBJECT_LIVE_BITS;
+    long words = (pool.slots_num + OBJECT_LIVE_BITS - 1) / OBJECT_LIVE_BITS;
+
+    if (slot >= pool.slots_num) {
+        return NULL;
+    }
+
+    unsigned long bits = pool.live[word] & (~0UL << (slot % OBJECT_LIVE_BITS));
+
+    while (bits == 0) {
+        if (++word == words) {
+            return NULL;
+        }
+
+        bits = pool.live[word];
+    }
+
+    return slot_object(word * OBJECT_LIVE_BITS + __builtin_ctzl(bits));
+}
+
+// live objects in increasing order of their handles
+struct object *first_object(void) {
+    return live_object(0);
+}
+
+struct object *next_object(struct object *obj) {
+    return live_object(handle_slot(obj->handle) + 1);
+}
+
+long count_objects(void) {
+    return pool.alive;
+}
+
+// NULL once the object was removed, even if its slot is in use again
+struct object *resolve_object(long handle) {
+    long slot = handle_slot(handle);
+
+    if (handle == OBJECT_HANDLE_NONE || slot >= pool.slots_num) {
+        return NULL;
+    }
+
+    struct object *obj = slot_object(slot);
+    return (obj->alive == 1 && obj->handle == handle) ? obj : NULL;
+}
+
+// presentation of an existing body
+struct object *attach_object(long body, struct model *model) {
+    struct object *new_object = allocate_object();
 
     if (new_object == NULL) {
         fprintf(stderr, "Error: failed allocating memory for a new object\n");
@@ -167,11 +497,10 @@ struct object *create_object(float mass, struct model *model) {
     }
 
     // initialize default values
-    new_object->mass = mass;
+    new_object->body = body;
     new_object->scale = 1.0f;
     new_object->paths_max = MAX_PATHS;
     new_object->model = model;
-    glm_vec4_one(new_object->position);
     glm_vec3_one(new_object->color);
 
     // choose random color
@@ -179,18 +508,56 @@ struct object *create_object(float mass, struct model *model) {
         new_object->color[i] = 0.5f + (fabs(frand48()) / 2);
     }
 
-    if (objects == NULL) {
-        objects = new_object;
-        goto end;
-    }
-
-    struct object *previous_object = objects;
-    new_object->next = previous_object;
-    objects = new_object;
-
-end:
     return new_object;
 
 error:
     return NULL;
 }
+
+struct object *create_object(float mass, struct model *model) {
+    long body = create_body(mass);
+    if (body == -1) {
+        return NULL;
+    }
+
+    return attach_object(body, model);
+}
+
+// states from the given step on do not refer to the object anymore, its
+// slot is reused once it is freed
+void retire_object(struct object *obj, long step) {
+    obj->alive = 0;
+    obj->retired_step = step;
+    pool.alive--;
+
+    long slot = handle_slot(obj->handle);
+    pool.live[slot / OBJECT_LIVE_BITS] &= ~(1UL << (slot % OBJECT_LIVE_BITS));
+
+    struct object *head = atomic_load(&retired_objects);
+    do {
+        obj->next = head;
+    } while (!atomic_compare_exchange_weak(&retired_objects, &head, obj));
+}
+
+// all objects retired so far, chained through next
+struct object *take_retired_objects(void) {
+    return atomic_exchange(&retired_objects, NULL);
+}
+
+// its buffers were released by whoever owns the gl context, from any thread
+void free_object(struct object *obj) {
+    struct object *head = atomic_load(&pool.released);
+    do {
+        obj->next = head;
+    } while (!atomic_compare_exchange_weak(&pool.released, &head, obj));
+}
+
+void free_retired_objects(void) {
+    struct object *obj = take_retired_objects();
+
+    while (obj != NULL) {
+        struct object *next = obj->next;
+        free_object(obj);
+        obj = next;
+    }
+}
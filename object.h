@@ -4,8 +4,44 @@
 #include <cglm/cglm.h>
 
 #define MAX_PATHS 2000
+#define OBJECT_CHUNK 1024 // objects per arena of the pool, arenas never move
+#define OBJECT_LIVE_BITS (8 * (long) sizeof(unsigned long)) // slots per word of the bitmap of live objects
+#define OBJECT_HANDLE_NONE -1L
+#define MODEL_LOADERS 8 // threads reading models ahead of their use
+#define INSTANCE_FLOATS 7 // position, scale, color
+
+#define MODEL_LODS 4 // the full mesh and up to three decimated versions
+#define LOD_FINEST_GRID 64 // cells per side of the first decimation attempt
+#define LOD_COARSEST_GRID 4
+#define LOD_MIN_REDUCTION 0.75f // a level needs fewer triangles than this share of the previous one
+#define LOD_IMPOSTOR_PIXELS 3.0f // projected radius below which objects are point sprites
+#define LOD_ERROR_PIXELS 1.0f // largest tolerated displacement of a vertex on screen
+
+// the mesh of a model at one level of detail and the objects drawn with it
+// in the current frame. the impostors of a model have no mesh, they are
+// drawn as point sprites.
+struct model_lod {
+    float *vertices; // level 0 points to the arrays of the model
+    float *normals;
+    unsigned int *indices;
+    long vertices_num;
+    long indices_num;
+    float max_pixels; // largest projected radius the level is used for
+
+    float *instances; // per instance data of the current frame
+    long instances_num;
+    long instances_max;
+
+    unsigned int vao; // array object shared by all instances
+    unsigned int vbo; // buffer for vertices
+    unsigned int ebo; // buffer for indices
+    unsigned int nbo; // buffer for normals
+    unsigned int ibo; // buffer for per instance data
+};
 
 struct model {
+    char *path; // file the model was loaded from, models are cached by it
+
     float *vertices;
     unsigned int *indices;
     float *normals;
@@ -13,36 +49,67 @@ struct model {
     long vertices_num;
     long indices_num;
     long normals_num;
+    float radius; // bounding radius of the vertices
+
+    void *mapping; // mesh cache the arrays point into, NULL when heap allocated
+    long mapping_size;
+
+    void *next;
+
+    struct model_lod lods[MODEL_LODS]; // decreasing detail
+    int lods_num;
+    struct model_lod impostors;
 };
 
+// objects live in pool slots that are reused once released, a handle is
+// the slot in the upper and its generation in the lower 32 bits so that it
+// stops resolving when the object is removed. handles grow with the slot.
 struct object {
-    vec4 translation_force;
-    vec4 position;
+    long handle;
+    int alive; // part of the simulation, not retired
+    long body; // index of the physics state in the body storage
     vec3 color;
-    float mass;
-    void *next;
+    void *next; // retired, released or free objects
 
-    float *paths;
+    float *paths; // ring buffer of the last paths_max positions, kept by the slot, physics thread only
     int paths_num;
     int paths_max;
+    int paths_head; // index of the next position to be written
+    long paths_recorded; // positions recorded since the last clear
+    long paths_clears;
+    long paths_captured; // recorded at the last capture of a state
+    long paths_taken; // recorded at the last capture the renderer took
 
     struct model *model;
     float scale;
+    long retired_step; // first step the object is no longer part of
 
-    unsigned int vao; // array object for the actual object
-    unsigned int vbo; // buffer for vertices
-    unsigned int ebo; // buffer for indices
-    unsigned int nbo; // buffer for normals
-
+    // owned by the renderer
     unsigned int pvao; // array object for paths
-    unsigned int pbo; // buffer for paths
+    unsigned int pbo; // buffer for paths, paths_max+1 positions
+    long paths_uploaded; // recorded positions already in the buffer
+    long paths_uploaded_clears;
 };
 
-extern struct object *objects;
+extern struct model *models;
 
 //int load_model_to_object(const char *path, struct object *obj);
+struct model *find_model(const char *path);
 struct model *load_model(const char *path);
+int queue_model_load(const char *path);
+int start_model_loads(void);
+void wait_model_loads(void);
 int record_path(struct object *obj);
+void clear_path(struct object *obj);
+struct object *first_object(void);
+struct object *next_object(struct object *obj);
+long count_objects(void);
+struct object *resolve_object(long handle);
+struct object *attach_object(long body, struct model *model);
 struct object *create_object(float mass, struct model *model);
+void retire_object(struct object *obj, long step);
+struct object *take_retired_objects(void);
+void free_object(struct object *obj);
+void free_retired_objects(void);
 
 #endif
@@ -0,0 +1,293 @@
+#include "octree.h"
+
+#include "body.h"
+#include "math.h"
+#include "workers.h"
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static struct octree tree;
+
+static long allocate_nodes(long num) {
+    if (tree.nodes_num + num > tree.nodes_max) {
+        long max = (tree.nodes_max == 0) ? 1024 : tree.nodes_max;
+        while (tree.nodes_num + num > max) {
+            max *= 2;
+        }
+
+        struct octree_node *nodes = (struct octree_node *) reallocarray(tree.nodes, max, sizeof(struct octree_node));
+        if (nodes == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for octree nodes\n");
+            return -1;
+        }
+
+        tree.nodes = nodes;
+        tree.nodes_max = max;
+    }
+
+    long first = tree.nodes_num;
+    tree.nodes_num += num;
+
+    for (long i = first; i < tree.nodes_num; i++) {
+        tree.nodes[i].children = -1;
+        tree.nodes[i].first = -1;
+        tree.nodes[i].count = 0;
+        tree.nodes[i].mass = 0.0f;
+    }
+
+    return first;
+}
+
+static int octant(struct octree_node *node, struct bodies *b, long body) {
+    return (b->x[body] >= node->center[0]) | ((b->y[body] >= node->center[1]) << 1) | ((b->z[body] >= node->center[2]) << 2);
+}
+
+static void push_body(struct octree_node *leaf, long body) {
+    tree.next[body] = leaf->first;
+    leaf->first = body;
+    leaf->count++;
+}
+
+static int split_node(struct bodies *b, long node) {
+    long children = allocate_nodes(8);
+    if (children == -1) {
+        return -1;
+    }
+
+    struct octree_node *parent = &tree.nodes[node];
+    float quarter = parent->half / 2.0f;
+
+    for (int i = 0; i < 8; i++) {
+        struct octree_node *child = &tree.nodes[children+i];
+        child->half = quarter;
+        child->center[0] = parent->center[0] + ((i & 1) ? quarter : -quarter);
+        child->center[1] = parent->center[1] + ((i & 2) ? quarter : -quarter);
+        child->center[2] = parent->center[2] + ((i & 4) ? quarter : -quarter);
+    }
+
+    // move the bodies of the former leaf into the children
+    long body = parent->first;
+    while (body != -1) {
+        long next = tree.next[body];
+        push_body(&tree.nodes[children + octant(parent, b, body)], body);
+        body = next;
+    }
+
+    parent->children = children;
+    parent->first = -1;
+    parent->count = 0;
+
+    return 0;
+}
+
+static int insert_body(struct bodies *b, long body) {
+    long node = 0;
+
+    for (int depth = 0; ; depth++) {
+        if (tree.nodes[node].children == -1) {
+            if (tree.nodes[node].count < OCTREE_LEAF_CAPACITY || depth == OCTREE_MAX_DEPTH) {
+                push_body(&tree.nodes[node], body);
+                return 0;
+            }
+
+            if (split_node(b, node) == -1) {
+                return -1;
+            }
+        }
+
+        struct octree_node *current = &tree.nodes[node];
+        node = current->children + octant(current, b, body);
+    }
+}
+
+// accumulate masses and centers of mass from the leaves up
+static void summarize_node(struct bodies *b, long node) {
+    struct octree_node *current = &tree.nodes[node];
+    float mass = 0.0f;
+    float com[3] = {0.0f, 0.0f, 0.0f};
+
+    if (current->children == -1) {
+        for (long body = current->first; body != -1; body = tree.next[body]) {
+            tree.order[tree.order_num++] = body;
+            mass += b->mass[body];
+            com[0] += b->x[body] * b->mass[body];
+            com[1] += b->y[body] * b->mass[body];
+            com[2] += b->z[body] * b->mass[body];
+        }
+    } else {
+        for (int i = 0; i < 8; i++) {
+            long child = current->children + i;
+            summarize_node(b, child);
+
+            struct octree_node *child_node = &tree.nodes[child];
+            mass += child_node->mass;
+            com[0] += child_node->com[0] * child_node->mass;
+            com[1] += child_node->com[1] * child_node->mass;
+            com[2] += child_node->com[2] * child_node->mass;
+        }
+    }
+
+    current->mass = mass;
+    for (int i = 0; i < 3; i++) {
+        current->com[i] = (mass > 0.0f) ? com[i] / mass : current->center[i];
+    }
+}
+
+int octree_build(struct bodies *b) {
+    tree.nodes_num = 0;
+    tree.order_num = 0;
+
+    if (b->num > tree.bodies_max) {
+        long *next = (long *) reallocarray(tree.next, b->num, sizeof(long));
+        if (next != NULL) {
+            tree.next = next;
+        }
+
+        long *order = (long *) reallocarray(tree.order, b->num, sizeof(long));
+        if (order != NULL) {
+            tree.order = order;
+        }
+
+        if (next == NULL || order == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for octree leaves\n");
+            return -1;
+        }
+
+        tree.bodies_max = b->num;
+    }
+
+    if (allocate_nodes(1) == -1) {
+        return -1;
+    }
+
+    // root cube around all bodies
+    float min[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+    float max[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    float *coordinates[3] = {b->x, b->y, b->z};
+
+    for (long i = 0; i < b->num; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            min[axis] = fminf(min[axis], coordinates[axis][i]);
+            max[axis] = fmaxf(max[axis], coordinates[axis][i]);
+        }
+    }
+
+    struct octree_node *root = &tree.nodes[0];
+    root->half = 0.0f;
+    for (int axis = 0; axis < 3; axis++) {
+        root->center[axis] = (b->num > 0) ? (min[axis] + max[axis]) / 2.0f : 0.0f;
+        root->half = fmaxf(root->half, (max[axis] - min[axis]) / 2.0f);
+    }
+
+    // keep bodies on the boundary inside the cube
+    root->half = root->half * 1.001f + FLT_MIN;
+
+    for (long i = 0; i < b->num; i++) {
+        if (insert_body(b, i) == -1) {
+            return -1;
+        }
+    }
+
+    summarize_node(b, 0);
+    return 0;
+}
+
+// accelerations of the bodies list[first] to list[last-1] from the tree
+// built by octree_build. lists in leaf order make neighbouring bodies walk
+// mostly the same nodes.
+void octree_walk(struct bodies *b, float theta, const long *list, long first, long last) {
+    long stack[8*(OCTREE_MAX_DEPTH+1)];
+    float theta_squared = theta * theta;
+
+    for (long k = first; k < last; k++) {
+        long i = list[k];
+        float xi = b->x[i];
+        float yi = b->y[i];
+        float zi = b->z[i];
+        vec3 acceleration = {0.0f, 0.0f, 0.0f};
+
+        int top = 0;
+        stack[top++] = 0;
+
+        while (top > 0) {
+            struct octree_node *node = &tree.nodes[stack[--top]];
+
+            if (node->mass == 0.0f) {
+                continue;
+            }
+
+            if (node->children == -1) {
+                for (long body = node->first; body != -1; body = tree.next[body]) {
+                    if (body == i) {
+                        continue;
+                    }
+
+                    gravity_acceleration(b->x[body] - xi, b->y[body] - yi, b->z[body] - zi, b->mass[body], acceleration);
+                }
+
+                continue;
+            }
+
+            float dx = node->com[0] - xi;
+            float dy = node->com[1] - yi;
+            float dz = node->com[2] - zi;
+            float distance_squared = dx*dx + dy*dy + dz*dz;
+            float size = node->half * 2.0f;
+
+            // far enough to be treated as a single mass
+            if (size * size < theta_squared * distance_squared) {
+                gravity_acceleration(dx, dy, dz, node->mass, acceleration);
+                continue;
+            }
+
+            for (int child = 0; child < 8; child++) {
+                stack[top++] = node->children + child;
+            }
+        }
+
+        b->ax[i] = acceleration[0];
+        b->ay[i] = acceleration[1];
+        b->az[i] = acceleration[2];
+    }
+}
+
+struct walk_arguments {
+    struct bodies *b;
+    float theta;
+    const long *list;
+    long num;
+};
+
+// blocks are handed out round robin, every body is computed independently
+// so the result does not depend on the number of threads
+static void walk_task(void *arg, int thread, int threads) {
+    struct walk_arguments *walk = (struct walk_arguments *) arg;
+    long num = walk->num;
+
+    for (long first = (long) thread * OCTREE_WALK_BLOCK; first < num; first += (long) threads * OCTREE_WALK_BLOCK) {
+        long last = (first + OCTREE_WALK_BLOCK < num) ? first + OCTREE_WALK_BLOCK : num;
+        octree_walk(walk->b, walk->theta, walk->list, first, last);
+    }
+}
+
+int octree_accelerations(struct bodies *b, float theta) {
+    if (octree_build(b) == -1) {
+        return -1;
+    }
+
+    struct walk_arguments walk = { b, theta, tree.order, tree.order_num };
+    workers_run(walk_task, &walk);
+    return 0;
+}
+
+// only the listed bodies, the tree still holds all of them
+int octree_accelerations_of(struct bodies *b, float theta, const long *list, long num) {
+    if (octree_build(b) == -1) {
+        return -1;
+    }
+
+    struct walk_arguments walk = { b, theta, list, num };
+    workers_run(walk_task, &walk);
+    return 0;
+}
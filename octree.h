@@ -0,0 +1,39 @@
+#ifndef OCTREE_H
+#define OCTREE_H
+
+#include "body.h"
+
+#define OCTREE_DEFAULT_THETA 0.5f
+#define OCTREE_LEAF_CAPACITY 8
+#define OCTREE_MAX_DEPTH 32
+#define OCTREE_WALK_BLOCK 64 // bodies per block of the parallel walk
+
+struct octree_node {
+    float center[3];
+    float half; // half of the side length of the cube
+
+    float com[3]; // center of mass
+    float mass;
+
+    long children; // index of the first of 8 consecutive children, -1 for leaves
+    long first; // first body of a leaf, chained through octree.next
+    int count;
+};
+
+struct octree {
+    struct octree_node *nodes;
+    long nodes_num;
+    long nodes_max;
+
+    long *next; // next body in the same leaf, -1 terminated
+    long *order; // bodies in depth first leaf order
+    long order_num;
+    long bodies_max;
+};
+
+int octree_build(struct bodies *b);
+void octree_walk(struct bodies *b, float theta, const long *list, long first, long last);
+int octree_accelerations(struct bodies *b, float theta);
+int octree_accelerations_of(struct bodies *b, float theta, const long *list, long num);
+
+#endif
@@ -0,0 +1,327 @@
+#include "physics.h"
+
+#include "body.h"
+#include "collision.h"
+#include "profiler.h"
+#include "simulation.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static struct physics physics;
+static struct object *graveyard; // retired objects the renderer may still draw
+
+double physics_time(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec * 1e-9;
+}
+
+static void run_command(struct physics_command *command) {
+    switch (command->type) {
+        case COMMAND_SPAWN: {
+            struct object *obj = create_object(command->mass, command->model);
+            if (obj == NULL) {
+                fprintf(stderr, "Error: spawning object\n");
+                break;
+            }
+
+            translate_body(obj->body, command->position);
+            break;
+        }
+        case COMMAND_TRACING:
+            physics.tracing = !physics.tracing;
+            if (physics.tracing == 0) {
+                break;
+            }
+
+            // remove all the recorded paths of objects
+            for (struct object *obj = first_object(); obj != NULL; obj = next_object(obj)) {
+                clear_path(obj);
+            }
+            break;
+        case COMMAND_SNAPSHOT:
+            if (save_snapshot(command->path, simulation_steps) != 0) {
+                fprintf(stderr, "Error: saving snapshot\n");
+            }
+            break;
+        case COMMAND_SOLVER:
+            next_force_solver();
+            fprintf(stdout, "Status: using %s force solver\n", force_solver_name());
+            break;
+        case COMMAND_COLLISIONS:
+            collisions_enabled = !collisions_enabled;
+            fprintf(stdout, "Status: collisions %s\n", (collisions_enabled == 1) ? "enabled" : "disabled");
+            break;
+        case COMMAND_GENERATE:
+            if (generate_bodies(&command->generator, command->model) == -1) {
+                fprintf(stderr, "Error: generating bodies\n");
+            }
+            break;
+    }
+}
+
+static void run_commands(void) {
+    long read = atomic_load_explicit(&physics.commands_read, memory_order_relaxed);
+    long written = atomic_load_explicit(&physics.commands_written, memory_order_acquire);
+
+    for (; read < written; read++) {
+        run_command(&physics.commands[read % PHYSICS_COMMANDS]);
+    }
+
+    atomic_store_explicit(&physics.commands_read, read, memory_order_release);
+}
+
+// queue an action for the physics thread, from the main thread only
+int physics_send(const struct physics_command *command) {
+    long written = atomic_load_explicit(&physics.commands_written, memory_order_relaxed);
+    long read = atomic_load_explicit(&physics.commands_read, memory_order_acquire);
+
+    if (written - read == PHYSICS_COMMANDS) {
+        fprintf(stderr, "Error: physics command queue is full\n");
+        return -1;
+    }
+
+    physics.commands[written % PHYSICS_COMMANDS] = *command;
+    atomic_store_explicit(&physics.commands_written, written + 1, memory_order_release);
+    return 0;
+}
+
+// the positions recorded since the last state the renderer took, at most
+// a full ring, are copied out of the ring in the order they were recorded
+static int capture_path(struct physics_state *state, struct state_object *state_object, struct object *obj) {
+    long pending = obj->paths_recorded - obj->paths_taken;
+    int num = (pending < obj->paths_num) ? (int) pending : obj->paths_num;
+
+    if (state->paths_num + num > state->paths_max) {
+        long max = (state->paths_max > 0) ? state->paths_max : MAX_PATHS;
+        while (max < state->paths_num + num) {
+            max *= 2;
+        }
+
+        float *paths = (float *) reallocarray(state->paths, max * 3, sizeof(float));
+        if (paths == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for the paths of the render state\n");
+            return -1;
+        }
+
+        state->paths = paths;
+        state->paths_max = max;
+    }
+
+    int first = (obj->paths_head - num + obj->paths_max) % obj->paths_max;
+    int wrapped = (first + num > obj->paths_max) ? first + num - obj->paths_max : 0;
+    float *to = state->paths + state->paths_num * 3;
+
+    memcpy(to, obj->paths + first * 3, (num - wrapped) * 3 * sizeof(float));
+    memcpy(to + (num - wrapped) * 3, obj->paths, wrapped * 3 * sizeof(float));
+
+    state_object->paths_first = state->paths_num;
+    state_object->paths_new = num;
+    state->paths_num += num;
+    return 0;
+}
+
+// from the thread that steps the simulation. taken tells that the renderer
+// took the state captured before, so it has the paths up to that one.
+int physics_capture(struct physics_state *state, int taken) {
+    long num = count_objects();
+    if (num > state->objects_max) {
+        struct state_object *state_objects = (struct state_object *) reallocarray(state->objects, num, sizeof(struct state_object));
+        if (state_objects == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for the render state\n");
+            return -1;
+        }
+
+        state->objects = state_objects;
+        state->objects_max = num;
+    }
+
+    state->paths_num = 0;
+
+    struct state_object *state_object = state->objects;
+    for (struct object *obj = first_object(); obj != NULL; obj = next_object(obj)) {
+        state_object->handle = obj->handle;
+        state_object->object = obj;
+        body_position(obj->body, state_object->position);
+        state_object->scale = obj->scale;
+        state_object->paths_num = obj->paths_num;
+        state_object->paths_head = obj->paths_head;
+        state_object->paths_recorded = obj->paths_recorded;
+        state_object->paths_clears = obj->paths_clears;
+        state_object->paths_first = 0;
+        state_object->paths_new = 0;
+
+        if (taken == 1) {
+            obj->paths_taken = obj->paths_captured;
+        }
+        obj->paths_captured = obj->paths_recorded;
+
+        if (obj->paths_num != 0 && capture_path(state, state_object, obj) == -1) {
+            return -1;
+        }
+
+        state_object++;
+    }
+
+    state->objects_num = num;
+    state->step = simulation_steps;
+    return 0;
+}
+
+// hand the written state over and continue with whichever state the
+// renderer left, or the published one if it was never taken
+static void publish(void) {
+    physics.states[physics.writing].published = physics_time();
+
+    int old = atomic_exchange(&physics.published, physics.writing | PHYSICS_FRESH);
+    physics.writing = old & ~PHYSICS_FRESH;
+}
+
+static void wait_until(double time) {
+    double wait = time - physics_time();
+    if (wait <= 0.0) {
+        return;
+    }
+
+    struct timespec duration = { (time_t) wait, (long) ((wait - (double) (time_t) wait) * 1e9) };
+    nanosleep(&duration, NULL);
+}
+
+static void *physics_thread(void *arg) {
+    profile_thread(PROFILER_PHYSICS);
+    double next_step = physics_time();
+
+    while (atomic_load(&physics.running) == 1) {
+        profile_begin(PHASE_FRAME);
+        run_commands();
+
+        // a state still fresh may be replaced untaken, its paths go into the next one too
+        int taken = (atomic_load(&physics.published) & PHYSICS_FRESH) == 0;
+
+        if (simulate_step(physics.dt, physics.tracing) == -1 || physics_capture(&physics.states[physics.writing], taken) == -1) {
+            atomic_store(&physics.failed, 1);
+            break;
+        }
+
+        publish();
+        profile_end(PHASE_FRAME);
+        profile_end_frame();
+
+        if (physics.rate <= 0.0f) {
+            continue;
+        }
+
+        // keep a steady rate, but do not race to catch up after a stall
+        next_step += 1.0 / physics.rate;
+        if (physics_time() - next_step > PHYSICS_MAX_LAG) {
+            next_step = physics_time();
+        }
+
+        wait_until(next_step);
+    }
+
+    return NULL;
+}
+
+// the current state of the simulation is published before the thread starts
+int physics_start(float dt, float rate, int tracing) {
+    physics.dt = dt;
+    physics.rate = rate;
+    physics.tracing = tracing;
+
+    physics.writing = 0;
+    physics.current = 1;
+    physics.previous = 2;
+    atomic_store(&physics.published, 3);
+
+    for (int i = 0; i < PHYSICS_STATES; i++) {
+        physics.states[i].step = -1;
+    }
+
+    if (physics_capture(&physics.states[physics.writing], 1) == -1) {
+        return -1;
+    }
+
+    publish();
+
+    atomic_store(&physics.running, 1);
+    if (pthread_create(&physics.thread, NULL, physics_thread, NULL) != 0) {
+        fprintf(stderr, "Error: failed starting the physics thread\n");
+        atomic_store(&physics.running, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+void physics_stop(void) {
+    if (atomic_exchange(&physics.running, 0) == 0) {
+        return;
+    }
+
+    pthread_join(physics.thread, NULL);
+}
+
+int physics_failed(void) {
+    return atomic_load(&physics.failed);
+}
+
+// the newest state and the one before it, states without a step are empty.
+// returns 1 if a new state was taken.
+int physics_take(struct physics_state **current, struct physics_state **previous) {
+    int taken = 0;
+
+    // only the renderer clears the flag, so it is still set on exchange
+    if ((atomic_load(&physics.published) & PHYSICS_FRESH) != 0) {
+        int newest = atomic_exchange(&physics.published, physics.previous);
+        physics.previous = physics.current;
+        physics.current = newest & ~PHYSICS_FRESH;
+        taken = 1;
+    }
+
+    *current = &physics.states[physics.current];
+    *previous = &physics.states[physics.previous];
+    return taken;
+}
+
+// objects are released once both states held by the renderer are past
+// their retirement, from the main thread only
+void physics_release_objects(void (*release)(struct object *obj)) {
+    struct object *taken = take_retired_objects();
+    while (taken != NULL) {
+        struct object *next = taken->next;
+        taken->next = graveyard;
+        graveyard = taken;
+        taken = next;
+    }
+
+    long oldest = physics.states[physics.previous].step;
+    if (oldest < 0 || physics.states[physics.current].step < oldest) {
+        oldest = physics.states[physics.current].step;
+    }
+
+    struct object *previous = NULL;
+    struct object *obj = graveyard;
+
+    while (obj != NULL) {
+        struct object *next = obj->next;
+
+        if (obj->retired_step <= oldest) {
+            if (previous == NULL) {
+                graveyard = next;
+            } else {
+                previous->next = next;
+            }
+
+            release(obj);
+            free_object(obj);
+        } else {
+            previous = obj;
+        }
+
+        obj = next;
+    }
+}
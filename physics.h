@@ -0,0 +1,97 @@
+#ifndef PHYSICS_H
+#define PHYSICS_H
+
+#include "generator.h"
+#include "object.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define PHYSICS_DEFAULT_RATE 60.0f // steps per second
+#define PHYSICS_STATES 4 // one being written, one published, two being interpolated
+#define PHYSICS_FRESH 0x100 // published state not taken by the renderer yet
+#define PHYSICS_COMMANDS 64
+#define PHYSICS_MAX_LAG 0.25 // seconds the physics may fall behind before it stops catching up
+
+// what the renderer needs of an object at the end of a step
+struct state_object {
+    long handle;
+    struct object *object; // only the fields owned by the renderer may be used
+    float position[3];
+    float scale;
+
+    int paths_num;
+    int paths_head;
+    long paths_recorded;
+    long paths_clears;
+    long paths_first; // first of the new positions in the paths of the state
+    int paths_new; // positions up to paths_recorded the renderer may not have yet
+};
+
+struct physics_state {
+    struct state_object *objects; // handles increasing
+    long objects_num;
+    long objects_max;
+
+    float *paths; // copies of the new path positions, the renderer never reads the rings
+    long paths_num;
+    long paths_max;
+
+    long step;
+    double published; // monotonic seconds
+};
+
+// input of the main thread, run by the physics thread before its next step
+enum physics_command_type {
+    COMMAND_SPAWN,
+    COMMAND_TRACING, // toggle, the paths are cleared when switched on
+    COMMAND_SNAPSHOT,
+    COMMAND_SOLVER, // cycle direct, barnes-hut and particle mesh
+    COMMAND_COLLISIONS, // toggle
+    COMMAND_GENERATE,
+};
+
+struct physics_command {
+    enum physics_command_type type;
+
+    struct model *model; // spawned or generated objects
+    float mass;
+    float position[3];
+
+    const char *path; // snapshot
+    struct generator generator;
+};
+
+// the states are handed over without locks: the physics thread owns the one
+// it writes, the renderer the two it interpolates between and the remaining
+// one is exchanged through published
+struct physics {
+    struct physics_state states[PHYSICS_STATES];
+    atomic_int published; // index, with PHYSICS_FRESH while not taken
+    int writing;
+    int current;
+    int previous;
+
+    // single producer and single consumer ring
+    struct physics_command commands[PHYSICS_COMMANDS];
+    atomic_long commands_written;
+    atomic_long commands_read;
+
+    float dt;
+    float rate; // steps per second, 0 for as fast as possible
+    int tracing;
+
+    atomic_int running;
+    atomic_int failed;
+    pthread_t thread;
+};
+
+double physics_time(void);
+int physics_capture(struct physics_state *state, int taken);
+int physics_start(float dt, float rate, int tracing);
+void physics_stop(void);
+int physics_failed(void);
+int physics_send(const struct physics_command *command);
+int physics_take(struct physics_state **current, struct physics_state **previous);
+void physics_release_objects(void (*release)(struct object *obj));
+
+#endif
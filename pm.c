@@ -0,0 +1,369 @@
+#include "pm.h"
+
+#include "math.h"
+#include "workers.h"
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct particle_mesh pm;
+
+// index into the padded grid
+static long cell(long x, long y, long z) {
+    return x + pm.size*(y + pm.size*z);
+}
+
+// index into the unpadded grid
+static long inner_cell(long x, long y, long z) {
+    return x + pm.grid*(y + (long) pm.grid*z);
+}
+
+struct fft_pass {
+    int axis; // 0 for x, 1 for y, 2 for z
+    long limit_a; // only lines whose other coordinates are below the limits,
+    long limit_b; // (y, z) for the x axis, (x, z) for y and (x, y) for z
+    int inverse;
+};
+
+static void fft_task(void *arg, int thread, int threads) {
+    struct fft_pass *pass = (struct fft_pass *) arg;
+    long size = pm.size;
+
+    // contiguous lines are transformed in place
+    if (pass->axis == 0) {
+        long lines = pass->limit_a * pass->limit_b;
+
+        for (long l = thread; l < lines; l += threads) {
+            long y = l % pass->limit_a;
+            long z = l / pass->limit_a;
+            fft(&pm.plan, &pm.density[2*cell(0, y, z)], pass->inverse);
+        }
+
+        return;
+    }
+
+    // strided lines are gathered in blocks of neighbouring x
+    long stride = (pass->axis == 1) ? size : size*size;
+    long x_blocks = pass->limit_a / PM_LINES_BLOCK;
+    long blocks = x_blocks * pass->limit_b;
+    double *lines = &pm.lines[(long) thread * PM_LINES_BLOCK * size * 2];
+
+    for (long l = thread; l < blocks; l += threads) {
+        long x = (l % x_blocks) * PM_LINES_BLOCK;
+        long other = l / x_blocks;
+        double *first = &pm.density[2*((pass->axis == 1) ? cell(x, 0, other) : cell(x, other, 0))];
+
+        for (long k = 0; k < size; k++) {
+            double *source = first + 2*k*stride;
+            for (int c = 0; c < PM_LINES_BLOCK; c++) {
+                lines[2*(c*size + k)] = source[2*c];
+                lines[2*(c*size + k) + 1] = source[2*c + 1];
+            }
+        }
+
+        for (int c = 0; c < PM_LINES_BLOCK; c++) {
+            fft(&pm.plan, &lines[2*c*size], pass->inverse);
+        }
+
+        for (long k = 0; k < size; k++) {
+            double *target = first + 2*k*stride;
+            for (int c = 0; c < PM_LINES_BLOCK; c++) {
+                target[2*c] = lines[2*(c*size + k)];
+                target[2*c + 1] = lines[2*(c*size + k) + 1];
+            }
+        }
+    }
+}
+
+static void fft_axis(int axis, long limit_a, long limit_b, int inverse) {
+    struct fft_pass pass = { axis, limit_a, limit_b, inverse };
+    workers_run(fft_task, &pass);
+}
+
+// the transform of a real and symmetric function is real and symmetric
+static void prepare_green(void) {
+    long size = pm.size;
+
+    for (long z = 0; z < size; z++) {
+        for (long y = 0; y < size; y++) {
+            for (long x = 0; x < size; x++) {
+                // offsets past the middle wrap around to negative ones
+                double dx = (x < pm.grid) ? x : x - size;
+                double dy = (y < pm.grid) ? y : y - size;
+                double dz = (z < pm.grid) ? z : z - size;
+
+                long i = cell(x, y, z);
+                pm.density[2*i] = sqrt(dx*dx + dy*dy + dz*dz);
+                pm.density[2*i + 1] = 0.0;
+            }
+        }
+    }
+
+    fft_axis(0, size, size, 0);
+    fft_axis(1, size, size, 0);
+    fft_axis(2, size, size, 0);
+
+    for (long i = 0; i < size*size*size; i++) {
+        pm.green[i] = pm.density[2*i];
+    }
+}
+
+static int prepare_mesh(int grid) {
+    int threads = workers_num();
+
+    if (grid == pm.grid && threads <= pm.lines_num) {
+        return 0;
+    }
+
+    if (grid < PM_MIN_GRID || (grid & (grid-1)) != 0) {
+        fprintf(stderr, "Error: particle mesh grid %d is not a power of two of at least %d\n", grid, PM_MIN_GRID);
+        return -1;
+    }
+
+    long size = 2L * grid;
+    long cells = size*size*size;
+    long inner_cells = (long) grid*grid*grid;
+
+    double *density = (double *) reallocarray(pm.density, 2*cells, sizeof(double));
+    if (density != NULL) {
+        pm.density = density;
+    }
+
+    double *green = (double *) reallocarray(pm.green, cells, sizeof(double));
+    if (green != NULL) {
+        pm.green = green;
+    }
+
+    float *ax = (float *) reallocarray(pm.ax, inner_cells, sizeof(float));
+    if (ax != NULL) {
+        pm.ax = ax;
+    }
+
+    float *ay = (float *) reallocarray(pm.ay, inner_cells, sizeof(float));
+    if (ay != NULL) {
+        pm.ay = ay;
+    }
+
+    float *az = (float *) reallocarray(pm.az, inner_cells, sizeof(float));
+    if (az != NULL) {
+        pm.az = az;
+    }
+
+    double *lines = (double *) reallocarray(pm.lines, (long) threads * PM_LINES_BLOCK * size * 2, sizeof(double));
+    if (lines != NULL) {
+        pm.lines = lines;
+    }
+
+    if (density == NULL || green == NULL || ax == NULL || ay == NULL || az == NULL || lines == NULL) {
+        fprintf(stderr, "Error: failed allocating memory for a particle mesh of %d cells\n", grid);
+        pm.grid = 0;
+        return -1;
+    }
+
+    if (fft_prepare(&pm.plan, size) == -1) {
+        pm.grid = 0;
+        return -1;
+    }
+
+    pm.grid = grid;
+    pm.size = size;
+    pm.lines_num = threads;
+
+    // cells on the border of the unpadded grid never get an acceleration
+    memset(pm.ax, 0, inner_cells*sizeof(float));
+    memset(pm.ay, 0, inner_cells*sizeof(float));
+    memset(pm.az, 0, inner_cells*sizeof(float));
+
+    prepare_green();
+    return 0;
+}
+
+// cell of the lower corner of the cloud and the weight of the upper one
+static long cloud_corner(float position, int axis, float *weight) {
+    float u = (position - pm.origin[axis]) / pm.spacing;
+    long corner = (long) floorf(u);
+
+    // rounding may push the bodies on the far side out by a cell
+    if (corner < PM_MARGIN) {
+        corner = PM_MARGIN;
+    }
+
+    if (corner > pm.grid - PM_MARGIN - 1) {
+        corner = pm.grid - PM_MARGIN - 1;
+    }
+
+    *weight = fminf(fmaxf(u - corner, 0.0f), 1.0f);
+    return corner;
+}
+
+// a cube around all bodies with PM_MARGIN empty cells on every side
+static void place_grid(struct bodies *b) {
+    float min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    float *positions[3] = { b->x, b->y, b->z };
+
+    for (int axis = 0; axis < 3; axis++) {
+        for (long i = 0; i < b->num; i++) {
+            min[axis] = fminf(min[axis], positions[axis][i]);
+            max[axis] = fmaxf(max[axis], positions[axis][i]);
+        }
+    }
+
+    float extent = fmaxf(fmaxf(max[0] - min[0], max[1] - min[1]), max[2] - min[2]);
+    pm.spacing = (extent > 0.0f) ? extent / (float) (pm.grid - 2*PM_MARGIN - 1) : 1.0f;
+
+    for (int axis = 0; axis < 3; axis++) {
+        pm.origin[axis] = min[axis] - PM_MARGIN * pm.spacing;
+    }
+}
+
+static void assign_masses(struct bodies *b) {
+    memset(pm.density, 0, 2*pm.size*pm.size*pm.size*sizeof(double));
+
+    for (long i = 0; i < b->num; i++) {
+        float fx, fy, fz;
+        long x = cloud_corner(b->x[i], 0, &fx);
+        long y = cloud_corner(b->y[i], 1, &fy);
+        long z = cloud_corner(b->z[i], 2, &fz);
+
+        for (int corner = 0; corner < 8; corner++) {
+            int cx = corner & 1;
+            int cy = (corner >> 1) & 1;
+            int cz = (corner >> 2) & 1;
+            float weight = (cx ? fx : 1.0f - fx) * (cy ? fy : 1.0f - fy) * (cz ? fz : 1.0f - fz);
+
+            pm.density[2*cell(x + cx, y + cy, z + cz)] += b->mass[i] * weight;
+        }
+    }
+}
+
+static void convolve_task(void *arg, int thread, int threads) {
+    double scale = *(double *) arg;
+    long cells = pm.size*pm.size*pm.size;
+    long first = cells * thread / threads;
+    long last = cells * (thread + 1) / threads;
+
+    for (long i = first; i < last; i++) {
+        double factor = pm.green[i] * scale;
+        pm.density[2*i] *= factor;
+        pm.density[2*i + 1] *= factor;
+    }
+}
+
+// central differences of the potential, a = -grad(potential)
+static void gradient_task(void *arg, int thread, int threads) {
+    long grid = pm.grid;
+    float factor = -1.0f / (2.0f * pm.spacing);
+
+    for (long z = 1 + thread; z < grid - 1; z += threads) {
+        for (long y = 1; y < grid - 1; y++) {
+            for (long x = 1; x < grid - 1; x++) {
+                long i = inner_cell(x, y, z);
+
+                pm.ax[i] = (pm.density[2*cell(x+1, y, z)] - pm.density[2*cell(x-1, y, z)]) * factor;
+                pm.ay[i] = (pm.density[2*cell(x, y+1, z)] - pm.density[2*cell(x, y-1, z)]) * factor;
+                pm.az[i] = (pm.density[2*cell(x, y, z+1)] - pm.density[2*cell(x, y, z-1)]) * factor;
+            }
+        }
+    }
+}
+
+static int compute_mesh(struct bodies *b, int grid) {
+    if (prepare_mesh(grid) == -1) {
+        return -1;
+    }
+
+    place_grid(b);
+    assign_masses(b);
+
+    // only the first octant holds masses and only the first octant of the
+    // potential is valid, the ffts skip the lines that are known to be zero
+    // or are not needed
+    long size = pm.size;
+    fft_axis(0, grid, grid, 0);
+    fft_axis(1, size, grid, 0);
+    fft_axis(2, size, size, 0);
+
+    // potential = G * FORCE_SCALE * sum of mass * distance, the inverse
+    // transform is not normalized
+    double scale = GRAVITY_CONSTANT * FORCE_SCALE * pm.spacing / ((double) size*size*size);
+    workers_run(convolve_task, &scale);
+
+    fft_axis(2, size, size, 1);
+    fft_axis(1, size, grid, 1);
+    fft_axis(0, grid, grid, 1);
+
+    workers_run(gradient_task, NULL);
+    return 0;
+}
+
+struct interpolation {
+    struct bodies *b;
+    const long *list; // NULL for all bodies
+    long num;
+};
+
+static void interpolate_task(void *arg, int thread, int threads) {
+    struct interpolation *interpolation = (struct interpolation *) arg;
+    struct bodies *b = interpolation->b;
+
+    for (long first = (long) thread * PM_INTERPOLATE_BLOCK; first < interpolation->num; first += (long) threads * PM_INTERPOLATE_BLOCK) {
+        long last = (first + PM_INTERPOLATE_BLOCK < interpolation->num) ? first + PM_INTERPOLATE_BLOCK : interpolation->num;
+
+        for (long n = first; n < last; n++) {
+            long i = (interpolation->list != NULL) ? interpolation->list[n] : n;
+
+            float fx, fy, fz;
+            long x = cloud_corner(b->x[i], 0, &fx);
+            long y = cloud_corner(b->y[i], 1, &fy);
+            long z = cloud_corner(b->z[i], 2, &fz);
+
+            float acceleration[3] = { 0.0f, 0.0f, 0.0f };
+            for (int corner = 0; corner < 8; corner++) {
+                int cx = corner & 1;
+                int cy = (corner >> 1) & 1;
+                int cz = (corner >> 2) & 1;
+                float weight = (cx ? fx : 1.0f - fx) * (cy ? fy : 1.0f - fy) * (cz ? fz : 1.0f - fz);
+                long c = inner_cell(x + cx, y + cy, z + cz);
+
+                acceleration[0] += pm.ax[c] * weight;
+                acceleration[1] += pm.ay[c] * weight;
+                acceleration[2] += pm.az[c] * weight;
+            }
+
+            b->ax[i] = acceleration[0];
+            b->ay[i] = acceleration[1];
+            b->az[i] = acceleration[2];
+        }
+    }
+}
+
+int pm_accelerations(struct bodies *b, int grid) {
+    if (b->num == 0) {
+        return 0;
+    }
+
+    if (compute_mesh(b, grid) == -1) {
+        return -1;
+    }
+
+    struct interpolation interpolation = { b, NULL, b->num };
+    workers_run(interpolate_task, &interpolation);
+    return 0;
+}
+
+// only the listed bodies, the mesh still holds all of them
+int pm_accelerations_of(struct bodies *b, int grid, const long *list, long num) {
+    if (num == 0) {
+        return 0;
+    }
+
+    if (compute_mesh(b, grid) == -1) {
+        return -1;
+    }
+
+    struct interpolation interpolation = { b, list, num };
+    workers_run(interpolate_task, &interpolation);
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef PM_H
+#define PM_H
+
+#include "body.h"
+#include "fft.h"
+
+#define PM_DEFAULT_GRID 64
+#define PM_MIN_GRID 8
+#define PM_MARGIN 2 // cells between the bodies and the edge of the grid
+#define PM_LINES_BLOCK 4 // strided lines transformed together, a cache line of complex doubles
+#define PM_INTERPOLATE_BLOCK 256 // bodies per block of the parallel interpolation
+
+// particle mesh solver: masses are spread onto a grid with cloud in cell
+// weights and the potential is their convolution with the distance, the
+// green's function of the force law. the convolution runs through ffts on
+// a grid of twice the size, so the boundaries are isolated, not periodic.
+struct particle_mesh {
+    int grid; // cells per side covering the bodies, power of two
+    long size; // cells per side of the padded grid, 2*grid
+
+    double *density; // padded grid of complex values, becomes the potential
+    double *green; // transform of the distance in cells, real
+
+    float *ax; // acceleration at the cells of the unpadded grid
+    float *ay;
+    float *az;
+
+    float origin[3]; // position of cell 0
+    float spacing; // side length of a cell
+
+    struct fft_plan plan;
+    double *lines; // gather buffers of the strided ffts, one per thread
+    int lines_num;
+};
+
+int pm_accelerations(struct bodies *b, int grid);
+int pm_accelerations_of(struct bodies *b, int grid, const long *list, long num);
+
+#endif
@@ -0,0 +1,248 @@
+#include "profiler.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PROFILE_LINE_MAX 1024
+
+int profile_overlay = 0; // draw the report on top of the scene
+
+static struct profiler profilers[PROFILERS_NUM] = {
+    [PROFILER_MAIN] = { .name = "main", .latency = PROFILE_GPU_LATENCY, .lock = PTHREAD_MUTEX_INITIALIZER },
+    [PROFILER_PHYSICS] = { .name = "physics", .latency = 0, .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+static __thread struct profiler *profiler = &profilers[PROFILER_MAIN];
+static int profilers_ready = 0; // histories cleared
+
+static FILE *profile_csv; // per frame records of all threads, NULL if not written
+static pthread_mutex_t csv_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *phase_names[] = {
+    [PHASE_FRAME] = "frame",
+    [PHASE_SIMULATION] = "simulation",
+    [PHASE_FORCES] = "forces",
+    [PHASE_COLLISIONS] = "collisions",
+    [PHASE_PATHS] = "paths",
+    [PHASE_CHECKPOINT] = "checkpoint",
+    [PHASE_TRAJECTORY] = "trajectory",
+    [PHASE_INSTANCES] = "instances",
+    [PHASE_PATH_UPLOADS] = "path_uploads",
+    [PHASE_PATH_DRAWS] = "path_draws",
+    [PHASE_SWAP] = "swap",
+    [PHASE_EXPORT] = "export",
+    [PHASE_GPU_INSTANCES] = "gpu_instances",
+    [PHASE_GPU_PATHS] = "gpu_paths",
+    [PHASE_GPU_FRAME] = "gpu_frame",
+};
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec * 1e-9;
+}
+
+static double *frame_record(struct profiler *p, long frame) {
+    return p->history[frame % PROFILE_HISTORY];
+}
+
+static void clear_record(double *record) {
+    for (int phase = 0; phase < PHASES_NUM; phase++) {
+        record[phase] = -1.0;
+    }
+}
+
+// runs before any other thread is started
+static void prepare_profilers(void) {
+    if (profilers_ready == 1) {
+        return;
+    }
+
+    for (int i = 0; i < PROFILERS_NUM; i++) {
+        clear_record(profilers[i].current);
+        for (int frame = 0; frame < PROFILE_HISTORY; frame++) {
+            clear_record(profilers[i].history[frame]);
+        }
+    }
+
+    profilers_ready = 1;
+}
+
+// records of every frame in milliseconds, the main thread writes them
+// PROFILE_GPU_LATENCY frames late so that the gpu times are known
+int profile_open(const char *path) {
+    prepare_profilers();
+
+    profile_csv = fopen(path, "w");
+    if (profile_csv == NULL) {
+        fprintf(stderr, "Error: cannot open profile '%s' for writing\n", path);
+        return -1;
+    }
+
+    fprintf(profile_csv, "thread,frame");
+    for (int phase = 0; phase < PHASES_NUM; phase++) {
+        fprintf(profile_csv, ",%s_ms", phase_names[phase]);
+    }
+    fprintf(profile_csv, "\n");
+
+    return 0;
+}
+
+// the history lock of the profiler is held
+static void write_record(struct profiler *p, long frame) {
+    char line[PROFILE_LINE_MAX];
+    double *record = frame_record(p, frame);
+    int length = snprintf(line, sizeof(line), "%s,%ld", p->name, frame);
+
+    for (int phase = 0; phase < PHASES_NUM; phase++) {
+        if (record[phase] < 0.0) {
+            length += snprintf(line + length, sizeof(line) - length, ",");
+        } else {
+            length += snprintf(line + length, sizeof(line) - length, ",%.4f", record[phase] * 1e3);
+        }
+    }
+
+    // whole lines, the threads write in turns
+    pthread_mutex_lock(&csv_lock);
+    fprintf(profile_csv, "%s\n", line);
+    pthread_mutex_unlock(&csv_lock);
+}
+
+// writes the frames that are still waiting for late measurements, all
+// other threads have stopped
+void profile_close(void) {
+    if (profile_csv == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < PROFILERS_NUM; i++) {
+        struct profiler *p = &profilers[i];
+        long first = p->frame - p->latency;
+
+        for (long frame = (first > 0) ? first : 0; frame < p->frame; frame++) {
+            write_record(p, frame);
+        }
+    }
+
+    fclose(profile_csv);
+    profile_csv = NULL;
+}
+
+// measurements of the calling thread go to this profiler
+void profile_thread(enum profiler_thread thread) {
+    profiler = &profilers[thread];
+}
+
+const char *profile_phase_name(enum profile_phase phase) {
+    return phase_names[phase];
+}
+
+long profile_frame(void) {
+    return profiler->frame;
+}
+
+void profile_begin(enum profile_phase phase) {
+    profiler->started[phase] = now();
+}
+
+// phases measured more than once in a frame add up
+void profile_end(enum profile_phase phase) {
+    prepare_profilers();
+
+    double seconds = now() - profiler->started[phase];
+    double *record = profiler->current;
+    record[phase] = (record[phase] < 0.0) ? seconds : record[phase] + seconds;
+}
+
+// late measurement of an earlier frame of the calling thread
+void profile_record(long frame, enum profile_phase phase, double seconds) {
+    prepare_profilers();
+
+    // too old, the record was already reused
+    if (frame >= profiler->frame || profiler->frame - frame >= PROFILE_HISTORY) {
+        return;
+    }
+
+    pthread_mutex_lock(&profiler->lock);
+    double *record = frame_record(profiler, frame);
+    record[phase] = (record[phase] < 0.0) ? seconds : record[phase] + seconds;
+    pthread_mutex_unlock(&profiler->lock);
+}
+
+void profile_end_frame(void) {
+    prepare_profilers();
+
+    pthread_mutex_lock(&profiler->lock);
+    memcpy(frame_record(profiler, profiler->frame), profiler->current, sizeof(profiler->current));
+
+    if (profile_csv != NULL && profiler->frame >= profiler->latency) {
+        write_record(profiler, profiler->frame - profiler->latency);
+    }
+
+    profiler->frame++;
+    pthread_mutex_unlock(&profiler->lock);
+
+    clear_record(profiler->current);
+}
+
+static int compare_seconds(const void *a, const void *b) {
+    double difference = *(const double *) a - *(const double *) b;
+    return (difference > 0.0) - (difference < 0.0);
+}
+
+// over the finished frames in the history of a thread
+void profile_stats(enum profiler_thread thread, enum profile_phase phase, struct profile_stats *stats) {
+    struct profiler *p = &profilers[thread];
+    double seconds[PROFILE_HISTORY];
+    double sum = 0.0;
+    int num = 0;
+
+    prepare_profilers();
+    pthread_mutex_lock(&p->lock);
+
+    long first = p->frame - PROFILE_HISTORY;
+    for (long frame = (first > 0) ? first : 0; frame < p->frame; frame++) {
+        double value = frame_record(p, frame)[phase];
+        if (value >= 0.0) {
+            seconds[num++] = value;
+            sum += value;
+        }
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->frames = num;
+
+    if (num == 0) {
+        return;
+    }
+
+    qsort(seconds, num, sizeof(double), compare_seconds);
+    stats->mean = sum / num;
+    stats->p50 = seconds[(num - 1) / 2];
+    stats->p95 = seconds[(num * 95 - 1) / 100];
+    stats->max = seconds[num - 1];
+}
+
+// one line per measured phase and thread, milliseconds
+int profile_report(char *text, long size) {
+    long length = snprintf(text, size, "%-22s %8s %8s %8s %8s\n", "phase (ms)", "mean", "p50", "p95", "max");
+
+    for (int thread = 0; thread < PROFILERS_NUM; thread++) {
+        for (int phase = 0; phase < PHASES_NUM && length < size; phase++) {
+            struct profile_stats stats;
+            profile_stats(thread, phase, &stats);
+
+            if (stats.frames == 0) {
+                continue;
+            }
+
+            length += snprintf(text + length, size - length, "%-8s %-13s %8.3f %8.3f %8.3f %8.3f\n", profilers[thread].name, phase_names[phase],
+                    stats.mean * 1e3, stats.p50 * 1e3, stats.p95 * 1e3, stats.max * 1e3);
+        }
+    }
+
+    return (length < size) ? 0 : -1;
+}
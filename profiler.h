@@ -0,0 +1,73 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#define PROFILE_HISTORY 240 // frames kept for averages and percentiles
+#define PROFILE_GPU_LATENCY 3 // frames until gpu timer queries are read back
+
+// phases of a frame, simulation includes forces, collisions, paths,
+// checkpoint and trajectory, frame includes everything on the cpu
+enum profile_phase {
+    PHASE_FRAME,
+    PHASE_SIMULATION,
+    PHASE_FORCES,
+    PHASE_COLLISIONS,
+    PHASE_PATHS,
+    PHASE_CHECKPOINT,
+    PHASE_TRAJECTORY, // copy into the staging of the writer, waits only if it falls behind
+    PHASE_INSTANCES,
+    PHASE_PATH_UPLOADS,
+    PHASE_PATH_DRAWS,
+    PHASE_SWAP,
+    PHASE_EXPORT, // readback of exported frames, waits only if the gpu or the writer falls behind
+    PHASE_GPU_INSTANCES,
+    PHASE_GPU_PATHS,
+    PHASE_GPU_FRAME,
+    PHASES_NUM,
+};
+
+struct profile_stats {
+    double mean; // seconds
+    double p50;
+    double p95;
+    double max;
+    int frames; // frames the phase was measured in
+};
+
+// every thread measures its own frames, the main thread its frames and the
+// physics thread its steps
+enum profiler_thread {
+    PROFILER_MAIN,
+    PROFILER_PHYSICS,
+    PROFILERS_NUM,
+};
+
+struct profiler {
+    const char *name;
+    int latency; // frames a record waits for late measurements
+
+    double current[PHASES_NUM]; // frame being measured, only touched by its thread
+    double started[PHASES_NUM]; // start of the running measurement of every phase
+    long frame; // number of the frame being measured
+
+    pthread_mutex_t lock; // guards the history, read by the overlay of another thread
+    double history[PROFILE_HISTORY][PHASES_NUM]; // seconds, negative if not measured
+};
+
+extern int profile_overlay;
+
+int profile_open(const char *path);
+void profile_close(void);
+void profile_thread(enum profiler_thread thread);
+const char *profile_phase_name(enum profile_phase phase);
+long profile_frame(void);
+void profile_begin(enum profile_phase phase);
+void profile_end(enum profile_phase phase);
+void profile_record(long frame, enum profile_phase phase, double seconds);
+void profile_end_frame(void);
+void profile_stats(enum profiler_thread thread, enum profile_phase phase, struct profile_stats *stats);
+int profile_report(char *text, long size);
+
+#endif
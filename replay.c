@@ -0,0 +1,433 @@
+#include "replay.h"
+
+#include "workers.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char *replay_path = NULL; // trajectory to play instead of simulating, NULL for none
+
+static struct replay replay = {
+    .mapping = MAP_FAILED,
+    .decoded = { -1, -1 },
+};
+
+struct decoding {
+    struct trajectory_frame frame;
+    const unsigned char *arrays;
+    struct physics_state *state;
+    atomic_int invalid; // ids out of order or out of range
+};
+
+// the ids, masses and scales follow the encoded arrays
+static long encoded_size(const struct trajectory_frame *frame) {
+    long value_size = (frame->encoding == TRAJECTORY_QUANTIZED) ? sizeof(uint16_t) : sizeof(float);
+    return frame->bodies_num * TRAJECTORY_ARRAYS * value_size;
+}
+
+// the frame headers are copied out, quantized arrays leave them unaligned
+static void read_frame_header(long frame, struct trajectory_frame *header) {
+    memcpy(header, (const unsigned char *) replay.mapping + replay.frames[frame], sizeof(*header));
+}
+
+// walks the frames once, a frame cut off by an interrupted recording ends
+// the index
+static int index_frames(const char *path) {
+    long offset = sizeof(struct trajectory_header);
+    long size = (long) replay.size;
+    long max = 0;
+
+    while (offset + (long) sizeof(struct trajectory_frame) <= size) {
+        struct trajectory_frame frame;
+        memcpy(&frame, (const unsigned char *) replay.mapping + offset, sizeof(frame));
+
+        long remaining = size - offset - (long) sizeof(frame);
+
+        if (memcmp(frame.magic, TRAJECTORY_FRAME_MAGIC, sizeof(frame.magic)) != 0 || frame.encoding > TRAJECTORY_QUANTIZED
+                || frame.bodies_num < 0 || frame.bodies_num > remaining
+                || frame.size != encoded_size(&frame) + frame.bodies_num * (long) TRAJECTORY_BODY_SIZE || frame.size > remaining) {
+            break;
+        }
+
+        if (replay.frames_num == max) {
+            max = (max == 0) ? 1024 : max * 2;
+            long *frames = (long *) reallocarray(replay.frames, max, sizeof(long));
+            if (frames == NULL) {
+                fprintf(stderr, "Error: failed allocating memory for the frame index\n");
+                return -1;
+            }
+
+            replay.frames = frames;
+        }
+
+        replay.frames[replay.frames_num++] = offset;
+        if (frame.bodies_num > replay.bodies_max) {
+            replay.bodies_max = frame.bodies_num;
+        }
+
+        // ids increase within a frame, the last one is the largest
+        if (frame.bodies_num > 0) {
+            int64_t last;
+            memcpy(&last, (const unsigned char *) replay.mapping + offset + sizeof(frame) + encoded_size(&frame)
+                    + (frame.bodies_num - 1) * sizeof(int64_t), sizeof(last));
+
+            if (last < 0 || last >= REPLAY_IDS_MAX) {
+                fprintf(stderr, "Error: body id %ld out of range in frame %ld of trajectory '%s'\n", (long) last, replay.frames_num - 1, path);
+                return -1;
+            }
+
+            if (last + 1 > replay.ids_num) {
+                replay.ids_num = last + 1;
+            }
+        }
+
+        offset += sizeof(frame) + frame.size;
+    }
+
+    if (offset != size) {
+        fprintf(stderr, "Warning: ignoring %ld bytes after frame %ld of trajectory '%s'\n",
+                size - offset, replay.frames_num, path);
+    }
+
+    return 0;
+}
+
+int replay_open(const char *path, float steps_per_second) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Error: cannot open trajectory '%s'\n", path);
+        return -1;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == -1 || info.st_size < (off_t) sizeof(struct trajectory_header)) {
+        fprintf(stderr, "Error: '%s' is not a trajectory\n", path);
+        close(fd);
+        return -1;
+    }
+
+    replay.size = info.st_size;
+    replay.mapping = mmap(NULL, replay.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (replay.mapping == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map trajectory '%s'\n", path);
+        return -1;
+    }
+
+    memcpy(&replay.header, replay.mapping, sizeof(replay.header));
+
+    if (memcmp(replay.header.magic, TRAJECTORY_MAGIC, sizeof(replay.header.magic)) != 0) {
+        fprintf(stderr, "Error: '%s' is not a trajectory\n", path);
+        goto error;
+    }
+
+    if (replay.header.version != TRAJECTORY_VERSION || replay.header.interval <= 0) {
+        fprintf(stderr, "Error: unsupported trajectory version %u in '%s'\n", replay.header.version, path);
+        goto error;
+    }
+
+    if (index_frames(path) == -1) {
+        goto error;
+    }
+
+    if (replay.frames_num == 0) {
+        fprintf(stderr, "Error: trajectory '%s' has no frames\n", path);
+        goto error;
+    }
+
+    struct trajectory_frame first, last;
+    read_frame_header(0, &first);
+    read_frame_header(replay.frames_num - 1, &last);
+
+    replay.rate = steps_per_second / replay.header.interval;
+    replay.speed = 1.0;
+    replay.playing = 1;
+    replay.states[0].step = -1;
+    replay.states[1].step = -1;
+
+    fprintf(stdout, "Status: replaying %ld frames of up to %ld bodies, steps %ld to %ld, from '%s'\n",
+            replay.frames_num, replay.bodies_max, (long) first.step, (long) last.step, path);
+    return 0;
+
+error:
+    munmap(replay.mapping, replay.size);
+    replay.mapping = MAP_FAILED;
+    return -1;
+}
+
+// one object per body id, attached in order so that their handles increase
+// with the id like the entries of a state. a body keeps its object across
+// merges, so the states are interpolated between the same bodies.
+int replay_attach(struct model *model) {
+    replay.objects = (struct object **) calloc(replay.ids_num, sizeof(struct object *));
+    if (replay.objects == NULL && replay.ids_num > 0) {
+        fprintf(stderr, "Error: failed allocating memory for the replayed objects\n");
+        return -1;
+    }
+
+    for (long id = 0; id < replay.ids_num; id++) {
+        replay.objects[id] = attach_object(id, model);
+        if (replay.objects[id] == NULL) {
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < 2; i++) {
+        replay.states[i].objects = (struct state_object *) calloc(replay.bodies_max, sizeof(struct state_object));
+        if (replay.states[i].objects == NULL && replay.bodies_max > 0) {
+            fprintf(stderr, "Error: failed allocating memory for the render state\n");
+            return -1;
+        }
+
+        replay.states[i].objects_max = replay.bodies_max;
+    }
+
+    return 0;
+}
+
+static void decode_task(void *arg, int thread, int threads) {
+    struct decoding *d = (struct decoding *) arg;
+    long num = d->frame.bodies_num;
+    long start = num * thread / threads;
+    long end = num * (thread + 1) / threads;
+
+    // unaligned after quantized arrays
+    const unsigned char *ids = d->arrays + encoded_size(&d->frame);
+    const unsigned char *scales = ids + num * (sizeof(int64_t) + sizeof(float));
+    int64_t previous = -1;
+
+    if (start > 0 && start < end) {
+        memcpy(&previous, ids + (start - 1) * sizeof(int64_t), sizeof(previous));
+    }
+
+    for (long i = start; i < end; i++) {
+        struct state_object *entry = &d->state->objects[i];
+        int64_t id;
+        memcpy(&id, ids + i * sizeof(int64_t), sizeof(id));
+
+        if (id <= previous || id >= replay.ids_num) {
+            atomic_store(&d->invalid, 1);
+            return;
+        }
+
+        previous = id;
+        struct object *obj = replay.objects[id];
+
+        entry->handle = obj->handle;
+        entry->object = obj;
+        memcpy(&entry->scale, scales + i * sizeof(float), sizeof(float));
+        entry->paths_num = 0;
+        entry->paths_head = 0;
+        entry->paths_recorded = 0;
+        entry->paths_clears = 0;
+        entry->paths_first = 0;
+        entry->paths_new = 0;
+    }
+
+    if (d->frame.encoding == TRAJECTORY_QUANTIZED) {
+        const uint16_t *quantized = (const uint16_t *) d->arrays;
+
+        for (int axis = 0; axis < 3; axis++) {
+            const uint16_t *values = quantized + axis * num;
+            float minimum = d->frame.minimum[axis];
+            float scale = d->frame.scale[axis];
+
+            for (long i = start; i < end; i++) {
+                d->state->objects[i].position[axis] = minimum + values[i] * scale;
+            }
+        }
+    } else {
+        const float *positions = (const float *) d->arrays;
+
+        for (int axis = 0; axis < 3; axis++) {
+            const float *values = positions + axis * num;
+
+            for (long i = start; i < end; i++) {
+                d->state->objects[i].position[axis] = values[i];
+            }
+        }
+    }
+}
+
+// hint the kernel to read a frame ahead of its turn
+static void prefetch_frame(long frame) {
+    if (frame < 0 || frame >= replay.frames_num) {
+        return;
+    }
+
+    struct trajectory_frame header;
+    read_frame_header(frame, &header);
+
+    long page = sysconf(_SC_PAGESIZE);
+    long start = replay.frames[frame] & ~(page - 1);
+    long end = replay.frames[frame] + sizeof(header) + header.size;
+    madvise((unsigned char *) replay.mapping + start, end - start, MADV_WILLNEED);
+}
+
+// the positions of the frame, the velocities are only recorded
+static int decode_frame(long frame, struct physics_state *state) {
+    struct decoding d = {
+        .arrays = (const unsigned char *) replay.mapping + replay.frames[frame] + sizeof(struct trajectory_frame),
+        .state = state,
+    };
+
+    read_frame_header(frame, &d.frame);
+
+    if (d.frame.bodies_num > state->objects_max) {
+        fprintf(stderr, "Error: frame %ld has more bodies than were attached\n", frame);
+        return -1;
+    }
+
+    workers_run(decode_task, &d);
+
+    if (atomic_load(&d.invalid) == 1) {
+        fprintf(stderr, "Error: frame %ld has invalid body ids\n", frame);
+        return -1;
+    }
+
+    state->objects_num = d.frame.bodies_num;
+    state->step = d.frame.step;
+
+    prefetch_frame(frame + ((replay.speed < 0.0) ? -1 : 1));
+    return 0;
+}
+
+// the state holding the frame, decoded into the one not holding keep
+static struct physics_state *decoded_state(long frame, long keep) {
+    for (int i = 0; i < 2; i++) {
+        if (replay.decoded[i] == frame) {
+            return &replay.states[i];
+        }
+    }
+
+    int i = (replay.decoded[0] == keep) ? 1 : 0;
+    replay.decoded[i] = -1;
+
+    if (decode_frame(frame, &replay.states[i]) == -1) {
+        return NULL;
+    }
+
+    replay.decoded[i] = frame;
+    return &replay.states[i];
+}
+
+static long current_step(void) {
+    struct trajectory_frame header;
+    read_frame_header((long) (replay.position + 0.5), &header);
+    return header.step;
+}
+
+// playback stops at either end of the recording
+static void advance(void) {
+    double now = physics_time();
+    double last = replay.frames_num - 1;
+
+    if (replay.playing == 1 && replay.clock > 0.0) {
+        replay.position += (now - replay.clock) * replay.rate * replay.speed;
+
+        if (replay.position >= last || replay.position <= 0.0) {
+            replay.position = (replay.position >= last) ? last : 0.0;
+            replay.playing = 0;
+            fprintf(stdout, "Status: replay stopped at step %ld\n", current_step());
+        }
+    }
+
+    replay.clock = now;
+}
+
+// the two frames around the playback position, drawn between like the
+// states of the physics. bodies are matched by their ids, one merged away
+// is drawn until the frame without it.
+int replay_take(struct physics_state **current, struct physics_state **previous, float *alpha) {
+    advance();
+
+    long lower = (long) replay.position;
+    long upper = (lower + 1 < replay.frames_num) ? lower + 1 : lower;
+
+    *previous = decoded_state(lower, upper);
+    *current = decoded_state(upper, lower);
+    *alpha = (float) (replay.position - lower);
+
+    return (*previous == NULL || *current == NULL) ? -1 : 0;
+}
+
+// a single frame, for exporting the recording frame by frame
+int replay_frame(long frame, struct physics_state **state) {
+    *state = decoded_state(frame, -1);
+    return (*state == NULL) ? -1 : 0;
+}
+
+long replay_frames(void) {
+    return replay.frames_num;
+}
+
+// continues from the start once it played to the end
+void replay_toggle(void) {
+    if (replay.playing == 0 && replay.speed > 0.0 && replay.position >= replay.frames_num - 1) {
+        replay.position = 0.0;
+    } else if (replay.playing == 0 && replay.speed < 0.0 && replay.position <= 0.0) {
+        replay.position = replay.frames_num - 1;
+    }
+
+    replay.playing = !replay.playing;
+    replay.clock = 0.0;
+    fprintf(stdout, "Status: replay %s at step %ld\n", (replay.playing == 1) ? "playing" : "paused", current_step());
+}
+
+void replay_scale_speed(double factor) {
+    double speed = fabs(replay.speed) * factor;
+    if (speed < REPLAY_SPEED_MIN) {
+        speed = REPLAY_SPEED_MIN;
+    } else if (speed > REPLAY_SPEED_MAX) {
+        speed = REPLAY_SPEED_MAX;
+    }
+
+    replay.speed = (replay.speed < 0.0) ? -speed : speed;
+    fprintf(stdout, "Status: replay speed %gx\n", replay.speed);
+}
+
+void replay_reverse(void) {
+    replay.speed = -replay.speed;
+    fprintf(stdout, "Status: replay speed %gx\n", replay.speed);
+}
+
+// any frame through the index, nothing before it is read
+void replay_seek(double position) {
+    double last = replay.frames_num - 1;
+    replay.position = (position < 0.0) ? 0.0 : (position > last) ? last : position;
+    fprintf(stdout, "Status: replay at frame %ld of %ld, step %ld\n",
+            (long) (replay.position + 0.5), replay.frames_num, current_step());
+}
+
+// pauses on a whole frame
+void replay_step(long frames) {
+    replay.playing = 0;
+    replay_seek((double) ((long) (replay.position + 0.5) + frames));
+}
+
+double replay_position(void) {
+    return replay.position;
+}
+
+void replay_close(void) {
+    if (replay.mapping != MAP_FAILED) {
+        munmap(replay.mapping, replay.size);
+        replay.mapping = MAP_FAILED;
+    }
+
+    free(replay.frames);
+    free(replay.objects);
+    free(replay.states[0].objects);
+    free(replay.states[1].objects);
+    replay.frames = NULL;
+    replay.objects = NULL;
+    replay.states[0].objects = NULL;
+    replay.states[1].objects = NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "object.h"
+#include "physics.h"
+#include "trajectory.h"
+#include <stddef.h>
+
+#define REPLAY_SPEED_MIN (1.0 / 64.0) // times the recorded rate
+#define REPLAY_SPEED_MAX 64.0
+#define REPLAY_IDS_MAX (1L << 32) // bodies ever created in a recorded run
+
+// a recorded trajectory mapped into memory, the frames are decoded straight
+// into the states the renderer draws instead of being stepped
+struct replay {
+    void *mapping;
+    size_t size;
+    struct trajectory_header header;
+
+    long *frames; // offset of every frame in the file, in order
+    long frames_num;
+    long bodies_max; // of any frame
+    long ids_num; // one past the largest body id of any frame
+
+    struct object **objects; // drawn for the bodies of a frame by id
+    struct physics_state states[2];
+    long decoded[2]; // frame held by each state, -1 for none
+
+    double position; // frame, the fraction is drawn between two frames
+    double rate; // frames per second at a speed of one
+    double speed; // negative plays backwards
+    int playing;
+    double clock; // monotonic seconds of the last advance
+};
+
+extern const char *replay_path; // trajectory to play instead of simulating, NULL for none
+
+int replay_open(const char *path, float steps_per_second);
+int replay_attach(struct model *model);
+int replay_take(struct physics_state **current, struct physics_state **previous, float *alpha);
+int replay_frame(long frame, struct physics_state **state);
+long replay_frames(void);
+void replay_toggle(void);
+void replay_scale_speed(double factor);
+void replay_reverse(void);
+void replay_seek(double position);
+void replay_step(long frames);
+double replay_position(void);
+void replay_close(void);
+
+#endif
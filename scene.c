@@ -0,0 +1,414 @@
+#include "scene.h"
+
+#include "body.h"
+#include "object.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// .grv scenes have one body per line:
+// mass,"model_filename",x_pos,y_pos,z_pos,x_boost,y_boost,z_boost
+// lines starting with '#' and empty lines are skipped
+
+struct scene_model {
+    char name[256];
+    struct model *model;
+};
+
+// consecutive bodies with the same model
+struct scene_run {
+    int model;
+    long first;
+    long num;
+};
+
+struct scene_loader {
+    const char *path;
+    long line;
+    int with_models;
+
+    struct scene_model *models; // every distinct model_filename, loaded once
+    int models_num;
+    int last_model;
+
+    struct scene_run *runs; // bodies waiting for their objects, in order
+    long runs_num;
+    long runs_max;
+};
+
+// the scene whose bodies get their objects in attach_scene_models
+static struct scene_loader pending;
+
+static struct scene_model *find_scene_model(struct scene_loader *loader, const char *name, int name_length) {
+    // consecutive bodies usually share their model
+    if (loader->models_num > 0) {
+        struct scene_model *last = &loader->models[loader->last_model];
+        if (strncmp(last->name, name, name_length) == 0 && last->name[name_length] == '\0') {
+            return last;
+        }
+    }
+
+    for (int i = 0; i < loader->models_num; i++) {
+        struct scene_model *known = &loader->models[i];
+        if (strncmp(known->name, name, name_length) == 0 && known->name[name_length] == '\0') {
+            loader->last_model = i;
+            return known;
+        }
+    }
+
+    return NULL;
+}
+
+// a model name seen for the first time, with the path of its file
+static struct scene_model *add_scene_model(struct scene_loader *loader, const char *name, int name_length, char *model_path, int model_path_size) {
+    if (name_length >= (int) sizeof(loader->models[0].name)) {
+        return NULL;
+    }
+
+    struct scene_model *new_models = (struct scene_model *) reallocarray(loader->models, loader->models_num+1, sizeof(struct scene_model));
+    if (new_models == NULL) {
+        return NULL;
+    }
+
+    loader->models = new_models;
+    struct scene_model *new_model = &loader->models[loader->models_num];
+    memcpy(new_model->name, name, name_length);
+    new_model->name[name_length] = '\0';
+    new_model->model = NULL;
+
+    snprintf(model_path, model_path_size, "%s%s", SCENE_MODELS_DIRECTORY, new_model->name);
+
+    loader->last_model = loader->models_num++;
+    return new_model;
+}
+
+// queue the model of a body for start_model_loads, its object is attached
+// once the model is loaded
+static int defer_scene_model(struct scene_loader *loader, long body, const char *name, int name_length) {
+    struct scene_model *model = find_scene_model(loader, name, name_length);
+
+    if (model == NULL) {
+        char model_path[sizeof(SCENE_MODELS_DIRECTORY) + sizeof(loader->models[0].name)];
+        model = add_scene_model(loader, name, name_length, model_path, sizeof(model_path));
+        if (model == NULL) {
+            fprintf(stderr, "Error: invalid model '%.*s' of '%s' line %ld\n", name_length, name, loader->path, loader->line);
+            return -1;
+        }
+
+        if (queue_model_load(model_path) != 0) {
+            return -1;
+        }
+    }
+
+    int index = model - loader->models;
+    struct scene_run *last = (loader->runs_num > 0) ? &loader->runs[loader->runs_num-1] : NULL;
+    if (last != NULL && last->model == index && last->first + last->num == body) {
+        last->num++;
+        return 0;
+    }
+
+    if (loader->runs_num == loader->runs_max) {
+        long runs_max = (loader->runs_max > 0) ? loader->runs_max * 2 : 64;
+        struct scene_run *runs = (struct scene_run *) reallocarray(loader->runs, runs_max, sizeof(struct scene_run));
+        if (runs == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for the models of scene '%s'\n", loader->path);
+            return -1;
+        }
+
+        loader->runs = runs;
+        loader->runs_max = runs_max;
+    }
+
+    loader->runs[loader->runs_num++] = (struct scene_run) { .model = index, .first = body, .num = 1 };
+    return 0;
+}
+
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// plain decimals like -12.5 or 1e6 without going through the locale aware
+// strtof, which dominates the load time of large scenes. anything else
+// (hex floats, inf, very long mantissas) is left to strtof.
+static char *parse_decimal(char *cursor, float *value) {
+    char *start = cursor;
+    int negative = 0;
+    unsigned long mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+
+    if (*cursor == '-' || *cursor == '+') {
+        negative = (*cursor == '-');
+        cursor++;
+    }
+
+    for (; *cursor >= '0' && *cursor <= '9'; cursor++, digits++) {
+        mantissa = mantissa*10 + (*cursor - '0');
+    }
+
+    if (*cursor == '.') {
+        cursor++;
+        for (; *cursor >= '0' && *cursor <= '9'; cursor++, digits++) {
+            mantissa = mantissa*10 + (*cursor - '0');
+            exponent--;
+        }
+    }
+
+    if (digits == 0 || digits > 19) {
+        return start;
+    }
+
+    if (*cursor == 'e' || *cursor == 'E') {
+        char *exponent_start = cursor++;
+        int exponent_negative = 0;
+        int exponent_value = 0;
+
+        if (*cursor == '-' || *cursor == '+') {
+            exponent_negative = (*cursor == '-');
+            cursor++;
+        }
+
+        if (*cursor < '0' || *cursor > '9') {
+            cursor = exponent_start;
+        }
+
+        for (; *cursor >= '0' && *cursor <= '9' && exponent_value < 1000; cursor++) {
+            exponent_value = exponent_value*10 + (*cursor - '0');
+        }
+
+        exponent += exponent_negative ? -exponent_value : exponent_value;
+    }
+
+    if (exponent < -22 || exponent > 22) {
+        return start;
+    }
+
+    double result = (double) mantissa;
+    result = (exponent < 0) ? result / powers_of_ten[-exponent] : result * powers_of_ten[exponent];
+    *value = (float) (negative ? -result : result);
+
+    return cursor;
+}
+
+static int parse_float(char **cursor, char *end, float *value) {
+    while (**cursor == ' ' || **cursor == '\t') {
+        (*cursor)++;
+    }
+
+    char *number_end = parse_decimal(*cursor, value);
+    if (number_end == *cursor) {
+        *value = strtof(*cursor, &number_end);
+    }
+
+    if (number_end == *cursor || number_end > end) {
+        return -1;
+    }
+
+    *cursor = number_end;
+    if (*cursor < end && **cursor == ',') {
+        (*cursor)++;
+    }
+
+    return 0;
+}
+
+static int parse_line(struct scene_loader *loader, char *line, char *end) {
+    while (line < end && (*line == ' ' || *line == '\t' || *line == '\r')) {
+        line++;
+    }
+
+    if (line == end || *line == '#') {
+        return 0;
+    }
+
+    // the line is terminated, strtof cannot run past it
+    *end = '\0';
+
+    float mass;
+    if (parse_float(&line, end, &mass) == -1) {
+        goto error;
+    }
+
+    // "model_filename",
+    if (*line != '"') {
+        goto error;
+    }
+
+    char *name = ++line;
+    while (line < end && *line != '"') {
+        line++;
+    }
+
+    if (line == end) {
+        goto error;
+    }
+
+    int name_length = line - name;
+    line++;
+    if (*line == ',') {
+        line++;
+    }
+
+    float values[6];
+    for (int i = 0; i < 6; i++) {
+        if (parse_float(&line, end, &values[i]) == -1) {
+            goto error;
+        }
+    }
+
+    long body = create_body(mass);
+    if (body == -1) {
+        return -1;
+    }
+
+    bodies.x[body] = values[0];
+    bodies.y[body] = values[1];
+    bodies.z[body] = values[2];
+    bodies.vx[body] = values[3];
+    bodies.vy[body] = values[4];
+    bodies.vz[body] = values[5];
+
+    if (loader->with_models == 0) {
+        return 0;
+    }
+
+    return defer_scene_model(loader, body, name, name_length);
+
+error:
+    fprintf(stderr, "Error: malformed body in '%s' line %ld\n", loader->path, loader->line);
+    return -1;
+}
+
+// read the file in fixed chunks and parse every complete line, so memory
+// use does not depend on the size of the scene
+static int read_scene(struct scene_loader *loader) {
+    const char *path = loader->path;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Cannot open scene '%s'\n", path);
+        return -1;
+    }
+
+    char *buffer = (char *) malloc(SCENE_CHUNK_SIZE + SCENE_LINE_MAX + 1);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: Cannot allocate memory for reading scene '%s'\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    long leftover = 0;
+    int result = 0;
+
+    for (;;) {
+        long read = fread(buffer + leftover, 1, SCENE_CHUNK_SIZE, fp);
+        long length = leftover + read;
+
+        if (read == 0 && leftover == 0) {
+            break;
+        }
+
+        // a last line without a newline
+        if (read == 0) {
+            buffer[length++] = '\n';
+        }
+
+        // body lines are hardly ever shorter than 32 bytes, reserving for
+        // the whole chunk keeps the body arrays from growing inside it
+        if (reserve_bodies(bodies.num + length / 32) == -1) {
+            result = -1;
+            break;
+        }
+
+        char *line = buffer;
+        char *end = buffer + length;
+        char *newline;
+
+        while ((newline = memchr(line, '\n', end - line)) != NULL) {
+            loader->line++;
+
+            if (parse_line(loader, line, newline) == -1) {
+                result = -1;
+                goto end;
+            }
+
+            line = newline + 1;
+        }
+
+        leftover = end - line;
+        if (leftover > SCENE_LINE_MAX) {
+            fprintf(stderr, "Error: line %ld of scene '%s' is too long\n", loader->line+1, path);
+            result = -1;
+            break;
+        }
+
+        memmove(buffer, line, leftover);
+    }
+
+end:
+    if (ferror(fp)) {
+        fprintf(stderr, "Error: failed reading scene '%s'\n", path);
+        result = -1;
+    }
+
+    free(buffer);
+    fclose(fp);
+    return result;
+}
+
+// with_models == 0 loads bodies only, for runs without rendering.
+// otherwise the models are queued for start_model_loads and the bodies get
+// their objects in attach_scene_models.
+int load_scene(const char *path, int with_models) {
+    struct scene_loader loader = { .path = path, .with_models = with_models };
+    long first_body = bodies.num;
+
+    int result = read_scene(&loader);
+    if (result == 0) {
+        fprintf(stdout, "Status: loaded %ld bodies and %d models from '%s'\n", bodies.num - first_body, loader.models_num, path);
+    }
+
+    if (result == 0 && with_models == 1) {
+        pending = loader;
+        return 0;
+    }
+
+    free(loader.models);
+    free(loader.runs);
+    return result;
+}
+
+// after wait_model_loads, objects are attached in the order of the scene
+int attach_scene_models(void) {
+    int result = 0;
+
+    for (long i = 0; i < pending.runs_num; i++) {
+        struct scene_run *run = &pending.runs[i];
+        struct scene_model *known = &pending.models[run->model];
+
+        if (known->model == NULL) {
+            char model_path[sizeof(SCENE_MODELS_DIRECTORY) + sizeof(known->name)];
+            snprintf(model_path, sizeof(model_path), "%s%s", SCENE_MODELS_DIRECTORY, known->name);
+
+            known->model = load_model(model_path);
+            if (known->model == NULL) {
+                fprintf(stderr, "Error: cannot load model '%s' of '%s'\n", known->name, pending.path);
+                result = -1;
+                goto end;
+            }
+        }
+
+        for (long body = run->first; body < run->first + run->num; body++) {
+            if (attach_object(body, known->model) == NULL) {
+                result = -1;
+                goto end;
+            }
+        }
+    }
+
+end:
+    free(pending.models);
+    free(pending.runs);
+    memset(&pending, 0, sizeof(pending));
+    return result;
+}
@@ -0,0 +1,12 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#define SCENE_CHUNK_SIZE (4 << 20)
+#define SCENE_LINE_MAX 4096
+#define SCENE_MODELS_DIRECTORY "assets/models/"
+
+// with_models == 0 loads bodies only, for runs without rendering
+int load_scene(const char *path, int with_models);
+int attach_scene_models(void);
+
+#endif
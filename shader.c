@@ -0,0 +1,294 @@
+#include "shader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <GL/glew.h>
+
+static char *read_source(const char *path, int *length) {
+    FILE *fp = fopen(path, "r");
+    char *ftext;
+
+    if (fp == NULL) {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", path);
+        return NULL;
+    }
+
+    fseek(fp, 0L, SEEK_END);
+    *length = ftell(fp);
+
+    if (*length == -1) {
+        fprintf(stderr, "Error: Cannot fetch length of file '%s'\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    fseek(fp, 0L, SEEK_SET);
+
+    ftext = (char *) malloc(*length);
+    if (ftext == NULL) {
+        fprintf(stderr, "Error: Cannot allocate enough memory for file's contents '%s'\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    *length = fread(ftext, sizeof(char), *length, fp);
+    fclose(fp);
+
+    return ftext;
+}
+
+// <vertex>+<fragment file name>.program, programs sharing either shader
+// keep caches of their own
+static char *cache_path(const char *vertex_path, const char *fragment_path) {
+    const char *fragment_name = strrchr(fragment_path, '/');
+    fragment_name = (fragment_name != NULL) ? fragment_name + 1 : fragment_path;
+
+    long size = strlen(vertex_path) + 1 + strlen(fragment_name) + sizeof(PROGRAM_CACHE_SUFFIX);
+    char *cache = (char *) malloc(size);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    snprintf(cache, size, "%s+%s%s", vertex_path, fragment_name, PROGRAM_CACHE_SUFFIX);
+    return cache;
+}
+
+static int compile_shader(const char *source, int length, unsigned int shader) {
+    glShaderSource(shader, 1, (const char **) &source, &length);
+    glCompileShader(shader);
+
+    int success;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+
+    if (success != GL_TRUE) {
+        int log_length;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_length);
+
+        char log[log_length];
+        glGetShaderInfoLog(shader, log_length, NULL, log);
+
+        fprintf(stderr, "Shader Compilation Error: %s\n", log);
+        return -1;
+    }
+
+    return 0;
+}
+
+// fnv-1a
+static uint64_t hash_bytes(uint64_t hash, const void *data, long length) {
+    const unsigned char *bytes = (const unsigned char *) data;
+
+    for (long i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3UL;
+    }
+
+    return hash;
+}
+
+static uint64_t program_key(const char *vertex_source, int vertex_length, const char *fragment_source, int fragment_length) {
+    GLenum driver_strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION, GL_SHADING_LANGUAGE_VERSION };
+    uint64_t hash = 0xcbf29ce484222325UL;
+
+    hash = hash_bytes(hash, &vertex_length, sizeof(vertex_length));
+    hash = hash_bytes(hash, vertex_source, vertex_length);
+    hash = hash_bytes(hash, &fragment_length, sizeof(fragment_length));
+    hash = hash_bytes(hash, fragment_source, fragment_length);
+
+    for (unsigned long i = 0; i < sizeof(driver_strings)/sizeof(driver_strings[0]); i++) {
+        const char *string = (const char *) glGetString(driver_strings[i]);
+        if (string != NULL) {
+            hash = hash_bytes(hash, string, strlen(string) + 1);
+        }
+    }
+
+    return hash;
+}
+
+static int program_binaries(void) {
+    if (!GLEW_ARB_get_program_binary) {
+        return 0;
+    }
+
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
+
+// fails when there is no cache, it is stale or the driver rejects it
+static int load_program_cache(const char *cache, uint64_t key, unsigned int program) {
+    FILE *fp = fopen(cache, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    struct program_header header;
+    void *binary = NULL;
+    int result = -1;
+
+    if (fread(&header, sizeof(header), 1, fp) != 1) {
+        goto end;
+    }
+
+    if (memcmp(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != PROGRAM_CACHE_VERSION
+            || header.key != key || header.length <= 0 || header.length > INT32_MAX) {
+        goto end;
+    }
+
+    binary = malloc(header.length);
+    if (binary == NULL || fread(binary, 1, header.length, fp) != (size_t) header.length) {
+        goto end;
+    }
+
+    glProgramBinary(program, header.format, binary, header.length);
+
+    int success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    result = (success == GL_TRUE) ? 0 : -1;
+
+end:
+    free(binary);
+    fclose(fp);
+    return result;
+}
+
+static int write_program_cache(const char *cache, uint64_t key, unsigned int program) {
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0) {
+        return -1;
+    }
+
+    void *binary = malloc(length);
+    if (binary == NULL) {
+        return -1;
+    }
+
+    struct program_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+    header.version = PROGRAM_CACHE_VERSION;
+    header.key = key;
+
+    GLenum format;
+    glGetProgramBinary(program, length, &length, &format, binary);
+    header.format = format;
+    header.length = length;
+
+    // write to a temporary file first, so a reader never sees half a cache
+    char temporary[strlen(cache) + sizeof(".tmp")];
+    strcpy(temporary, cache);
+    strcat(temporary, ".tmp");
+
+    FILE *fp = fopen(temporary, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Warning: cannot write program cache '%s'\n", cache);
+        free(binary);
+        return -1;
+    }
+
+    int failed = 0;
+    failed |= fwrite(&header, sizeof(header), 1, fp) != 1;
+    failed |= fwrite(binary, 1, length, fp) != (size_t) length;
+    failed |= fclose(fp) != 0;
+    free(binary);
+
+    if (failed || rename(temporary, cache) == -1) {
+        fprintf(stderr, "Warning: failed writing program cache '%s'\n", cache);
+        unlink(temporary);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int compile_program(const char *vertex_path, const char *vertex_source, int vertex_length,
+        const char *fragment_source, int fragment_length, unsigned int program) {
+    // create and load new shaders
+    unsigned int vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+    unsigned int fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    int result = -1;
+
+    if (compile_shader(vertex_source, vertex_length, vertex_shader) == -1) {
+        goto end;
+    }
+
+    if (compile_shader(fragment_source, fragment_length, fragment_shader) == -1) {
+        goto end;
+    }
+
+    // compile shader program
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+
+    int success;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+
+    if (success != GL_TRUE) {
+        int log_length;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_length);
+
+        char log[log_length];
+        glGetProgramInfoLog(program, log_length, NULL, log);
+
+        fprintf(stderr, "[%s] Shader Compilation Error: %s\n", vertex_path, log);
+        goto end;
+    }
+
+    result = 0;
+
+end:
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    return result;
+}
+
+// link a program from its sources, or take the binary the driver linked
+// from the same sources last time
+int load_program(const char *vertex_path, const char *fragment_path, unsigned int *program) {
+    int vertex_length, fragment_length;
+    char *vertex_source = read_source(vertex_path, &vertex_length);
+    char *fragment_source = read_source(fragment_path, &fragment_length);
+    char *cache = cache_path(vertex_path, fragment_path);
+    int cached = program_binaries() && cache != NULL;
+    int result = -1;
+
+    if (vertex_source == NULL || fragment_source == NULL) {
+        goto end;
+    }
+
+    uint64_t key = program_key(vertex_source, vertex_length, fragment_source, fragment_length);
+
+    glDeleteProgram(*program);
+    *program = glCreateProgram();
+
+    if (cached == 1 && load_program_cache(cache, key, *program) == 0) {
+        result = 0;
+        goto end;
+    }
+
+    // a rejected binary leaves the program unusable
+    if (cached == 1) {
+        glDeleteProgram(*program);
+        *program = glCreateProgram();
+        glProgramParameteri(*program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+
+    if (compile_program(vertex_path, vertex_source, vertex_length, fragment_source, fragment_length, *program) == -1) {
+        goto end;
+    }
+
+    if (cached == 1) {
+        write_program_cache(cache, key, *program);
+    }
+
+    result = 0;
+
+end:
+    free(vertex_source);
+    free(fragment_source);
+    free(cache);
+    return result;
+}
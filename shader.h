@@ -0,0 +1,24 @@
+#ifndef SHADER_H
+#define SHADER_H
+
+#include <stdint.h>
+
+#define PROGRAM_CACHE_MAGIC "GRVPROG"
+#define PROGRAM_CACHE_VERSION 1
+#define PROGRAM_CACHE_SUFFIX ".program"
+
+// linked program written next to its vertex shader and named after both
+// shaders, followed by the binary of the driver. the key hashes both sources and the driver strings, any
+// change of either is a stale cache.
+struct program_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t format; // binary format of the driver
+
+    uint64_t key;
+    int64_t length;
+};
+
+int load_program(const char *vertex_path, const char *fragment_path, unsigned int *program);
+
+#endif
@@ -0,0 +1,425 @@
+#include "simulation.h"
+
+#include "body.h"
+#include "collision.h"
+#include "domain.h"
+#include "math.h"
+#include "object.h"
+#include "octree.h"
+#include "pm.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "trajectory.h"
+#include "workers.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <cglm/cglm.h>
+
+long simulation_steps = 0; // steps since the start of the run
+enum force_solver force_solver = SOLVER_DIRECT;
+float barnes_hut_theta = OCTREE_DEFAULT_THETA;
+int particle_mesh_grid = PM_DEFAULT_GRID;
+enum integrator integrator = INTEGRATOR_EULER;
+float block_eta = BLOCK_DEFAULT_ETA;
+long force_evaluations = 0; // accelerations computed for single bodies
+
+static const char *force_solver_names[] = {
+    [SOLVER_DIRECT] = "direct",
+    [SOLVER_BARNES_HUT] = "barnes-hut",
+    [SOLVER_PARTICLE_MESH] = "pm",
+};
+
+static const char *integrator_names[] = {
+    [INTEGRATOR_EULER] = "euler",
+    [INTEGRATOR_LEAPFROG] = "leapfrog",
+    [INTEGRATOR_BLOCK] = "block",
+};
+
+int select_integrator(const char *name) {
+    for (unsigned long i = 0; i < sizeof(integrator_names)/sizeof(integrator_names[0]); i++) {
+        if (strcmp(integrator_names[i], name) == 0) {
+            integrator = i;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Error: unknown integrator '%s'\n", name);
+    return -1;
+}
+
+const char *integrator_name(void) {
+    return integrator_names[integrator];
+}
+
+int select_force_solver(const char *name) {
+    for (unsigned long i = 0; i < sizeof(force_solver_names)/sizeof(force_solver_names[0]); i++) {
+        if (strcmp(force_solver_names[i], name) == 0) {
+            force_solver = i;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Error: unknown force solver '%s'\n", name);
+    return -1;
+}
+
+// the solver after the current one, wrapping around
+void next_force_solver(void) {
+    force_solver = (force_solver + 1) % (sizeof(force_solver_names)/sizeof(force_solver_names[0]));
+}
+
+const char *force_solver_name(void) {
+    return force_solver_names[force_solver];
+}
+
+static int calculate_forces(void) {
+    int result;
+    profile_begin(PHASE_FORCES);
+
+    switch (force_solver) {
+        case SOLVER_BARNES_HUT:
+            result = octree_accelerations(&bodies, barnes_hut_theta);
+            break;
+        case SOLVER_PARTICLE_MESH:
+            result = pm_accelerations(&bodies, particle_mesh_grid);
+            break;
+        case SOLVER_DIRECT:
+        default:
+            result = calculate_accelerations(&bodies);
+            break;
+    }
+
+    profile_end(PHASE_FORCES);
+    return result;
+}
+
+static int calculate_forces_of(const long *list, long num) {
+    force_evaluations += num;
+
+    // everybody is due, the full solvers are faster
+    if (num == bodies.num) {
+        return calculate_forces();
+    }
+
+    int result;
+    profile_begin(PHASE_FORCES);
+
+    switch (force_solver) {
+        case SOLVER_BARNES_HUT:
+            result = octree_accelerations_of(&bodies, barnes_hut_theta, list, num);
+            break;
+        case SOLVER_PARTICLE_MESH:
+            result = pm_accelerations_of(&bodies, particle_mesh_grid, list, num);
+            break;
+        case SOLVER_DIRECT:
+        default:
+            result = calculate_accelerations_of(&bodies, list, num);
+            break;
+    }
+
+    profile_end(PHASE_FORCES);
+    return result;
+}
+
+static void kick(long i, float dt) {
+    bodies.vx[i] += bodies.ax[i] * dt;
+    bodies.vy[i] += bodies.ay[i] * dt;
+    bodies.vz[i] += bodies.az[i] * dt;
+}
+
+static void drift(float dt) {
+    for (long i = 0; i < bodies.num; i++) {
+        bodies.x[i] += bodies.vx[i] * dt;
+        bodies.y[i] += bodies.vy[i] * dt;
+        bodies.z[i] += bodies.vz[i] * dt;
+    }
+}
+
+// the leapfrog integrators start a step from the accelerations of the end
+// of the previous one, they are only recomputed when bodies were added
+static long accelerations_num = -1;
+
+static int update_accelerations(void) {
+    if (accelerations_num == bodies.num) {
+        return 0;
+    }
+
+    force_evaluations += bodies.num;
+    if (calculate_forces() == -1) {
+        return -1;
+    }
+
+    accelerations_num = bodies.num;
+    return 0;
+}
+
+static int step_euler(float dt) {
+    force_evaluations += bodies.num;
+    if (calculate_forces() == -1) {
+        return -1;
+    }
+
+    for (long i = 0; i < bodies.num; i++) {
+        kick(i, dt);
+    }
+
+    drift(dt);
+    accelerations_num = -1;
+
+    return 0;
+}
+
+// kick-drift-kick
+static int step_leapfrog(float dt) {
+    if (update_accelerations() == -1) {
+        return -1;
+    }
+
+    for (long i = 0; i < bodies.num; i++) {
+        kick(i, dt / 2.0f);
+    }
+
+    drift(dt);
+
+    force_evaluations += bodies.num;
+    if (calculate_forces() == -1) {
+        return -1;
+    }
+
+    for (long i = 0; i < bodies.num; i++) {
+        kick(i, dt / 2.0f);
+    }
+
+    return 0;
+}
+
+static unsigned char *levels; // block level of every body, its step is dt/2^level
+static long *active; // bodies finishing their step in the current substep
+static long block_max;
+
+// pick the level of every body from the time it takes its acceleration
+// to change its velocity by a fraction eta. bodies close to rest would
+// always end up on the finest level, so their velocity is taken to be at
+// least a fraction of the rms velocity of all bodies.
+static int assign_levels(float dt) {
+    double velocity_sum = 0.0;
+    for (long i = 0; i < bodies.num; i++) {
+        velocity_sum += bodies.vx[i]*bodies.vx[i] + bodies.vy[i]*bodies.vy[i] + bodies.vz[i]*bodies.vz[i];
+    }
+
+    float velocity_floor = BLOCK_VELOCITY_FLOOR * sqrt(velocity_sum / (double) bodies.num);
+    int max_level = 0;
+
+    for (long i = 0; i < bodies.num; i++) {
+        float acceleration = sqrtf(bodies.ax[i]*bodies.ax[i] + bodies.ay[i]*bodies.ay[i] + bodies.az[i]*bodies.az[i]);
+        float velocity = sqrtf(bodies.vx[i]*bodies.vx[i] + bodies.vy[i]*bodies.vy[i] + bodies.vz[i]*bodies.vz[i]);
+        int level = 0;
+
+        if (acceleration > 0.0f) {
+            float timestep = block_eta * fmaxf(velocity, velocity_floor) / acceleration;
+
+            while (level < BLOCK_MAX_LEVEL && dt / (float) (1 << level) > timestep) {
+                level++;
+            }
+        }
+
+        levels[i] = level;
+        if (level > max_level) {
+            max_level = level;
+        }
+    }
+
+    return max_level;
+}
+
+// hierarchical block timesteps: positions of all bodies are drifted every
+// substep, but only the bodies at the end of their own step get new forces
+static int step_block(float dt) {
+    if (update_accelerations() == -1) {
+        return -1;
+    }
+
+    if (bodies.num > block_max) {
+        unsigned char *new_levels = (unsigned char *) realloc(levels, bodies.num);
+        if (new_levels != NULL) {
+            levels = new_levels;
+        }
+
+        long *new_active = (long *) reallocarray(active, bodies.num, sizeof(long));
+        if (new_active != NULL) {
+            active = new_active;
+        }
+
+        if (new_levels == NULL || new_active == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for block timesteps\n");
+            return -1;
+        }
+
+        block_max = bodies.num;
+    }
+
+    int max_level = assign_levels(dt);
+    long substeps = 1L << max_level;
+    float substep_dt = dt / (float) substeps;
+
+    for (long substep = 0; substep < substeps; substep++) {
+        for (long i = 0; i < bodies.num; i++) {
+            long period = 1L << (max_level - levels[i]);
+            if (substep % period == 0) {
+                kick(i, substep_dt * period / 2.0f);
+            }
+        }
+
+        drift(substep_dt);
+
+        long active_num = 0;
+        for (long i = 0; i < bodies.num; i++) {
+            long period = 1L << (max_level - levels[i]);
+            if ((substep+1) % period == 0) {
+                active[active_num++] = i;
+            }
+        }
+
+        if (calculate_forces_of(active, active_num) == -1) {
+            return -1;
+        }
+
+        for (long k = 0; k < active_num; k++) {
+            long i = active[k];
+            long period = 1L << (max_level - levels[i]);
+            kick(i, substep_dt * period / 2.0f);
+        }
+    }
+
+    return 0;
+}
+
+static int advance(float dt, int tracing) {
+    int result;
+
+    // split across processes, the domains integrate their own bodies
+    if (domain_processes > 1) {
+        result = domain_step(dt);
+    } else {
+        switch (integrator) {
+            case INTEGRATOR_LEAPFROG:
+                result = step_leapfrog(dt);
+                break;
+            case INTEGRATOR_BLOCK:
+                result = step_block(dt);
+                break;
+            case INTEGRATOR_EULER:
+            default:
+                result = step_euler(dt);
+                break;
+        }
+    }
+
+    if (result == -1) {
+        return -1;
+    }
+
+    if (collisions_enabled == 1) {
+        profile_begin(PHASE_COLLISIONS);
+        int removed = resolve_collisions();
+        profile_end(PHASE_COLLISIONS);
+
+        if (removed == -1) {
+            return -1;
+        }
+
+        // merged bodies moved, gained mass or are gone
+        if (removed > 0) {
+            accelerations_num = -1;
+            domain_invalidate();
+        }
+    }
+
+    // record path
+    if (tracing == 1) {
+        profile_begin(PHASE_PATHS);
+
+        for (struct object *obj = first_object(); obj != NULL; obj = next_object(obj)) {
+            if (record_path(obj) == -1) {
+                return -1;
+            }
+        }
+
+        profile_end(PHASE_PATHS);
+    }
+
+    simulation_steps++;
+
+    profile_begin(PHASE_CHECKPOINT);
+    result = checkpoint(simulation_steps);
+    profile_end(PHASE_CHECKPOINT);
+
+    if (result != 0) {
+        return result;
+    }
+
+    profile_begin(PHASE_TRAJECTORY);
+    result = record_trajectory(simulation_steps);
+    profile_end(PHASE_TRAJECTORY);
+
+    return result;
+}
+
+int simulate_step(float dt, int tracing) {
+    profile_begin(PHASE_SIMULATION);
+    int result = advance(dt, tracing);
+    profile_end(PHASE_SIMULATION);
+
+    return result;
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end) {
+    return (double) (end->tv_sec - start->tv_sec) + (double) (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+// observe is called after every step, if given
+int run_headless(long steps, float dt, int (*observe)(long step)) {
+    fprintf(stdout, "Status: running %ld steps headless (dt=%f, bodies=%ld, integrator=%s, solver=%s, kernel=%s, threads=%d)\n", steps, dt, bodies.num, integrator_name(), force_solver_name(), gravity_kernel_name(), workers_num());
+    long first_evaluations = force_evaluations;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long step = 0; step < steps; step++) {
+        profile_begin(PHASE_FRAME);
+
+        if (simulate_step(dt, 0) == -1) {
+            fprintf(stderr, "Error: simulation step %ld failed\n", step);
+            return -1;
+        }
+
+        if (observe != NULL && observe(step) != 0) {
+            return -1;
+        }
+
+        free_retired_objects();
+
+        profile_end(PHASE_FRAME);
+        profile_end_frame();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    wait_snapshot();
+
+    double seconds = elapsed_seconds(&start, &end);
+    double rate = (seconds > 0.0) ? (double) steps / seconds : 0.0;
+    fprintf(stdout, "Status: %ld steps in %.3f s (%.1f steps/sec)\n", steps, seconds, rate);
+
+    if (bodies.num > 0) {
+        double evaluations = (double) (force_evaluations - first_evaluations) / (double) (steps * bodies.num);
+        fprintf(stdout, "Status: %.3f force evaluations per body and step\n", evaluations);
+    }
+
+    if (collisions_enabled == 1) {
+        fprintf(stdout, "Status: %ld bodies merged, %ld left\n", collisions_merged, bodies.num);
+    }
+
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include "object.h"
+
+#define DEFAULT_TIMESTEP 1.0f
+
+enum force_solver {
+    SOLVER_DIRECT, // all pairs, exact
+    SOLVER_BARNES_HUT, // octree, O(N log N)
+    SOLVER_PARTICLE_MESH, // fft on a grid, O(N + G^3 log G)
+};
+
+#define BLOCK_DEFAULT_ETA 0.02f
+#define BLOCK_MAX_LEVEL 10
+#define BLOCK_VELOCITY_FLOOR 0.1f // fraction of the rms velocity
+
+enum integrator {
+    INTEGRATOR_EULER, // first order, a kick and a drift per step
+    INTEGRATOR_LEAPFROG, // kick-drift-kick, symplectic
+    INTEGRATOR_BLOCK, // leapfrog with power of two substeps per body
+};
+
+extern long simulation_steps;
+extern long force_evaluations;
+extern enum integrator integrator;
+extern float block_eta;
+extern enum force_solver force_solver;
+extern float barnes_hut_theta;
+extern int particle_mesh_grid;
+
+int select_integrator(const char *name);
+const char *integrator_name(void);
+int select_force_solver(const char *name);
+void next_force_solver(void);
+const char *force_solver_name(void);
+int simulate_step(float dt, int tracing);
+int run_headless(long steps, float dt, int (*observe)(long step));
+
+#endif
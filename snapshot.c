@@ -0,0 +1,356 @@
+#include "snapshot.h"
+
+#include "body.h"
+#include "object.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const char *checkpoint_path = NULL; // periodic snapshots are written here
+long checkpoint_interval = 0; // steps between snapshots, 0 disables them
+
+struct snapshot_job {
+    char path[SNAPSHOT_PATH_MAX];
+    char *data;
+    size_t size;
+};
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_done = PTHREAD_COND_INITIALIZER;
+static int snapshot_writing = 0;
+
+static int model_index(struct model *model) {
+    int index = 0;
+    for (struct model *current = models; current != NULL; current = current->next, index++) {
+        if (current == model) {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+static void *write_snapshot(void *arg) {
+    struct snapshot_job *job = (struct snapshot_job *) arg;
+
+    char temporary[SNAPSHOT_PATH_MAX + sizeof(".tmp")];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", job->path);
+
+    // write next to the target and rename, an interrupted write never
+    // replaces the previous snapshot
+    FILE *fp = fopen(temporary, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error: cannot open snapshot '%s'\n", temporary);
+        goto end;
+    }
+
+    int failed = fwrite(job->data, 1, job->size, fp) != job->size;
+    failed |= fclose(fp) != 0;
+
+    if (failed || rename(temporary, job->path) == -1) {
+        fprintf(stderr, "Error: failed writing snapshot '%s'\n", job->path);
+        unlink(temporary);
+        goto end;
+    }
+
+    fprintf(stdout, "Status: wrote snapshot '%s'\n", job->path);
+
+end:
+    free(job->data);
+    free(job);
+
+    pthread_mutex_lock(&snapshot_lock);
+    snapshot_writing = 0;
+    pthread_cond_broadcast(&snapshot_done);
+    pthread_mutex_unlock(&snapshot_lock);
+
+    return NULL;
+}
+
+// copy the whole state into one buffer and write it from a background
+// thread, the caller only pays for the copy
+int save_snapshot(const char *path, long step) {
+    if (strlen(path) >= SNAPSHOT_PATH_MAX) {
+        fprintf(stderr, "Error: snapshot path '%s' is too long\n", path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    if (snapshot_writing == 1) {
+        pthread_mutex_unlock(&snapshot_lock);
+        fprintf(stderr, "Warning: skipping snapshot, the previous one is still being written\n");
+        return 0;
+    }
+    snapshot_writing = 1;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.step = step;
+    header.bodies_num = bodies.num;
+
+    for (struct model *model = models; model != NULL; model = model->next) {
+        header.models_num++;
+    }
+
+    for (struct object *obj = first_object(); obj != NULL; obj = next_object(obj)) {
+        header.objects_num++;
+        header.paths_num += obj->paths_num;
+    }
+
+    size_t size = sizeof(header)
+        + header.objects_num * sizeof(struct snapshot_object)
+        + header.models_num * SNAPSHOT_PATH_MAX
+        + (header.bodies_num * 7 + header.paths_num * 3) * sizeof(float);
+
+    struct snapshot_job *job = (struct snapshot_job *) calloc(1, sizeof(struct snapshot_job));
+    char *data = (char *) calloc(1, size);
+    if (job == NULL || data == NULL) {
+        fprintf(stderr, "Error: failed allocating memory for a snapshot\n");
+        free(job);
+        free(data);
+        goto error;
+    }
+
+    strcpy(job->path, path);
+    job->data = data;
+    job->size = size;
+
+    char *cursor = data;
+    memcpy(cursor, &header, sizeof(header));
+    cursor += sizeof(header);
+
+    struct snapshot_object *snapshot_objects = (struct snapshot_object *) cursor;
+    cursor += header.objects_num * sizeof(struct snapshot_object);
+
+    for (struct model *model = models; model != NULL; model = model->next) {
+        strncpy(cursor, model->path, SNAPSHOT_PATH_MAX-1);
+        cursor += SNAPSHOT_PATH_MAX;
+    }
+
+    float *arrays[] = { bodies.x, bodies.y, bodies.z, bodies.vx, bodies.vy, bodies.vz, bodies.mass };
+    for (int i = 0; i < 7; i++) {
+        memcpy(cursor, arrays[i], bodies.num * sizeof(float));
+        cursor += bodies.num * sizeof(float);
+    }
+
+    // trails are unrolled from their ring buffers, oldest position first
+    long index = 0;
+    for (struct object *obj = first_object(); obj != NULL; obj = next_object(obj), index++) {
+        struct snapshot_object *snapshot_object = &snapshot_objects[index];
+        snapshot_object->body = obj->body;
+        snapshot_object->model = (obj->model != NULL) ? model_index(obj->model) : -1;
+        snapshot_object->paths_num = obj->paths_num;
+        snapshot_object->scale = obj->scale;
+        memcpy(snapshot_object->color, obj->color, 3*sizeof(float));
+
+        int oldest = (obj->paths_num < obj->paths_max) ? 0 : obj->paths_head;
+        int first_part = obj->paths_num - oldest;
+        memcpy(cursor, obj->paths + oldest*3, first_part*3*sizeof(float));
+        memcpy(cursor + first_part*3*sizeof(float), obj->paths, oldest*3*sizeof(float));
+        cursor += obj->paths_num*3*sizeof(float);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, write_snapshot, job) != 0) {
+        fprintf(stderr, "Error: failed starting snapshot writer\n");
+        free(job->data);
+        free(job);
+        goto error;
+    }
+
+    pthread_detach(thread);
+    return 0;
+
+error:
+    pthread_mutex_lock(&snapshot_lock);
+    snapshot_writing = 0;
+    pthread_mutex_unlock(&snapshot_lock);
+    return -1;
+}
+
+// block until a snapshot that is being written is on disk
+void wait_snapshot(void) {
+    pthread_mutex_lock(&snapshot_lock);
+    while (snapshot_writing == 1) {
+        pthread_cond_wait(&snapshot_done, &snapshot_lock);
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+}
+
+// periodic snapshot, called after every step
+int checkpoint(long step) {
+    if (checkpoint_path == NULL || checkpoint_interval <= 0 || step % checkpoint_interval != 0) {
+        return 0;
+    }
+
+    return save_snapshot(checkpoint_path, step);
+}
+
+static int restore_trail(struct object *obj, float *positions, int positions_num) {
+    if (positions_num == 0) {
+        return 0;
+    }
+
+    // a reused slot still has its buffer
+    if (obj->paths == NULL) {
+        obj->paths = (float *) calloc(obj->paths_max*3, sizeof(float));
+    }
+
+    if (obj->paths == NULL) {
+        fprintf(stderr, "Error: failed allocating memory for paths of object\n");
+        return -1;
+    }
+
+    if (positions_num > obj->paths_max) {
+        positions += (positions_num - obj->paths_max)*3;
+        positions_num = obj->paths_max;
+    }
+
+    memcpy(obj->paths, positions, positions_num*3*sizeof(float));
+    obj->paths_num = positions_num;
+    obj->paths_head = positions_num % obj->paths_max;
+    obj->paths_recorded = positions_num;
+
+    return 0;
+}
+
+// restore a snapshot after the bodies that already exist. without models
+// only the bodies are restored, with models the bodies of a snapshot
+// without objects get the default model.
+int load_snapshot(const char *path, int with_models, struct model *default_model, long *step) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Cannot open snapshot '%s'\n", path);
+        return -1;
+    }
+
+    struct stat snapshot_stat;
+    if (fstat(fd, &snapshot_stat) == -1 || snapshot_stat.st_size < (off_t) sizeof(struct snapshot_header)) {
+        fprintf(stderr, "Error: '%s' is not a snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+
+    char *mapping = (char *) mmap(NULL, snapshot_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map snapshot '%s'\n", path);
+        return -1;
+    }
+
+    int result = -1;
+    struct snapshot_header *header = (struct snapshot_header *) mapping;
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "Error: '%s' is not a snapshot\n", path);
+        goto end;
+    }
+
+    if (header->version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "Error: snapshot '%s' has unsupported version %u\n", path, header->version);
+        goto end;
+    }
+
+    size_t size = sizeof(*header)
+        + header->objects_num * sizeof(struct snapshot_object)
+        + header->models_num * SNAPSHOT_PATH_MAX
+        + (header->bodies_num * 7 + header->paths_num * 3) * sizeof(float);
+
+    if (header->bodies_num < 0 || header->objects_num < 0 || header->models_num < 0 || header->paths_num < 0 || (off_t) size != snapshot_stat.st_size) {
+        fprintf(stderr, "Error: snapshot '%s' is truncated or corrupt\n", path);
+        goto end;
+    }
+
+    char *cursor = mapping + sizeof(*header);
+    struct snapshot_object *snapshot_objects = (struct snapshot_object *) cursor;
+    cursor += header->objects_num * sizeof(struct snapshot_object);
+
+    char *model_paths = cursor;
+    cursor += header->models_num * SNAPSHOT_PATH_MAX;
+
+    long first_body = bodies.num;
+    if (reserve_bodies(first_body + header->bodies_num) == -1) {
+        goto end;
+    }
+
+    float *arrays[] = { bodies.x, bodies.y, bodies.z, bodies.vx, bodies.vy, bodies.vz, bodies.mass };
+    for (int i = 0; i < 7; i++) {
+        memcpy(arrays[i] + first_body, cursor, header->bodies_num * sizeof(float));
+        cursor += header->bodies_num * sizeof(float);
+    }
+
+    memset(bodies.ax + first_body, 0, header->bodies_num * sizeof(float));
+    memset(bodies.ay + first_body, 0, header->bodies_num * sizeof(float));
+    memset(bodies.az + first_body, 0, header->bodies_num * sizeof(float));
+    bodies.num = first_body + header->bodies_num;
+    number_bodies(first_body);
+
+    if (with_models == 1 && header->objects_num == 0) {
+        for (long body = first_body; body < bodies.num; body++) {
+            if (attach_object(body, default_model) == NULL) {
+                goto end;
+            }
+        }
+    }
+
+    float *trails = (float *) cursor;
+    long trails_offset = 0;
+
+    // objects were written in pool order, attaching in order keeps it
+    for (long i = 0; with_models == 1 && i < header->objects_num; i++) {
+        struct snapshot_object *snapshot_object = &snapshot_objects[i];
+        struct model *model = default_model;
+
+        if (snapshot_object->body < 0 || snapshot_object->body >= header->bodies_num || snapshot_object->paths_num < 0
+                || trails_offset + snapshot_object->paths_num > header->paths_num) {
+            fprintf(stderr, "Error: snapshot '%s' is truncated or corrupt\n", path);
+            goto end;
+        }
+
+        if (snapshot_object->model >= 0 && snapshot_object->model < header->models_num) {
+            char model_path[SNAPSHOT_PATH_MAX];
+            memcpy(model_path, model_paths + snapshot_object->model * SNAPSHOT_PATH_MAX, SNAPSHOT_PATH_MAX);
+            model_path[SNAPSHOT_PATH_MAX-1] = '\0';
+
+            model = load_model(model_path);
+            if (model == NULL) {
+                goto end;
+            }
+        }
+
+        struct object *obj = attach_object(first_body + snapshot_object->body, model);
+        if (obj == NULL) {
+            goto end;
+        }
+
+        obj->scale = snapshot_object->scale;
+        memcpy(obj->color, snapshot_object->color, 3*sizeof(float));
+
+        // trails are stored in object order
+        if (restore_trail(obj, trails + trails_offset*3, snapshot_object->paths_num) == -1) {
+            goto end;
+        }
+
+        trails_offset += snapshot_object->paths_num;
+    }
+
+    if (step != NULL) {
+        *step = header->step;
+    }
+
+    fprintf(stdout, "Status: restored %ld bodies at step %ld from '%s'\n", (long) header->bodies_num, (long) header->step, path);
+    result = 0;
+
+end:
+    munmap(mapping, snapshot_stat.st_size);
+    return result;
+}
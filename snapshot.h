@@ -0,0 +1,41 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "object.h"
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC "GRVSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PATH_MAX 256
+
+// a snapshot is the header followed by the objects, the model table, the
+// body arrays (x, y, z, vx, vy, vz, mass) and the trails of all objects
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+
+    int64_t step;
+    int64_t bodies_num;
+    int64_t objects_num;
+    int64_t models_num; // paths of SNAPSHOT_PATH_MAX bytes
+    int64_t paths_num; // trail positions of all objects
+};
+
+struct snapshot_object {
+    int64_t body;
+    int32_t model; // index into the model table, -1 without model
+    int32_t paths_num; // trail positions, oldest first
+    float scale;
+    float color[3];
+};
+
+extern const char *checkpoint_path;
+extern long checkpoint_interval;
+
+int save_snapshot(const char *path, long step);
+void wait_snapshot(void);
+int checkpoint(long step);
+int load_snapshot(const char *path, int with_models, struct model *default_model, long *step);
+
+#endif
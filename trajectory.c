@@ -0,0 +1,296 @@
+#include "trajectory.h"
+
+#include "body.h"
+#include "object.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+const char *trajectory_path = NULL; // frames are streamed to this file, NULL for none
+long trajectory_interval = 1; // steps between frames
+enum trajectory_encoding trajectory_encoding = TRAJECTORY_FLOAT;
+
+static struct trajectory trajectory = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .filled = PTHREAD_COND_INITIALIZER,
+    .emptied = PTHREAD_COND_INITIALIZER,
+};
+
+int select_trajectory_encoding(const char *name) {
+    if (strcmp(name, "float") == 0) {
+        trajectory_encoding = TRAJECTORY_FLOAT;
+    } else if (strcmp(name, "quantized") == 0) {
+        trajectory_encoding = TRAJECTORY_QUANTIZED;
+    } else {
+        fprintf(stderr, "Error: unknown trajectory format '%s', expected float or quantized\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double) time.tv_sec + (double) time.tv_nsec * 1e-9;
+}
+
+// every array over its own range, so that positions and velocities keep
+// the same relative precision
+static int quantize_frame(struct trajectory_buffer *buffer, struct trajectory_frame *frame) {
+    long num = buffer->bodies_num;
+
+    if (num * TRAJECTORY_ARRAYS > trajectory.quantized_max) {
+        uint16_t *quantized = (uint16_t *) reallocarray(trajectory.quantized, num * TRAJECTORY_ARRAYS, sizeof(uint16_t));
+        if (quantized == NULL) {
+            return -1;
+        }
+
+        trajectory.quantized = quantized;
+        trajectory.quantized_max = num * TRAJECTORY_ARRAYS;
+    }
+
+    for (int array = 0; array < TRAJECTORY_ARRAYS; array++) {
+        float *values = buffer->arrays + array * buffer->max;
+        uint16_t *quantized = trajectory.quantized + array * num;
+        float minimum = (num > 0) ? values[0] : 0.0f;
+        float maximum = minimum;
+
+        for (long i = 1; i < num; i++) {
+            minimum = fminf(minimum, values[i]);
+            maximum = fmaxf(maximum, values[i]);
+        }
+
+        float scale = (maximum - minimum) / TRAJECTORY_QUANTIZED_MAX;
+        float inverse = (scale > 0.0f) ? 1.0f / scale : 0.0f;
+
+        for (long i = 0; i < num; i++) {
+            quantized[i] = (uint16_t) lrintf(fminf((values[i] - minimum) * inverse, TRAJECTORY_QUANTIZED_MAX));
+        }
+
+        frame->minimum[array] = minimum;
+        frame->scale[array] = scale;
+    }
+
+    frame->size = num * (TRAJECTORY_ARRAYS * sizeof(uint16_t) + TRAJECTORY_BODY_SIZE);
+    return 0;
+}
+
+static int write_frame(struct trajectory_buffer *buffer) {
+    struct trajectory_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    memcpy(frame.magic, TRAJECTORY_FRAME_MAGIC, sizeof(frame.magic));
+    frame.encoding = trajectory_encoding;
+    frame.step = buffer->step;
+    frame.bodies_num = buffer->bodies_num;
+    frame.size = buffer->bodies_num * (TRAJECTORY_ARRAYS * sizeof(float) + TRAJECTORY_BODY_SIZE);
+
+    if (trajectory_encoding == TRAJECTORY_QUANTIZED && quantize_frame(buffer, &frame) == -1) {
+        fprintf(stderr, "Error: failed allocating memory for trajectory encoding\n");
+        return -1;
+    }
+
+    int failed = fwrite(&frame, sizeof(frame), 1, trajectory.fp) != 1;
+
+    size_t num = buffer->bodies_num;
+    if (trajectory_encoding == TRAJECTORY_QUANTIZED) {
+        failed |= fwrite(trajectory.quantized, sizeof(uint16_t), num * TRAJECTORY_ARRAYS, trajectory.fp) != num * TRAJECTORY_ARRAYS;
+    } else {
+        for (int array = 0; array < TRAJECTORY_ARRAYS; array++) {
+            float *values = buffer->arrays + array * buffer->max;
+            failed |= fwrite(values, sizeof(float), num, trajectory.fp) != num;
+        }
+    }
+
+    failed |= fwrite(buffer->ids, sizeof(int64_t), num, trajectory.fp) != num;
+    for (int array = TRAJECTORY_ARRAYS; array < TRAJECTORY_ARRAYS + TRAJECTORY_FLOAT_ARRAYS; array++) {
+        float *values = buffer->arrays + array * buffer->max;
+        failed |= fwrite(values, sizeof(float), num, trajectory.fp) != num;
+    }
+
+    if (failed) {
+        fprintf(stderr, "Error: failed writing trajectory '%s'\n", trajectory_path);
+        return -1;
+    }
+
+    trajectory.frames++;
+    trajectory.bytes += sizeof(frame) + frame.size;
+    return 0;
+}
+
+// writes the staged steps in turn until closed, encoding happens here so
+// the steps only pay for the copy
+static void *write_frames(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&trajectory.lock);
+
+    for (;;) {
+        struct trajectory_buffer *buffer = &trajectory.buffers[trajectory.writing];
+
+        while (buffer->full == 0 && trajectory.closing == 0) {
+            pthread_cond_wait(&trajectory.filled, &trajectory.lock);
+        }
+
+        if (buffer->full == 0) {
+            break;
+        }
+
+        pthread_mutex_unlock(&trajectory.lock);
+        int result = (trajectory.failed == 0) ? write_frame(buffer) : 0;
+        pthread_mutex_lock(&trajectory.lock);
+
+        if (result == -1) {
+            trajectory.failed = 1;
+        }
+
+        buffer->full = 0;
+        trajectory.writing = (trajectory.writing + 1) % TRAJECTORY_BUFFERS;
+        pthread_cond_signal(&trajectory.emptied);
+    }
+
+    pthread_mutex_unlock(&trajectory.lock);
+    return NULL;
+}
+
+int trajectory_open(float dt) {
+    trajectory.fp = fopen(trajectory_path, "wb");
+    if (trajectory.fp == NULL) {
+        fprintf(stderr, "Error: cannot open trajectory '%s' for writing\n", trajectory_path);
+        return -1;
+    }
+
+    setvbuf(trajectory.fp, NULL, _IOFBF, TRAJECTORY_STREAM_BUFFER);
+
+    struct trajectory_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+    header.version = TRAJECTORY_VERSION;
+    header.encoding = trajectory_encoding;
+    header.interval = trajectory_interval;
+    header.dt = dt;
+
+    if (fwrite(&header, sizeof(header), 1, trajectory.fp) != 1) {
+        fprintf(stderr, "Error: failed writing trajectory '%s'\n", trajectory_path);
+        fclose(trajectory.fp);
+        return -1;
+    }
+
+    trajectory.bytes = sizeof(header);
+
+    if (pthread_create(&trajectory.writer, NULL, write_frames, NULL) != 0) {
+        fprintf(stderr, "Error: failed starting the trajectory writer\n");
+        fclose(trajectory.fp);
+        return -1;
+    }
+
+    fprintf(stdout, "Status: writing %s trajectory frames every %ld steps to '%s'\n",
+            (trajectory_encoding == TRAJECTORY_QUANTIZED) ? "quantized" : "float", trajectory_interval, trajectory_path);
+    return 0;
+}
+
+// copy the bodies into the staging buffer of the writer, waits only if the
+// writer is still busy with the buffer from two frames ago
+int record_trajectory(long step) {
+    if (trajectory.fp == NULL || step % trajectory_interval != 0) {
+        return 0;
+    }
+
+    struct trajectory_buffer *buffer = &trajectory.buffers[trajectory.filling];
+
+    pthread_mutex_lock(&trajectory.lock);
+    if (buffer->full == 1) {
+        double start = now();
+        while (buffer->full == 1) {
+            pthread_cond_wait(&trajectory.emptied, &trajectory.lock);
+        }
+        trajectory.waited += now() - start;
+    }
+    int failed = trajectory.failed;
+    pthread_mutex_unlock(&trajectory.lock);
+
+    if (failed == 1) {
+        return -1;
+    }
+
+    if (bodies.num > buffer->max) {
+        float *arrays = (float *) reallocarray(buffer->arrays, bodies.num * (TRAJECTORY_ARRAYS + TRAJECTORY_FLOAT_ARRAYS), sizeof(float));
+        if (arrays != NULL) {
+            buffer->arrays = arrays;
+        }
+
+        int64_t *ids = (int64_t *) reallocarray(buffer->ids, bodies.num, sizeof(int64_t));
+        if (ids != NULL) {
+            buffer->ids = ids;
+        }
+
+        if (arrays == NULL || ids == NULL) {
+            fprintf(stderr, "Error: failed allocating memory for trajectory staging\n");
+            return -1;
+        }
+
+        buffer->max = bodies.num;
+    }
+
+    float *arrays[] = { bodies.x, bodies.y, bodies.z, bodies.vx, bodies.vy, bodies.vz, bodies.mass };
+    for (int array = 0; array < TRAJECTORY_ARRAYS + 1; array++) {
+        memcpy(buffer->arrays + array * buffer->max, arrays[array], bodies.num * sizeof(float));
+    }
+
+    for (long i = 0; i < bodies.num; i++) {
+        buffer->ids[i] = bodies.id[i];
+    }
+
+    // bodies without an object, as in headless runs, are drawn at scale one
+    float *scales = buffer->arrays + (TRAJECTORY_ARRAYS + 1) * buffer->max;
+    for (long i = 0; i < bodies.num; i++) {
+        scales[i] = 1.0f;
+    }
+
+    for (struct object *obj = first_object(); obj != NULL; obj = next_object(obj)) {
+        scales[obj->body] = obj->scale;
+    }
+
+    buffer->bodies_num = bodies.num;
+    buffer->step = step;
+
+    pthread_mutex_lock(&trajectory.lock);
+    buffer->full = 1;
+    pthread_cond_signal(&trajectory.filled);
+    pthread_mutex_unlock(&trajectory.lock);
+
+    trajectory.filling = (trajectory.filling + 1) % TRAJECTORY_BUFFERS;
+    return 0;
+}
+
+// write the staged frames and close the file
+int trajectory_close(void) {
+    if (trajectory.fp == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&trajectory.lock);
+    trajectory.closing = 1;
+    pthread_cond_signal(&trajectory.filled);
+    pthread_mutex_unlock(&trajectory.lock);
+
+    pthread_join(trajectory.writer, NULL);
+
+    if (fclose(trajectory.fp) != 0) {
+        fprintf(stderr, "Error: failed writing trajectory '%s'\n", trajectory_path);
+        trajectory.failed = 1;
+    }
+
+    trajectory.fp = NULL;
+    fprintf(stdout, "Status: wrote %ld trajectory frames (%.1f MB) to '%s', steps waited %.3f s for the writer\n",
+            trajectory.frames, trajectory.bytes / 1e6, trajectory_path, trajectory.waited);
+
+    for (int i = 0; i < TRAJECTORY_BUFFERS; i++) {
+        free(trajectory.buffers[i].arrays);
+        free(trajectory.buffers[i].ids);
+    }
+    free(trajectory.quantized);
+
+    return (trajectory.failed == 0) ? 0 : -1;
+}
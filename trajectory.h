@@ -0,0 +1,90 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRAJECTORY_MAGIC "GRVTRAJ"
+#define TRAJECTORY_FRAME_MAGIC "FRAM"
+#define TRAJECTORY_VERSION 2
+#define TRAJECTORY_BUFFERS 2 // staging, one filled by the steps while the other is written
+#define TRAJECTORY_ARRAYS 6 // x, y, z, vx, vy, vz, in the encoding of the frame
+#define TRAJECTORY_FLOAT_ARRAYS 2 // mass and scale, always floats
+#define TRAJECTORY_BODY_SIZE (sizeof(int64_t) + TRAJECTORY_FLOAT_ARRAYS * sizeof(float)) // id, mass and scale
+#define TRAJECTORY_QUANTIZED_MAX 65535
+#define TRAJECTORY_STREAM_BUFFER (1 << 20)
+
+enum trajectory_encoding {
+    TRAJECTORY_FLOAT, // the arrays as they are
+    TRAJECTORY_QUANTIZED, // 16 bits per value over the range of its array in the frame
+};
+
+// the file header is followed by one frame per recorded step, a frame
+// header and the arrays of all bodies in their order at that step: the
+// encoded arrays, then the ids as int64 and the masses and scales as
+// floats. a body keeps its id across merges that compact the others, ids
+// increase within a frame.
+struct trajectory_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t encoding;
+
+    int64_t interval; // steps between frames
+    float dt;
+    uint32_t reserved;
+};
+
+struct trajectory_frame {
+    char magic[4];
+    uint32_t encoding;
+
+    int64_t step;
+    int64_t bodies_num;
+    int64_t size; // bytes of the arrays that follow
+
+    // quantized values decode to minimum + value * scale
+    float minimum[TRAJECTORY_ARRAYS];
+    float scale[TRAJECTORY_ARRAYS];
+};
+
+struct trajectory_buffer {
+    float *arrays; // TRAJECTORY_ARRAYS and then TRAJECTORY_FLOAT_ARRAYS arrays of max values each
+    int64_t *ids;
+    long max;
+    long bodies_num;
+    long step;
+    int full; // waiting for the writer
+};
+
+struct trajectory {
+    FILE *fp;
+    struct trajectory_buffer buffers[TRAJECTORY_BUFFERS];
+    int filling; // buffer the next recorded step goes to
+    int writing; // buffer the writer takes next
+
+    uint16_t *quantized; // encoded arrays of the writer
+    long quantized_max;
+
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t emptied;
+    pthread_t writer;
+    int closing;
+    int failed;
+
+    long frames; // written
+    long bytes;
+    double waited; // seconds the steps waited for the writer
+};
+
+extern const char *trajectory_path;
+extern long trajectory_interval;
+extern enum trajectory_encoding trajectory_encoding;
+
+int select_trajectory_encoding(const char *name);
+int trajectory_open(float dt);
+int record_trajectory(long step);
+int trajectory_close(void);
+
+#endif
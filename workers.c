@@ -0,0 +1,98 @@
+#include "workers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static int threads_num = 1;
+
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workers_done = PTHREAD_COND_INITIALIZER;
+static unsigned long generation;
+static int remaining;
+
+static worker_task current_task;
+static void *current_arg;
+
+static void *worker(void *arg) {
+    int thread = (int) (long) arg;
+    unsigned long seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&workers_lock);
+        while (generation == seen) {
+            pthread_cond_wait(&workers_start, &workers_lock);
+        }
+
+        seen = generation;
+        worker_task task = current_task;
+        void *task_arg = current_arg;
+        pthread_mutex_unlock(&workers_lock);
+
+        task(task_arg, thread, threads_num);
+
+        pthread_mutex_lock(&workers_lock);
+        remaining--;
+        if (remaining == 0) {
+            pthread_cond_signal(&workers_done);
+        }
+        pthread_mutex_unlock(&workers_lock);
+    }
+
+    return NULL;
+}
+
+// start the pool, 0 threads means one per online cpu
+int workers_init(int threads) {
+    if (threads <= 0) {
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if (threads <= 0) {
+        threads = 1;
+    }
+
+    // the calling thread is worker 0
+    for (int i = 1; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, (void *) (long) i) != 0) {
+            fprintf(stderr, "Error: failed creating worker thread\n");
+            return -1;
+        }
+
+        pthread_detach(thread);
+    }
+
+    threads_num = threads;
+    return 0;
+}
+
+int workers_num(void) {
+    return threads_num;
+}
+
+// run task on all workers and wait for every one of them to finish
+void workers_run(worker_task task, void *arg) {
+    if (threads_num == 1) {
+        task(arg, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&workers_lock);
+    current_task = task;
+    current_arg = arg;
+    remaining = threads_num - 1;
+    generation++;
+    pthread_cond_broadcast(&workers_start);
+    pthread_mutex_unlock(&workers_lock);
+
+    task(arg, 0, threads_num);
+
+    pthread_mutex_lock(&workers_lock);
+    while (remaining > 0) {
+        pthread_cond_wait(&workers_done, &workers_lock);
+    }
+    pthread_mutex_unlock(&workers_lock);
+}
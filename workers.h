@@ -0,0 +1,11 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+// task run by every worker, thread is in [0, threads)
+typedef void (*worker_task)(void *arg, int thread, int threads);
+
+int workers_init(int threads);
+int workers_num(void);
+void workers_run(worker_task task, void *arg);
+
+#endif